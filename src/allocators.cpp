@@ -66,3 +66,51 @@ LockedPageManager::LockedPageManager() : LockedPageManagerBase<MemoryPageLocker>
 {
 }
 
+CBufferPool* CBufferPool::_instance = NULL;
+boost::once_flag CBufferPool::init_flag = BOOST_ONCE_INIT;
+
+void CBufferPool::Get(std::vector<char>& buf)
+{
+    std::vector<char> vchSpare;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (vBuffers.empty())
+            return;
+        vchSpare.swap(vBuffers.back());
+        vBuffers.pop_back();
+        nBytes -= vchSpare.capacity();
+    }
+    buf.swap(vchSpare);
+}
+
+void CBufferPool::Release(std::vector<char>& buf)
+{
+    size_t nCapacity = buf.capacity();
+    if (nCapacity == 0)
+        return;
+    if (nCapacity <= MAX_BUFFER_SIZE) {
+        buf.clear();
+        boost::mutex::scoped_lock lock(mutex);
+        if (vBuffers.size() < MAX_BUFFERS && nBytes + nCapacity <= MAX_BYTES) {
+            vBuffers.push_back(std::vector<char>());
+            vBuffers.back().swap(buf);
+            nBytes += nCapacity;
+            return;
+        }
+    }
+    // Not worth keeping: free it outside the lock
+    std::vector<char>().swap(buf);
+}
+
+size_t CBufferPool::GetCount()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return vBuffers.size();
+}
+
+size_t CBufferPool::GetBytes()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return nBytes;
+}
+
@@ -10,6 +10,7 @@
 #include <map>
 #include <string>
 #include <string.h>
+#include <vector>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
@@ -253,4 +254,50 @@ struct zero_after_free_allocator : public std::allocator<T>
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
+/**
+ * Thread-safe cache of spare byte buffers, so that the serialization buffers
+ * made and dropped for every network message and database record reuse
+ * memory that has already grown to size instead of going back to the heap.
+ * Only for data that is not secret: buffers are cleared, not wiped.
+ */
+class CBufferPool
+{
+public:
+    // Buffers cached at most, and the bytes they may hold in all
+    static const size_t MAX_BUFFERS = 128;
+    static const size_t MAX_BYTES = 16 * 1024 * 1024;
+    // Larger buffers (blocks) are rare enough to be freed
+    static const size_t MAX_BUFFER_SIZE = 1024 * 1024;
+
+    static CBufferPool& Instance()
+    {
+        boost::call_once(CBufferPool::CreateInstance, CBufferPool::init_flag);
+        return *CBufferPool::_instance;
+    }
+
+    // Hand buf an empty cached buffer, if there is one; what buf held is freed
+    void Get(std::vector<char>& buf);
+    // Take the memory of buf into the cache, leaving buf empty
+    void Release(std::vector<char>& buf);
+
+    size_t GetCount();
+    size_t GetBytes();
+
+private:
+    boost::mutex mutex;
+    std::vector<std::vector<char> > vBuffers;
+    size_t nBytes;
+
+    CBufferPool() : nBytes(0) {}
+
+    static void CreateInstance()
+    {
+        static CBufferPool instance;
+        CBufferPool::_instance = &instance;
+    }
+
+    static CBufferPool* _instance;
+    static boost::once_flag init_flag;
+};
+
 #endif
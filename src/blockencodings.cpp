@@ -0,0 +1,146 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+#include <map>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nNonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        header(block)
+{
+    FillShortTxIDSelector();
+    // The coinbase is never in a mempool
+    vPrefilledTxn.push_back(CPrefilledTransaction(0, block.vtx[0]));
+    vShortTxIds.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIds.push_back(GetShortID(block.vMerkleTree.size() > i ? block.vMerkleTree[i] : block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    // Keyed by the block and a per-announcement nonce, so that nobody can
+    // make transactions whose short ids collide for every announcement
+    CHashWriter ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hashKey = ss.GetHash();
+    nShortIdK0 = hashKey.Get64(0);
+    nShortIdK1 = hashKey.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIdK0, nShortIdK1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIds.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+    // Every transaction takes at least 60 bytes of a block
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+    nPrefilled = nMempool = 0;
+
+    for (unsigned int i = 0; i < cmpctblock.vPrefilledTxn.size(); i++) {
+        const CPrefilledTransaction& prefilled = cmpctblock.vPrefilledTxn[i];
+        if (prefilled.index >= vtx.size() || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+        nPrefilled++;
+    }
+
+    // Short ids, in order, go to the positions not taken by prefilled ones
+    map<uint64_t, uint16_t> mapShortIds;
+    unsigned int nIndex = 0;
+    for (unsigned int i = 0; i < cmpctblock.vShortTxIds.size(); i++) {
+        while (nIndex < vHave.size() && vHave[nIndex])
+            nIndex++;
+        if (nIndex == vHave.size())
+            return READ_STATUS_INVALID;
+        // Two transactions of the block with the same short id: the block
+        // cannot be rebuilt reliably
+        if (!mapShortIds.insert(make_pair(cmpctblock.vShortTxIds[i], nIndex)).second)
+            return READ_STATUS_FAILED;
+        nIndex++;
+    }
+
+    // Positions matched by more than one mempool transaction
+    vector<bool> vAmbiguous(vtx.size(), false);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+            map<uint64_t, uint16_t>::const_iterator itId = mapShortIds.find(cmpctblock.GetShortID(it->first));
+            if (itId == mapShortIds.end())
+                continue;
+            uint16_t nPos = itId->second;
+            if (vAmbiguous[nPos])
+                continue;
+            if (vHave[nPos]) {
+                // Leave it to getblocktxn
+                vtx[nPos] = CTransaction();
+                vHave[nPos] = false;
+                vAmbiguous[nPos] = true;
+                nMempool--;
+                continue;
+            }
+            vtx[nPos] = it->second.GetTx();
+            vHave[nPos] = true;
+            nMempool++;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized compact block %s: %u transactions, %u prefilled, %u from mempool\n",
+             cmpctblock.header.GetHash().ToString(), vtx.size(), nPrefilled, nMempool);
+    return READ_STATUS_OK;
+}
+
+bool CPartiallyDownloadedBlock::IsTxAvailable(size_t nIndex) const
+{
+    assert(nIndex < vHave.size());
+    return vHave[nIndex];
+}
+
+ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx.resize(vtx.size());
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = vtx[i];
+        } else {
+            if (nMissing >= vtxMissing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtxMissing[nMissing++];
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A wrong mempool match (a short id collision) shows up as a wrong
+    // merkle root. That is no fault of the peer, and not a reason to mark
+    // the block invalid either: fetch it in full instead.
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Rebuilt block %s: %u transactions, %u prefilled, %u from mempool, %u requested\n",
+             header.GetHash().ToString(), vtx.size(), nPrefilled, nMempool, vtxMissing.size());
+    return READ_STATUS_OK;
+}
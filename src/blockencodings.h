@@ -0,0 +1,225 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKENCODINGS_H
+#define BITMARK_BLOCKENCODINGS_H
+
+#include "core.h"
+#include "serialize.h"
+
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Compact block relay: a new block is sent as its header (with the auxpow,
+ * which can be large for merge-mined blocks), a 6-byte short id per
+ * transaction and the few transactions the receiver surely lacks (the
+ * coinbase). The receiver rebuilds the block from its mempool and asks for
+ * what is missing with getblocktxn. */
+
+/** Compact block format version carried in sendcmpct */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Serve getdata for compact blocks as cmpctblock only this close to the tip;
+ * older blocks are unlikely to be in the peer's mempool, and go in full */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Answer getblocktxn only for blocks this close to the tip */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to push new blocks without an inv round-trip */
+static const unsigned int MAX_HB_CMPCT_PEERS = 3;
+
+/** A transaction sent in full within a compact block */
+class CPrefilledTransaction
+{
+public:
+    // Position in the block; sent as the difference to the previous
+    // prefilled transaction's position, minus one
+    uint16_t index;
+    CTransaction tx;
+
+    CPrefilledTransaction() : index(0) {}
+    CPrefilledTransaction(uint16_t indexIn, const CTransaction& txIn) : index(indexIn), tx(txIn) {}
+};
+
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIdK0, nShortIdK1;
+    uint64_t nNonce;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<uint64_t> vShortTxIds;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    // For deserialization
+    CBlockHeaderAndShortTxIDs() : nShortIdK0(0), nShortIdK1(0), nNonce(0) {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return vShortTxIds.size() + vPrefilledTxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(header, nType, nVersion) + sizeof(nNonce);
+        nSize += GetSizeOfCompactSize(vShortTxIds.size()) + vShortTxIds.size() * SHORTTXIDS_LENGTH;
+        nSize += GetSizeOfCompactSize(vPrefilledTxn.size());
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+            nSize += GetSizeOfCompactSize(vPrefilledTxn[i].index) + ::GetSerializeSize(vPrefilledTxn[i].tx, nType, nVersion);
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nNonce, nType, nVersion);
+        WriteCompactSize(s, vShortTxIds.size());
+        for (unsigned int i = 0; i < vShortTxIds.size(); i++) {
+            uint32_t nLsb = vShortTxIds[i] & 0xffffffff;
+            uint16_t nMsb = (vShortTxIds[i] >> 32) & 0xffff;
+            ::Serialize(s, nLsb, nType, nVersion);
+            ::Serialize(s, nMsb, nType, nVersion);
+        }
+        WriteCompactSize(s, vPrefilledTxn.size());
+        int nLastIndex = -1;
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++) {
+            WriteCompactSize(s, vPrefilledTxn[i].index - nLastIndex - 1);
+            nLastIndex = vPrefilledTxn[i].index;
+            ::Serialize(s, vPrefilledTxn[i].tx, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nNonce, nType, nVersion);
+
+        uint64_t nShortIds = ReadCompactSize(s);
+        if (nShortIds > 0xffff)
+            throw std::ios_base::failure("too many short transaction ids");
+        vShortTxIds.resize(nShortIds);
+        for (unsigned int i = 0; i < vShortTxIds.size(); i++) {
+            uint32_t nLsb;
+            uint16_t nMsb;
+            ::Unserialize(s, nLsb, nType, nVersion);
+            ::Unserialize(s, nMsb, nType, nVersion);
+            vShortTxIds[i] = ((uint64_t)nMsb << 32) | nLsb;
+        }
+
+        uint64_t nPrefilled = ReadCompactSize(s);
+        if (nPrefilled > 0xffff)
+            throw std::ios_base::failure("too many prefilled transactions");
+        vPrefilledTxn.resize(nPrefilled);
+        uint64_t nIndex = 0;
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++) {
+            nIndex += ReadCompactSize(s) + (i ? 1 : 0);
+            if (nIndex > 0xffff)
+                throw std::ios_base::failure("prefilled transaction index overflowed");
+            vPrefilledTxn[i].index = nIndex;
+            ::Unserialize(s, vPrefilledTxn[i].tx, nType, nVersion);
+        }
+
+        FillShortTxIDSelector();
+    }
+};
+
+/** getblocktxn: positions of the transactions missing from a compact block */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> vIndexes; // absolute here, differential on the wire
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = sizeof(blockhash) + GetSizeOfCompactSize(vIndexes.size());
+        int nLastIndex = -1;
+        for (unsigned int i = 0; i < vIndexes.size(); i++) {
+            nSize += GetSizeOfCompactSize(vIndexes[i] - nLastIndex - 1);
+            nLastIndex = vIndexes[i];
+        }
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, vIndexes.size());
+        int nLastIndex = -1;
+        for (unsigned int i = 0; i < vIndexes.size(); i++) {
+            WriteCompactSize(s, vIndexes[i] - nLastIndex - 1);
+            nLastIndex = vIndexes[i];
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        if (nCount > 0xffff)
+            throw std::ios_base::failure("too many transaction indexes");
+        vIndexes.resize(nCount);
+        uint64_t nIndex = 0;
+        for (unsigned int i = 0; i < vIndexes.size(); i++) {
+            nIndex += ReadCompactSize(s) + (i ? 1 : 0);
+            if (nIndex > 0xffff)
+                throw std::ios_base::failure("transaction index overflowed");
+            vIndexes[i] = nIndex;
+        }
+    }
+};
+
+/** blocktxn: the transactions asked for by getblocktxn, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // the peer sent something malformed
+    READ_STATUS_FAILED,  // could not rebuild the block (a short id collision); get it in full
+};
+
+/** A block being rebuilt from a compact block and the mempool */
+class CPartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+    unsigned int nPrefilled, nMempool;
+
+public:
+    CBlockHeader header;
+
+    CPartiallyDownloadedBlock() : nPrefilled(0), nMempool(0) {}
+
+    // Place the prefilled transactions, then whatever the mempool has
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(size_t nIndex) const;
+    size_t BlockTxCount() const { return vtx.size(); }
+    // Fill in the missing transactions, in order, and check the merkle root
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
+#endif // BITMARK_BLOCKENCODINGS_H
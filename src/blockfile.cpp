@@ -0,0 +1,171 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "chainparams.h"
+#include "core.h"
+#include "serialize.h"
+#include "sync.h"
+#include "util.h"
+
+#include <list>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+bool fMapBlockFiles = DEFAULT_MMAP_BLOCK_FILES;
+
+/** A whole blk/rev file mapped read-only. Unmapped when the last reference
+ * (the cache or a CBlockFileView) goes away. */
+class CMappedBlockFile
+{
+public:
+    char chPrefix; // 'b' or 'r'
+    int nFile;
+    const char* pData;
+    size_t nLength;
+
+    CMappedBlockFile(char chPrefixIn, int nFileIn, const char* pDataIn, size_t nLengthIn) :
+        chPrefix(chPrefixIn), nFile(nFileIn), pData(pDataIn), nLength(nLengthIn) {}
+
+    ~CMappedBlockFile()
+    {
+#ifndef WIN32
+        munmap((void*)pData, nLength);
+#endif
+    }
+
+private:
+    CMappedBlockFile(const CMappedBlockFile&);
+    void operator=(const CMappedBlockFile&);
+};
+
+namespace {
+
+CCriticalSection cs_mapped;
+// Most recently used first
+list<boost::shared_ptr<CMappedBlockFile> > listMapped;
+
+#ifndef WIN32
+boost::shared_ptr<CMappedBlockFile> MapFile(const char* pszPrefix, int nFile)
+{
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), pszPrefix);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return boost::shared_ptr<CMappedBlockFile>();
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrint("mmap", "MapFile : cannot map %s\n", path.string());
+        return boost::shared_ptr<CMappedBlockFile>();
+    }
+    return boost::shared_ptr<CMappedBlockFile>(new CMappedBlockFile(pszPrefix[0], nFile, (const char*)p, st.st_size));
+}
+#endif
+
+// Return a mapping of the file that covers at least the first nEnd bytes,
+// remapping it if the file has grown since it was mapped.
+boost::shared_ptr<CMappedBlockFile> GetMapping(const char* pszPrefix, int nFile, size_t nEnd)
+{
+    boost::shared_ptr<CMappedBlockFile> mapping;
+#ifndef WIN32
+    LOCK(cs_mapped);
+    for (list<boost::shared_ptr<CMappedBlockFile> >::iterator it = listMapped.begin(); it != listMapped.end(); ++it) {
+        if ((*it)->chPrefix == pszPrefix[0] && (*it)->nFile == nFile) {
+            mapping = *it;
+            listMapped.erase(it);
+            break;
+        }
+    }
+    if (!mapping || mapping->nLength < nEnd)
+        mapping = MapFile(pszPrefix, nFile);
+    if (!mapping)
+        return mapping;
+    listMapped.push_front(mapping);
+    while (listMapped.size() > MAX_MAPPED_BLOCK_FILES)
+        listMapped.pop_back();
+    if (mapping->nLength < nEnd)
+        mapping.reset();
+#endif
+    return mapping;
+}
+
+} // namespace
+
+bool MapBlockFileRecord(const CDiskBlockPos& pos, const char* pszPrefix, unsigned int nTrailer, CBlockFileView& view)
+{
+    if (!fMapBlockFiles || pos.IsNull())
+        return false;
+
+    // Every record is preceded by the network magic and its size
+    static const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (pos.nPos < nHeaderSize)
+        return false;
+    boost::shared_ptr<CMappedBlockFile> mapping = GetMapping(pszPrefix, pos.nFile, pos.nPos);
+    if (!mapping)
+        return false;
+
+    const char* pHeader = mapping->pData + pos.nPos - nHeaderSize;
+    if (memcmp(pHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("MapBlockFileRecord : no record header at %s%05u.dat:%u", pszPrefix, pos.nFile, pos.nPos);
+    unsigned int nSize;
+    memcpy(&nSize, pHeader + MESSAGE_START_SIZE, sizeof(nSize));
+    if (nSize > MAX_SIZE)
+        return error("MapBlockFileRecord : record size %u too large at %s%05u.dat:%u", nSize, pszPrefix, pos.nFile, pos.nPos);
+
+    size_t nEnd = (size_t)pos.nPos + nSize + nTrailer;
+    if (nEnd > mapping->nLength) {
+        // Written after the file was mapped
+        mapping = GetMapping(pszPrefix, pos.nFile, nEnd);
+        if (!mapping)
+            return false;
+    }
+
+    view.mapping = mapping;
+    view.pbegin = mapping->pData + pos.nPos;
+    view.pend = mapping->pData + nEnd;
+    return true;
+}
+
+void PrefetchBlockFile(const CDiskBlockPos& pos, const char* pszPrefix, unsigned int nBytes)
+{
+#if !defined(WIN32) && defined(MADV_WILLNEED)
+    if (!fMapBlockFiles || pos.IsNull() || nBytes == 0)
+        return;
+    boost::shared_ptr<CMappedBlockFile> mapping = GetMapping(pszPrefix, pos.nFile, pos.nPos);
+    if (!mapping || pos.nPos >= mapping->nLength)
+        return;
+    static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+    size_t nStart = pos.nPos & ~(nPageSize - 1);
+    size_t nEnd = std::min((size_t)pos.nPos + nBytes, mapping->nLength);
+    madvise((void*)(mapping->pData + nStart), nEnd - nStart, MADV_WILLNEED);
+#endif
+}
+
+void UnmapBlockFile(int nFile)
+{
+    LOCK(cs_mapped);
+    for (list<boost::shared_ptr<CMappedBlockFile> >::iterator it = listMapped.begin(); it != listMapped.end(); ) {
+        if ((*it)->nFile == nFile)
+            listMapped.erase(it++);
+        else
+            ++it;
+    }
+}
+
+void UnmapBlockFiles()
+{
+    LOCK(cs_mapped);
+    listMapped.clear();
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKFILE_H
+#define BITMARK_BLOCKFILE_H
+
+#include <stddef.h>
+
+#include <boost/shared_ptr.hpp>
+
+class CDiskBlockPos;
+
+/** Default for -mmapblocks */
+static const bool DEFAULT_MMAP_BLOCK_FILES = true;
+/** Maximum number of blk/rev files kept mapped at once */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 64 : 4;
+
+/** Read blocks and undo data through memory mappings of the blk/rev files
+ * instead of stdio. Reads fall back to stdio when a file cannot be mapped. */
+extern bool fMapBlockFiles;
+
+class CMappedBlockFile;
+
+/** One record (a block, or undo data plus its checksum) inside a mapped
+ * blk/rev file. The view holds a reference on the mapping, so its bytes stay
+ * valid even if the mapping is evicted from the cache meanwhile. */
+class CBlockFileView
+{
+public:
+    boost::shared_ptr<CMappedBlockFile> mapping;
+    const char* pbegin;
+    const char* pend;
+
+    CBlockFileView() : pbegin(NULL), pend(NULL) {}
+    size_t size() const { return pend - pbegin; }
+};
+
+/** Map the record stored at pos in the given file ("blk" or "rev"). The
+ * record length comes from the size field in front of it; nTrailer extra
+ * bytes after it (the undo checksum) are included in the view. Returns false
+ * if mapping is disabled or unavailable, in which case the caller reads the
+ * record with stdio instead. */
+bool MapBlockFileRecord(const CDiskBlockPos& pos, const char* pszPrefix, unsigned int nTrailer, CBlockFileView& view);
+
+/** Hint that nBytes starting at pos are about to be read, so the kernel can
+ * start reading them in (for rescans walking the chain in order). */
+void PrefetchBlockFile(const CDiskBlockPos& pos, const char* pszPrefix, unsigned int nBytes);
+
+/** Drop the cached mappings of blk/rev file nFile, e.g. before it is
+ * truncated or removed. Outstanding views keep their mapping alive. */
+void UnmapBlockFile(int nFile);
+
+/** Drop all cached mappings */
+void UnmapBlockFiles();
+
+#endif // BITMARK_BLOCKFILE_H
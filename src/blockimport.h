@@ -0,0 +1,199 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKIMPORT_H
+#define BITMARK_BLOCKIMPORT_H
+
+#include "chainparams.h"
+#include "main.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+/** Serialized bytes of the blocks the import pipeline holds at most */
+static const size_t DEFAULT_IMPORT_QUEUE_BYTES = 32 * 1024 * 1024;
+
+/** A block located in an import file, on its way through the pipeline */
+struct CImportBlock
+{
+    uint64_t nBlockPos;
+    unsigned int nSize; // serialized size, held against the queue's byte limit
+    std::vector<char> vchRaw; // serialized block, released once decoded
+    CBlock block;
+    bool fValid; // deserialized and proof of work checked
+    bool fDone;
+
+    CImportBlock(uint64_t nBlockPosIn, unsigned int nSizeIn) : nBlockPos(nBlockPosIn), nSize(nSizeIn), fValid(false), fDone(false) {}
+};
+
+/** Import pipeline for one block file:
+ *  - a reader thread locates blocks by their magic and size header and
+ *    copies out the raw bytes,
+ *  - a pool of workers deserializes them and checks the block hash against
+ *    its proof of work, which is where the CPU time goes,
+ *  - the caller takes the blocks back in file order (Pop) and connects them.
+ * The blocks between reader and caller are limited in number and in bytes.
+ */
+class CBlockImportPipeline
+{
+private:
+    FILE* file;
+    uint64_t nStartByte;
+    size_t nMaxQueued;
+    size_t nMaxQueuedBytes;
+    size_t nQueuedBytes;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;  // signals workers: block to decode or stop
+    boost::condition_variable condDone;  // signals Pop: block decoded or reader finished
+    boost::condition_variable condSpace; // signals the reader: room in the queue or stop
+    std::deque<boost::shared_ptr<CImportBlock> > queue;     // all blocks, in file order
+    std::deque<boost::shared_ptr<CImportBlock> > queueWork; // blocks not claimed by a worker
+    bool fReaderDone;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Reader()
+    {
+        try {
+            CBufferedFile blkdat(file, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            if (nStartByte)
+                blkdat.Seek(nStartByte);
+            uint64_t nRewind = blkdat.GetPos();
+            while (blkdat.good() && !blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (std::exception &e) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    boost::shared_ptr<CImportBlock> job(new CImportBlock(nBlockPos, nSize));
+                    job->vchRaw.resize(nSize);
+                    blkdat.read(&job->vchRaw[0], nSize);
+                    nRewind = blkdat.GetPos();
+
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    // A block larger than the byte limit still goes into an empty queue
+                    while (!fStop && !queue.empty() &&
+                           (queue.size() >= nMaxQueued || nQueuedBytes + nSize > nMaxQueuedBytes))
+                        condSpace.wait(lock);
+                    if (fStop)
+                        break;
+                    nQueuedBytes += nSize;
+                    queue.push_back(job);
+                    queueWork.push_back(job);
+                    condWork.notify_one();
+                } catch (std::exception &e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                }
+            }
+        } catch (std::exception &e) {
+            LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+        condDone.notify_all();
+    }
+
+    void Worker()
+    {
+        while (true) {
+            boost::shared_ptr<CImportBlock> job;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queueWork.empty())
+                    condWork.wait(lock);
+                if (fStop)
+                    return;
+                job = queueWork.front();
+                queueWork.pop_front();
+            }
+
+            try {
+                CMemoryReader reader(&job->vchRaw[0], &job->vchRaw[0] + job->vchRaw.size(), SER_DISK, CLIENT_VERSION);
+                reader >> job->block;
+                CValidationState state;
+                job->fValid = CheckBlockProofOfWork(job->block, state);
+            } catch (std::exception &e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            std::vector<char>().swap(job->vchRaw);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            job->fDone = true;
+            if (job == queue.front())
+                condDone.notify_all();
+        }
+    }
+
+public:
+    CBlockImportPipeline(FILE* fileIn, uint64_t nStartByteIn, int nThreads, size_t nMaxQueuedBytesIn = DEFAULT_IMPORT_QUEUE_BYTES) :
+        file(fileIn), nStartByte(nStartByteIn), nMaxQueued(16 * nThreads), nMaxQueuedBytes(nMaxQueuedBytesIn),
+        nQueuedBytes(0), fReaderDone(false), fStop(false)
+    {
+        threadGroup.create_thread(boost::bind(&CBlockImportPipeline::Reader, this));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImportPipeline::Worker, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condWork.notify_all();
+        condSpace.notify_all();
+        threadGroup.join_all();
+    }
+
+    // Wait for the next block in file order; NULL at the end of the file
+    boost::shared_ptr<CImportBlock> Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(queue.empty() ? fReaderDone : queue.front()->fDone)) {
+            // Wake up now and then so a shutdown request gets through
+            condDone.timed_wait(lock, boost::posix_time::milliseconds(100));
+            lock.unlock();
+            boost::this_thread::interruption_point();
+            lock.lock();
+        }
+        if (queue.empty())
+            return boost::shared_ptr<CImportBlock>();
+        boost::shared_ptr<CImportBlock> job = queue.front();
+        queue.pop_front();
+        nQueuedBytes -= job->nSize;
+        condSpace.notify_one();
+        return job;
+    }
+};
+
+#endif // BITMARK_BLOCKIMPORT_H
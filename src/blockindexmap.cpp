@@ -0,0 +1,91 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexmap.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <limits>
+
+static const size_t MIN_SLOTS = 1024;
+
+uint64_t CBlockIndexMap::Hash(const uint256& hash) const
+{
+    // Block hashes are already uniform, but peers choose which ones we look
+    // up, so mix in a per-process salt to keep probe chains unpredictable.
+    uint64_t h = (hash.Get64(0) ^ nSalt[0]) + (hash.Get64(1) ^ nSalt[1]);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t CBlockIndexMap::Find(const uint256& hash, uint64_t h) const
+{
+    const size_t nMask = vSlots.size() - 1;
+    const uint32_t nTag = (uint32_t)(h >> 32);
+    for (size_t i = h & nMask; ; i = (i + 1) & nMask) {
+        const Slot& slot = vSlots[i];
+        if (slot.pentry == NULL || (slot.nTag == nTag && slot.pentry->first == hash))
+            return i;
+    }
+}
+
+void CBlockIndexMap::Rehash(size_t nSlots)
+{
+    if (nSalt[0] == 0 && nSalt[1] == 0) {
+        nSalt[0] = GetRand(std::numeric_limits<uint64_t>::max());
+        nSalt[1] = GetRand(std::numeric_limits<uint64_t>::max()) | 1;
+    }
+
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    Slot empty = {0, NULL};
+    vSlots.assign(nSlots, empty);
+    for (size_t i = 0; i < vOld.size(); i++) {
+        if (vOld[i].pentry == NULL)
+            continue;
+        const size_t nMask = nSlots - 1;
+        size_t j = Hash(vOld[i].pentry->first) & nMask;
+        while (vSlots[j].pentry != NULL)
+            j = (j + 1) & nMask;
+        vSlots[j] = vOld[i];
+    }
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& value)
+{
+    // Keep the load factor at or below 3/4
+    if ((nSize + 1) * 4 > vSlots.size() * 3)
+        Rehash(std::max(MIN_SLOTS, vSlots.size() * 2));
+
+    uint64_t h = Hash(value.first);
+    size_t i = Find(value.first, h);
+    if (vSlots[i].pentry != NULL)
+        return std::make_pair(iterator(&vSlots[i], End()), false);
+
+    vSlots[i].nTag = (uint32_t)(h >> 32);
+    vSlots[i].pentry = arena.Allocate(value);
+    nSize++;
+    return std::make_pair(iterator(&vSlots[i], End()), true);
+}
+
+void CBlockIndexMap::reserve(size_t nCount)
+{
+    size_t nSlots = MIN_SLOTS;
+    while (nSlots * 3 < nCount * 4)
+        nSlots *= 2;
+    if (nSlots > vSlots.size())
+        Rehash(nSlots);
+}
+
+void CBlockIndexMap::clear()
+{
+    std::vector<Slot>().swap(vSlots);
+    arena.Clear();
+    nSize = 0;
+}
@@ -0,0 +1,212 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_BLOCKINDEXMAP_H
+#define BITMARK_BLOCKINDEXMAP_H
+
+#include "uint256.h"
+
+#include <iterator>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+
+/** Chunked allocator for objects that are only released all at once, such
+ * as block index entries. Objects are constructed in place in chunks of
+ * nChunkSize, so they never move and neighbours share cache lines and pages
+ * instead of being scattered over the heap one allocation each.
+ */
+template<typename T, size_t nChunkSize = 4096>
+class CArena
+{
+private:
+    std::vector<T*> vChunks;
+    size_t nUsed; // objects used in the last chunk
+
+    CArena(const CArena&);
+    void operator=(const CArena&);
+
+    void* Next()
+    {
+        if (vChunks.empty() || nUsed == nChunkSize) {
+            vChunks.push_back(static_cast<T*>(::operator new(sizeof(T) * nChunkSize)));
+            nUsed = 0;
+        }
+        return vChunks.back() + nUsed;
+    }
+
+public:
+    CArena() : nUsed(0) {}
+    ~CArena() { Clear(); }
+
+    T* Allocate()
+    {
+        T* p = new (Next()) T();
+        nUsed++;
+        return p;
+    }
+
+    template<typename A>
+    T* Allocate(const A& arg)
+    {
+        T* p = new (Next()) T(arg);
+        nUsed++;
+        return p;
+    }
+
+    size_t size() const
+    {
+        return vChunks.empty() ? 0 : (vChunks.size() - 1) * nChunkSize + nUsed;
+    }
+
+    // Destroy every object and release the memory
+    void Clear()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++) {
+            size_t nCount = (i + 1 == vChunks.size()) ? nUsed : nChunkSize;
+            for (size_t j = 0; j < nCount; j++)
+                vChunks[i][j].~T();
+            ::operator delete(vChunks[i]);
+        }
+        vChunks.clear();
+        nUsed = 0;
+    }
+};
+
+/** Hash map from block hash to CBlockIndex*, with the subset of the
+ * std::map interface that mapBlockIndex is used with (no erase).
+ *
+ * Open addressing with linear probing over a power-of-two slot table. Each
+ * slot holds a 32-bit tag of the salted hash, so a probe rarely has to
+ * look at the key, and a pointer to the entry. Entries live in an arena
+ * and never move, so CBlockIndex::phashBlock may point at their key.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+    typedef size_t size_type;
+
+private:
+    struct Slot
+    {
+        uint32_t nTag;
+        value_type* pentry; // NULL if empty
+    };
+
+    std::vector<Slot> vSlots;
+    size_t nSize;
+    uint64_t nSalt[2];
+    CArena<value_type> arena;
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    void operator=(const CBlockIndexMap&);
+
+    uint64_t Hash(const uint256& hash) const;
+    size_t Find(const uint256& hash, uint64_t h) const; // slot of hash, or the empty slot ending its probe
+    void Rehash(size_t nSlots);
+
+public:
+    template<typename V>
+    class iterator_base
+    {
+    private:
+        const Slot* pslot;
+        const Slot* pend;
+
+        void SkipEmpty()
+        {
+            while (pslot != pend && pslot->pentry == NULL)
+                ++pslot;
+        }
+
+        friend class CBlockIndexMap;
+        template<typename V2> friend class iterator_base;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        iterator_base() : pslot(NULL), pend(NULL) {}
+        iterator_base(const Slot* pslotIn, const Slot* pendIn) : pslot(pslotIn), pend(pendIn) {}
+        template<typename V2>
+        iterator_base(const iterator_base<V2>& other) : pslot(other.pslot), pend(other.pend) {}
+
+        V& operator*() const { return *pslot->pentry; }
+        V* operator->() const { return pslot->pentry; }
+        iterator_base& operator++() { ++pslot; SkipEmpty(); return *this; }
+        iterator_base operator++(int) { iterator_base ret = *this; ++*this; return ret; }
+        template<typename V2>
+        bool operator==(const iterator_base<V2>& other) const { return pslot == other.pslot; }
+        template<typename V2>
+        bool operator!=(const iterator_base<V2>& other) const { return pslot != other.pslot; }
+    };
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+    CBlockIndexMap() : nSize(0)
+    {
+        nSalt[0] = nSalt[1] = 0;
+    }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator begin()
+    {
+        iterator it(vSlots.empty() ? NULL : &vSlots[0], End());
+        it.SkipEmpty();
+        return it;
+    }
+    iterator end() { return iterator(End(), End()); }
+    const_iterator begin() const
+    {
+        const_iterator it(vSlots.empty() ? NULL : &vSlots[0], End());
+        it.SkipEmpty();
+        return it;
+    }
+    const_iterator end() const { return const_iterator(End(), End()); }
+
+    iterator find(const uint256& hash)
+    {
+        if (nSize == 0)
+            return end();
+        size_t i = Find(hash, Hash(hash));
+        return vSlots[i].pentry ? iterator(&vSlots[i], End()) : end();
+    }
+    const_iterator find(const uint256& hash) const
+    {
+        if (nSize == 0)
+            return end();
+        size_t i = Find(hash, Hash(hash));
+        return vSlots[i].pentry ? const_iterator(&vSlots[i], End()) : end();
+    }
+    size_t count(const uint256& hash) const { return find(hash) != end() ? 1 : 0; }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+    CBlockIndex*& operator[](const uint256& hash)
+    {
+        return insert(value_type(hash, (CBlockIndex*)NULL)).first->second;
+    }
+
+    // Make room for nCount entries without rehashing
+    void reserve(size_t nCount);
+    void clear();
+
+private:
+    const Slot* End() const { return vSlots.empty() ? NULL : &vSlots[0] + vSlots.size(); }
+};
+
+typedef CBlockIndexMap BlockMap;
+
+#endif // BITMARK_BLOCKINDEXMAP_H
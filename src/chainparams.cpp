@@ -64,6 +64,9 @@ public:
 
         nForkHeight2 = 518191;  // Fork #2 ForkHeight - Bitmark definitive v0.9.8.3 Release - Estimated: September 8 2018
 
+        // Block 446399, the last checkpoint
+        hashDefaultAssumeValid = uint256("0xf6d49ebc768025e300083d133d1bc1bf4e05b0878685c16237739d569cb9dcfe");
+
         // Build the Genesis block.
         const char* pszTimestamp = "13/July/2014, with memory of the past, we look to the future. TDR";
         CTransaction txNew;
@@ -167,6 +170,8 @@ public:
 
         nForkHeight2 = 2000; // Testnet 4  ForkHeight - for Fork #2 - Bitmark definitive v0.9.8.3 Release - Estimated: September 8 2018
 
+        hashDefaultAssumeValid = 0;
+
 	const char* pszTimestamp = "Fork 2 Testnet";
 	CTransaction txNew;
         txNew.vin.resize(1);
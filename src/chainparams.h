@@ -73,6 +73,8 @@ public:
     unsigned int EquihashN() const { return nEquihashN; }
     unsigned int EquihashK() const { return nEquihashK; }
     bool MineBlocksOnDemand() const { return fMineBlocksOnDemand; }
+    /** Default for -assumevalid: a block whose ancestors' scripts are known good */
+    const uint256& DefaultAssumeValid() const { return hashDefaultAssumeValid; }
 
     int64_t GetFork2Height() const { return nForkHeight2; }
     bool    OnFork2(int64_t blockHeight) const { return blockHeight >= nForkHeight2; }
@@ -110,6 +112,7 @@ protected:
     unsigned int nEquihashN = 0;
     unsigned int nEquihashK = 0;
     bool fMineBlocksOnDemand = true;
+    uint256 hashDefaultAssumeValid;
 
     int64_t nForkHeight2;
 };
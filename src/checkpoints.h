@@ -6,10 +6,11 @@
 #ifndef BITMARK_CHECKPOINT_H
 #define BITMARK_CHECKPOINT_H
 
+#include "blockindexmap.h"
+
 #include <map>
 
 class CBlockIndex;
-class uint256;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -23,7 +24,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     double GuessVerificationProgress(CBlockIndex *pindex, bool fSigchecks = true);
 
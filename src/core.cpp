@@ -7,6 +7,7 @@
 #include "core.h"
 #include "coins.h"
 
+#include "sha256.h"
 #include "util.h"
 #include "sync.h"
 
@@ -243,25 +244,57 @@ uint64_t CTxOutCompressor::DecompressAmount(uint64_t x)
     return n;
 }
 
+/** Hash one merkle tree level of nSize nodes into its (nSize + 1) / 2 parents.
+ *  Sibling pairs are adjacent in memory, so all complete pairs go to SHA256D64
+ *  in a single batch; an odd last node is paired with itself.  pparent may
+ *  alias pnode (used by ComputeMerkleRoot to reduce levels in place). */
+static void ComputeMerkleLevel(const uint256* pnode, size_t nSize, uint256* pparent)
+{
+    SHA256D64(pparent->begin(), pnode->begin(), nSize / 2);
+    if (nSize & 1) {
+        unsigned char pair[64];
+        memcpy(pair, pnode[nSize - 1].begin(), 32);
+        memcpy(pair + 32, pnode[nSize - 1].begin(), 32);
+        SHA256D64(pparent[nSize / 2].begin(), pair, 1);
+    }
+}
+
 uint256 CBlock::BuildMerkleTree() const
 {
-    vMerkleTree.clear();
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-        vMerkleTree.push_back(tx.GetHash());
-    int j = 0;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    // Size the whole tree up front so each level is written in place
+    size_t nTreeSize = vtx.size();
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nTreeSize += (nSize + 1) / 2;
+    vMerkleTree.resize(nTreeSize);
+    for (size_t i = 0; i < vtx.size(); i++)
+        vMerkleTree[i] = vtx[i].GetHash();
+    size_t j = 0;
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-        }
+        ComputeMerkleLevel(&vMerkleTree[j], nSize, &vMerkleTree[j + nSize]);
         j += nSize;
     }
     return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
 }
 
+uint256 CBlock::ComputeMerkleRoot() const
+{
+    std::vector<uint256> vHashes;
+    vHashes.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vHashes.push_back(tx.GetHash());
+    return ComputeMerkleRoot(vHashes);
+}
+
+uint256 CBlock::ComputeMerkleRoot(std::vector<uint256> vHashes)
+{
+    if (vHashes.empty())
+        return 0;
+    for (size_t nSize = vHashes.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        ComputeMerkleLevel(&vHashes[0], nSize, &vHashes[0]);
+    return vHashes[0];
+}
+
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
 {
     if (vMerkleTree.empty())
@@ -283,13 +316,18 @@ uint256 CBlock::CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMer
   //LogPrintf("in checkmerklebranch nIndex=%d\n",nIndex);
     if (nIndex == -1)
         return 0;
+    unsigned char pair[64];
     BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
     {
       //LogPrintf("otherside\n");
-        if (nIndex & 1)
-            hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
-        else
-            hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+        if (nIndex & 1) {
+            memcpy(pair, otherside.begin(), 32);
+            memcpy(pair + 32, hash.begin(), 32);
+        } else {
+            memcpy(pair, hash.begin(), 32);
+            memcpy(pair + 32, otherside.begin(), 32);
+        }
+        SHA256D64(hash.begin(), pair, 1);
         nIndex >>= 1;
     }
     return hash;
@@ -543,11 +581,16 @@ CAuxPow::getExpectedIndex(int nNonce, int nChainId, unsigned h)
     return rand % (1 << h);
 }
 
+boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix)
+{
+    return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+}
+
 FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
 {
     if (pos.IsNull())
         return NULL;
-    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
     boost::filesystem::create_directories(path.parent_path());
     FILE* file = fopen(path.string().c_str(), "rb+");
     if (!file && !fReadOnly)
@@ -582,6 +625,8 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "blk", fReadOnly);
 }
 
+bool fCheckBlockReads = false;
+
 bool CheckAuxPowProofOfWork(const CBlockHeader& block, const CChainParams& params)
 {
   int algo = block.GetAlgo();
@@ -649,6 +694,17 @@ bool CheckAuxPowProofOfWork(const CBlockHeader& block, const CChainParams& param
   return true;
 }
 
+bool CheckAuxPowLink(const CBlockHeader& block, const CChainParams& params)
+{
+  if (!block.auxpow)
+    return !block.IsAuxpow() || error("%s : no auxpow on block with auxpow version", __func__);
+  if (!block.IsAuxpow())
+    return error("%s : auxpow on block with non-auxpow version", __func__);
+  if (!block.auxpow->check(block.GetHash(), block.GetChainId(), params))
+    return error("%s : auxpow does not commit to block %s", __func__, block.GetHash().ToString());
+  return true;
+}
+
 // Based on tests with general purpose CPUs,
 //       ( Except for SHA256 which was designed for simplicity and suited for ASICs, 
 //       so given a factor of 16 decrease in weight. )
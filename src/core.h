@@ -756,6 +756,10 @@ public:
 
     uint256 BuildMerkleTree() const;
 
+    // Merkle root of vtx without building or touching vMerkleTree
+    uint256 ComputeMerkleRoot() const;
+    static uint256 ComputeMerkleRoot(std::vector<uint256> vHashes);
+
     const uint256 &GetTxHash(unsigned int nIndex) const {
         assert(vMerkleTree.size() > 0); // BuildMerkleTree must have been called first
         assert(nIndex < vtx.size());
@@ -786,12 +790,27 @@ enum BlockStatus {
     BLOCK_FAILED_MASK        =   96
 };
 
+/** Path of the blk ("blk") or undo ("rev") file holding pos */
+boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly);
 
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 
 bool CheckAuxPowProofOfWork(const CBlockHeader& block, const CChainParams& params);
 
+/** The merkle links of CheckAuxPowProofOfWork without the parent block's
+ * proof of work: the auxpow commits to this block and its coinbase is in
+ * the parent block. The block hash does not cover the auxpow, so this is
+ * what catches a damaged auxpow on disk. */
+bool CheckAuxPowLink(const CBlockHeader& block, const CChainParams& params);
+
+/** Re-verify the proof of work of blocks and headers read back from disk
+ * (-checkblockreads). Off by default: an indexed block passed
+ * CheckAuxPowProofOfWork when it was accepted, so reads of blocks at
+ * BLOCK_VALID_TREE or better only compare the header hash with the index
+ * and run CheckAuxPowLink. */
+extern bool fCheckBlockReads;
+
 unsigned int GetAlgoWeight (const int algo);
 
 static const int64_t nForkHeight = 200; // We set it in past so not really used for fork condition
@@ -810,9 +829,6 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    // pointer to the AuxPoW header, if this block has one
-    boost::shared_ptr<CAuxPow> pauxpow;
-
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -831,7 +847,7 @@ public:
     // Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    // Total amount of work (expected number of hashes) in the chain up to and including this block
     uint256 nChainWork;
 
     // Number of transactions in this block.
@@ -861,7 +877,6 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
-	pauxpow.reset();
         nHeight = 0;
         nMoneySupply = 0;
 	subsidyScalingFactor = 0;
@@ -919,6 +934,17 @@ public:
         return ret;
     }
 
+    // Whether the header was accepted into the tree (and its proof of work checked)
+    bool IsValidTree() const
+    {
+        return (nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TREE;
+    }
+
+    // The AuxPoW header, if this block has one. It is not kept in the index:
+    // it is read from the block tree database on demand, through a small
+    // cache of recently used entries (see main.cpp).
+    boost::shared_ptr<CAuxPow> GetAuxPow() const;
+
     bool onFork() const {
       if (this->nHeight >= nForkHeight && IsSuperMajority(4,this->pprev,75,100)) return true;
       return false;
@@ -927,7 +953,7 @@ public:
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
-	if (IsAuxpow() && onFork())
+	if (IsAuxpow() && onFork() && (nStatus & BLOCK_HAVE_DATA))
 	  {
 	    const CDiskBlockPos pos = GetBlockPos();
 	    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
@@ -939,7 +965,7 @@ public:
 	    catch (const std::exception& e) {
 	      LogPrintf("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), "");
 	    }
-	    if (!CheckAuxPowProofOfWork(block, Params()))
+	    if (fCheckBlockReads || !IsValidTree() ? !CheckAuxPowProofOfWork(block, Params()) : !CheckAuxPowLink(block, Params()))
 	      LogPrintf("ReadBlockFromDisk: Errors in block header at %s", "");
 	    if (block.GetHash() != GetBlockHash())
 	      LogPrintf("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -953,6 +979,12 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        // Block data pruned: the auxpow is still in the block tree db
+        if (IsAuxpow() && onFork()) {
+            block.nNonce256 = nNonce256;
+            block.nSolution = nSolution;
+            block.auxpow    = GetAuxPow();
+        }
         return block;
     }
 
@@ -1075,13 +1107,16 @@ class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
+    boost::shared_ptr<CAuxPow> pauxpow;
 
     CDiskBlockIndex() {
       SetNull();
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
+    explicit CDiskBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex) {
       hashPrev = (pprev ? pprev->GetBlockHash() : 0);
+      if (IsAuxpow())
+        pauxpow = pindex->GetAuxPow();
     }
 
     unsigned int GetSerializeSize(int nType, int nVersion) const \
@@ -1138,6 +1173,7 @@ public:
 	  }
 	  READWRITE(*pauxpow);
 	}
+	READWRITE(nChainWork);
         return nSerSize;                        \
     }                                           \
     template<typename Stream>                   \
@@ -1192,6 +1228,7 @@ public:
 	  }
 	  READWRITE(*pauxpow);
 	}
+	READWRITE(nChainWork);
     }                                           \
     template<typename Stream>                   \
     void Unserialize(Stream& s, int nType, int nVersion)  \
@@ -1248,6 +1285,12 @@ public:
 	} else {
 	  pauxpow.reset();
 	}
+	// nChainWork was appended later; records without it get it recomputed in LoadBlockIndexDB
+	if (!s.empty()) {
+	  READWRITE(nChainWork);
+	} else {
+	  nChainWork = 0;
+	}
     }
  
     void SetNull() {
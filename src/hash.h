@@ -191,6 +191,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value (its 32 bytes, little endian) under the
+ * key (k0, k1). Fast keyed hash for short transaction ids. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -17,6 +17,8 @@
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "sha256.h"
+#include "stratum.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -116,6 +118,7 @@ void Shutdown()
     RenameThread("bitmark-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    StopStratumServer();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -130,14 +133,15 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(chainActive.GetLocator());
 #endif
-        if (pblocktree)
-            pblocktree->Flush();
-        if (pcoinsTip)
-            pcoinsTip->Flush();
+        if (pcoinsTip && pblocktree) {
+            CValidationState state;
+            FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+        }
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
+    UnmapBlockFiles();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
@@ -148,7 +152,9 @@ void Shutdown()
     if (pwalletMain)
         delete pwalletMain;
 #endif
+    LogLockStats();
     LogPrintf("Shutdown : done\n");
+    FlushDebugLog();
 }
 
 //
@@ -194,9 +200,11 @@ std::string HelpMessage(HelpMessageMode hmm)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
+    strUsage += "  -assumevalid=<hex>     " + strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s)"), Params().DefaultAssumeValid().GetHex()) + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification of -checkblocks is (0-4, default: 3)") + "\n";
+    strUsage += "  -compressundo          " + strprintf(_("LZ-compress the undo data of new blocks (default: %u)"), DEFAULT_COMPRESS_UNDO) + "\n";
     strUsage += "  -conf=<file>           " + _("Specify configuration file (default: bitmark.conf)") + "\n";
     if (hmm == HMM_BITMARKD)
     {
@@ -206,11 +214,19 @@ std::string HelpMessage(HelpMessageMode hmm)
     }
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -dbflushinterval=<n>   " + strprintf(_("Write cached chainstate to disk at least every <n> seconds (default: %d)"), DEFAULT_DB_FLUSH_INTERVAL) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+#if !defined(WIN32)
+    strUsage += "  -mmapblocks            " + strprintf(_("Read blocks and undo data through memory-mapped block files (default: %u)"), DEFAULT_MMAP_BLOCK_FILES) + "\n";
+#endif
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: bitmarkd.pid)") + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Reduce storage requirements by deleting old blocks. This disables wallet rescans and is incompatible with -txindex. "
+                                                 "Going back to an unpruned node means downloading the whole block chain again. "
+                                                 "(default: 0 = keep all blocks, >%u = target size in MiB for block and undo files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024) + "\n";
+    strUsage += "  -prunedepth=<n>        " + strprintf(_("When pruning, always keep the files holding the last <n> blocks (minimum and default: %u)"), MIN_BLOCKS_TO_KEEP) + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
 
@@ -250,6 +266,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -paytxfee=<amt>        " + _("Fee per kB to add to transactions you send") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + " " + _("on startup") + "\n";
+    strUsage += "  -rescanthreads=<n>     " + strprintf(_("Number of threads reading and matching blocks during a rescan (0 = one per core, default: %d)"), DEFAULT_RESCAN_THREADS) + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup") + "\n";
     strUsage += "  -spendzeroconfchange   " + _("Spend unconfirmed change when sending transactions (default: 1)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
@@ -269,6 +286,9 @@ std::string HelpMessage(HelpMessageMode hmm)
         strUsage += "  -dropmessagestest=<n>  " + _("Randomly drop 1 of every <n> network messages") + "\n";
         strUsage += "  -fuzzmessagestest=<n>  " + _("Randomly fuzz 1 of every <n> network messages") + "\n";
         strUsage += "  -flushwallet           " + _("Run a thread to flush wallet periodically (default: 1)") + "\n";
+        strUsage += "  -checkblockreads       " + _("Re-verify the proof of work of every block read from disk (default: 0)") + "\n";
+        strUsage += "  -lockstats             " + _("Profile lock waits and hold times per LOCK site, see getlockstats (default: 0)") + "\n";
+        strUsage += "  -lockstatsinterval=<n> " + strprintf(_("Log the most contended lock sites every <n> seconds while profiling (0 = never, default: %d)"), DEFAULT_LOCKSTATS_INTERVAL) + "\n";
     }
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
@@ -283,6 +303,7 @@ std::string HelpMessage(HelpMessageMode hmm)
 #endif
     strUsage += "  -help-debug            " + _("Show all debugging options (usage: --help -help-debug)") + "\n";
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n";
+    strUsage += "  -logratelimit=<n>      " + strprintf(_("Log at most <n> messages per second for each debug category (0 = unlimited, default: %d)"), DEFAULT_LOG_RATE_LIMIT) + "\n";
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
@@ -315,7 +336,11 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 9266 or testnet: 19266)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service thread-safe RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORKQUEUE) + "\n";
+    strUsage += "  -rpckeepalive          " + _("Keep RPC connections open between requests (default: 1)") + "\n";
+    strUsage += "  -rpcservertimeout=<n>  " + strprintf(_("Close an RPC connection that sends no request for <n> seconds (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT) + "\n";
+    strUsage += "  -blocknotifyport=<port> " + _("Send the hash and height of each new best block to local connections on <port>") + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Bitmark Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -323,6 +348,14 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -rpcsslprivatekeyfile=<file.pem>         " + _("Server private key (default: server.pem)") + "\n";
     strUsage += "  -rpcsslciphers=<ciphers>                 " + _("Acceptable ciphers (default: TLSv1.2+HIGH:TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!3DES:@STRENGTH)") + "\n";
 
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratum               " + _("Serve mining jobs over the stratum protocol (default: 0)") + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Address blocks found through the stratum server pay to") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Listen for stratum connections on <addr> (default: 127.0.0.1)") + "\n";
+    strUsage += "  -stratumport=<port>    " + strprintf(_("Listen for stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT) + "\n";
+    strUsage += "  -stratumthreads=<n>    " + strprintf(_("Set the number of threads to serve stratum connections and check shares (default: %d)"), DEFAULT_STRATUM_THREADS) + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + _("Starting share difficulty, adjusted to the miner's rate unless it asks for d=<n> (default: 1)") + "\n";
+
     return strUsage;
 }
 
@@ -339,6 +372,34 @@ struct CImportingNow
     }
 };
 
+// -reindex with -prune: the reindex reads blk files from 0 up to the first
+// missing one, so remove the blk files after a gap, which it would never
+// read, and all rev files, which it rewrites. The block file info then
+// matches what is on disk again and later pruning accounts for it correctly.
+static void CleanupBlockRevFiles()
+{
+    LogPrintf("Removing unusable blk?????.dat and rev?????.dat files for -reindex with -prune\n");
+    map<int, filesystem::path> mapBlockFiles;
+    filesystem::path pathBlocks = GetDataDir() / "blocks";
+    for (filesystem::directory_iterator it(pathBlocks); it != filesystem::directory_iterator(); it++) {
+        string strName = it->path().filename().string();
+        if (!filesystem::is_regular_file(*it) || strName.size() != 12 || strName.substr(8, 4) != ".dat")
+            continue;
+        if (strName.substr(0, 3) == "blk")
+            mapBlockFiles[atoi(strName.substr(3, 5))] = it->path();
+        else if (strName.substr(0, 3) == "rev")
+            filesystem::remove(it->path());
+    }
+
+    int nContiguous = 0;
+    for (map<int, filesystem::path>::iterator it = mapBlockFiles.begin(); it != mapBlockFiles.end(); ++it) {
+        if (it->first == nContiguous)
+            nContiguous++;
+        else
+            filesystem::remove(it->second);
+    }
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("bitmark-loadblk");
@@ -356,6 +417,12 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file, &pos);
             nFile++;
         }
+        {
+            // Everything reindexed so far must be on disk before the flag goes
+            LOCK(cs_main);
+            CValidationState state;
+            FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+        }
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -539,9 +606,35 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
 
+    // -prune is a target in MiB for the blk/rev files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t)nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB. Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+#ifdef ENABLE_WALLET
+        if (GetBoolArg("-rescan", false))
+            return InitError(_("Rescans are not possible in pruned mode. You will need to use -reindex which will download the whole block chain again."));
+#endif
+        nPruneDepth = std::max(MIN_BLOCKS_TO_KEEP, (int)GetArg("-prunedepth", MIN_BLOCKS_TO_KEEP));
+        fPruneMode = true;
+        // Peers cannot download the historical chain from us any more
+        nLocalServices &= ~NODE_NETWORK;
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files, keeping the last %d blocks\n", nPruneTarget / 1024 / 1024, nPruneDepth);
+    }
+
     fBenchmark = GetBoolArg("-benchmark", false);
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
+    hashAssumeValid = uint256(GetArg("-assumevalid", Params().DefaultAssumeValid().GetHex()));
+    if (hashAssumeValid != 0)
+        LogPrintf("Assuming ancestors of block %s have valid signatures.\n", hashAssumeValid.GetHex());
+    else
+        LogPrintf("Validating signatures for all blocks.\n");
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -555,6 +648,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
+    fLockStats = GetBoolArg("-lockstats", false);
+    fCheckBlockReads = GetBoolArg("-checkblockreads", false);
+    fCompressUndo = GetBoolArg("-compressundo", DEFAULT_COMPRESS_UNDO);
+#if !defined(WIN32)
+    fMapBlockFiles = GetBoolArg("-mmapblocks", DEFAULT_MMAP_BLOCK_FILES);
+#else
+    fMapBlockFiles = false;
+#endif
     setvbuf(stdout, NULL, _IOLBF, 0);
 #ifdef ENABLE_WALLET
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
@@ -609,6 +710,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     strWalletFile = GetArg("-wallet", "wallet.dat");
 #endif
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
+    std::string strSHA256Impl = SHA256AutoDetect();
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. Bitmark Core is shutting down."));
 
@@ -631,6 +733,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Bitmark version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using SHA256 implementation %s\n", strSHA256Impl);
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -835,6 +938,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nDbFlushInterval = std::max((int64_t)1, GetArg("-dbflushinterval", DEFAULT_DB_FLUSH_INTERVAL));
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -855,8 +959,11 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
 
-                if (fReindex)
+                if (fReindex) {
                     pblocktree->WriteReindexing(true);
+                    if (fPruneMode)
+                        CleanupBlockRevFiles();
+                }
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -879,6 +986,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Blocks deleted by -prune can only come back by downloading them
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode. This will download the whole block chain again");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg("-checkblocks", 288))) {
@@ -933,7 +1046,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1047,13 +1160,30 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pindexRescan = chainActive.FindFork(locator);
             else
                 pindexRescan = chainActive.Genesis();
+            // Resume a rescan that was interrupted by a shutdown
+            if (walletdb.ReadRescanProgress(locator))
+            {
+                CBlockIndex *pindexResume = chainActive.FindFork(locator);
+                if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight)
+                    pindexRescan = pindexResume;
+            }
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
+            // The rescan needs every block since the wallet's last sync
+            if (fPruneMode) {
+                CBlockIndex *pindex = chainActive.Tip();
+                while (pindex && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA) && pindex != pindexRescan)
+                    pindex = pindex->pprev;
+                if (pindex != pindexRescan)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole block chain again)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            if (pwalletMain->ScanForWalletTransactions(pindexRescan, true) < 0)
+                return InitError(_("Error reading a block during the wallet rescan. You need to -reindex."));
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(chainActive.GetLocator());
             nWalletDBUpdated++;
@@ -1112,10 +1242,18 @@ bool AppInit2(boost::thread_group& threadGroup)
 #endif
 
     StartNode(threadGroup);
+
+    // Periodic lock contention report; getlockstats can switch profiling on at any time
+    int64_t nLockStatsInterval = GetArg("-lockstatsinterval", DEFAULT_LOCKSTATS_INTERVAL);
+    if (nLockStatsInterval > 0)
+        threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "lockstats", &LogLockStats, nLockStatsInterval * 1000));
+
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
     if (fServer)
         StartRPCThreads();
+    if (GetBoolArg("-stratum", false))
+        StartStratumServer();
 
 #ifdef ENABLE_WALLET
     // Generate coins in the background
@@ -5,6 +5,7 @@
 
 #include "leveldbwrapper.h"
 
+#include "sync.h"
 #include "util.h"
 
 #include <boost/filesystem.hpp>
@@ -71,8 +72,18 @@ CLevelDBWrapper::~CLevelDBWrapper() {
     options.env = NULL;
 }
 
+static CCriticalSection cs_nBytesWritten;
+static uint64_t nBytesWritten = 0;
+
+uint64_t GetLevelDBBytesWritten() {
+    LOCK(cs_nBytesWritten);
+    return nBytesWritten;
+}
+
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     HandleError(status);
+    LOCK(cs_nBytesWritten);
+    nBytesWritten += batch.GetSize();
     return true;
 }
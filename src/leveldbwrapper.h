@@ -29,32 +29,42 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSize; // bytes of keys and values
 
 public:
+    CLevelDBBatch() : nSize(0) {}
+
+    size_t GetSize() const { return nSize; }
+
     template<typename K, typename V> void Write(const K& key, const V& value) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPooledDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        CPooledDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(ssValue.GetSerializeSize(value));
         ssValue << value;
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSize += slKey.size() + slValue.size();
     }
 
     template<typename K> void Erase(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPooledDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSize += slKey.size();
     }
 };
 
+/** Total bytes of keys and values written to all LevelDB databases */
+uint64_t GetLevelDBBytesWritten();
+
 class CLevelDBWrapper
 {
 private:
@@ -84,7 +94,7 @@ public:
     ~CLevelDBWrapper();
 
     template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPooledDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
@@ -98,7 +108,8 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CPooledDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(strValue.data(), strValue.size());
             ssValue >> value;
         } catch(std::exception &e) {
             return false;
@@ -113,7 +124,7 @@ public:
     }
 
     template<typename K> bool Exists(const K& key) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPooledDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
@@ -0,0 +1,126 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lzcompress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static const size_t LZ_MIN_MATCH = 4;
+static const size_t LZ_MAX_OFFSET = 65535;
+// Like LZ4, the last bytes are always literals, so a match never runs to the
+// very end and the decoder knows the final sequence has no match part.
+static const size_t LZ_LAST_LITERALS = 5;
+static const size_t LZ_MATCH_FIND_LIMIT = 12;
+static const int LZ_HASH_LOG = 12;
+
+static inline uint32_t Read32(const unsigned char* p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return n;
+}
+
+static inline void WriteLength(std::vector<unsigned char>& vchOut, size_t nLength)
+{
+    while (nLength >= 255) {
+        vchOut.push_back(255);
+        nLength -= 255;
+    }
+    vchOut.push_back((unsigned char)nLength);
+}
+
+static void WriteSequence(std::vector<unsigned char>& vchOut, const unsigned char* pLiterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+{
+    size_t nMatchCode = nMatch ? nMatch - LZ_MIN_MATCH : 0;
+    unsigned char nToken = (unsigned char)(((nLiterals < 15 ? nLiterals : 15) << 4) | (nMatchCode < 15 ? nMatchCode : 15));
+    vchOut.push_back(nToken);
+    if (nLiterals >= 15)
+        WriteLength(vchOut, nLiterals - 15);
+    vchOut.insert(vchOut.end(), pLiterals, pLiterals + nLiterals);
+    if (nMatch == 0)
+        return;
+    vchOut.push_back(nOffset & 0xff);
+    vchOut.push_back(nOffset >> 8);
+    if (nMatchCode >= 15)
+        WriteLength(vchOut, nMatchCode - 15);
+}
+
+void LZCompress(const unsigned char* pbegin, const unsigned char* pend, std::vector<unsigned char>& vchOut)
+{
+    const size_t nSize = pend - pbegin;
+    size_t nAnchor = 0;
+
+    if (nSize >= LZ_MATCH_FIND_LIMIT) {
+        std::vector<uint32_t> vTable(1 << LZ_HASH_LOG, 0);
+        const size_t nMatchEnd = nSize - LZ_LAST_LITERALS;
+        size_t i = 1;
+        while (i + LZ_MATCH_FIND_LIMIT <= nSize) {
+            uint32_t nSeq = Read32(pbegin + i);
+            uint32_t nHash = (nSeq * 2654435761U) >> (32 - LZ_HASH_LOG);
+            size_t nRef = vTable[nHash];
+            vTable[nHash] = i;
+            if (i - nRef > LZ_MAX_OFFSET || Read32(pbegin + nRef) != nSeq) {
+                i++;
+                continue;
+            }
+            size_t nMatch = LZ_MIN_MATCH;
+            while (i + nMatch < nMatchEnd && pbegin[nRef + nMatch] == pbegin[i + nMatch])
+                nMatch++;
+            WriteSequence(vchOut, pbegin + nAnchor, i - nAnchor, i - nRef, nMatch);
+            i += nMatch;
+            nAnchor = i;
+        }
+    }
+
+    WriteSequence(vchOut, pbegin + nAnchor, nSize - nAnchor, 0, 0);
+}
+
+static inline bool ReadLength(const unsigned char*& p, const unsigned char* pend, size_t& nLength)
+{
+    unsigned char n;
+    do {
+        if (p == pend)
+            return false;
+        n = *p++;
+        nLength += n;
+    } while (n == 255);
+    return true;
+}
+
+bool LZDecompress(const unsigned char* pbegin, const unsigned char* pend, size_t nRawSize, std::vector<unsigned char>& vchOut)
+{
+    vchOut.clear();
+    vchOut.reserve(nRawSize);
+    const unsigned char* p = pbegin;
+    while (p < pend) {
+        unsigned char nToken = *p++;
+
+        size_t nLiterals = nToken >> 4;
+        if (nLiterals == 15 && !ReadLength(p, pend, nLiterals))
+            return false;
+        if (nLiterals > (size_t)(pend - p) || nLiterals > nRawSize - vchOut.size())
+            return false;
+        vchOut.insert(vchOut.end(), p, p + nLiterals);
+        p += nLiterals;
+        if (p == pend)
+            break; // the last sequence has no match
+
+        if (pend - p < 2)
+            return false;
+        size_t nOffset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t nMatch = nToken & 15;
+        if (nMatch == 15 && !ReadLength(p, pend, nMatch))
+            return false;
+        nMatch += LZ_MIN_MATCH;
+        if (nOffset == 0 || nOffset > vchOut.size() || nMatch > nRawSize - vchOut.size())
+            return false;
+        // Byte by byte, as the match may overlap the bytes it produces
+        size_t nFrom = vchOut.size() - nOffset;
+        for (size_t i = 0; i < nMatch; i++)
+            vchOut.push_back(vchOut[nFrom + i]);
+    }
+    return vchOut.size() == nRawSize;
+}
@@ -0,0 +1,22 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_LZCOMPRESS_H
+#define BITMARK_LZCOMPRESS_H
+
+#include <stddef.h>
+#include <vector>
+
+/** Small LZ77 codec using the LZ4 block layout: a token with 4-bit literal
+ * and match lengths, optional length extension bytes of 255, the literals,
+ * and a 2-byte little-endian match offset. It is meant for short records
+ * (undo data) where a greedy single-pass match finder is good enough.
+ *
+ * LZCompress appends the compressed form of [pbegin, pend) to vchOut.
+ * LZDecompress expands it again and returns false unless the input is well
+ * formed and expands to exactly nRawSize bytes. */
+void LZCompress(const unsigned char* pbegin, const unsigned char* pend, std::vector<unsigned char>& vchOut);
+bool LZDecompress(const unsigned char* pbegin, const unsigned char* pend, size_t nRawSize, std::vector<unsigned char>& vchOut);
+
+#endif // BITMARK_LZCOMPRESS_H
@@ -8,6 +8,8 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockimport.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -19,6 +21,8 @@
 #include "util.h"
 #include "pow.h"
 
+#include <deque>
+#include <list>
 #include <sstream>
 #include <inttypes.h>
 
@@ -39,16 +43,26 @@ using namespace boost;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+// Storage for every CBlockIndex in mapBlockIndex; released with the map
+static CArena<CBlockIndex> arenaBlockIndex;
 CChain chainMostWork;
 CCoinsViewCache *pcoinsTip = NULL;
 int64_t nTimeBestReceived = 0;
+CWaitableCriticalSection csBestBlock;
+CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
 unsigned int nCoinCacheSize = 5000;
+int64_t nDbFlushInterval = DEFAULT_DB_FLUSH_INTERVAL;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+int nPruneDepth = MIN_BLOCKS_TO_KEEP;
+bool fHavePruned = false;
+uint256 hashAssumeValid;
 static const int64_t v2checkpoint = 230000;
 
 /** The term "satoshi" is kept in homage to entity who gave the block chain to the world */
@@ -109,6 +123,20 @@ namespace {
     CBlockFileInfo infoLastBlockFile;
     int nLastBlockFile = 0;
 
+    // Block index entries and block file info changed since the last
+    // FlushStateToDisk, which writes them in one batch. setDirtyBlockIndex is
+    // protected by cs_main, the file info by cs_LastBlockFile.
+    set<CBlockIndex*> setDirtyBlockIndex;
+    map<int, CBlockFileInfo> mapDirtyFileInfo;
+    bool fDirtyLastBlockFile = false;
+
+    // Set when the blk/rev files grew, so the next FlushStateToDisk checks
+    // them against the -prune target
+    bool fCheckForPruning = false;
+
+    // Flush statistics (getflushstats), protected by cs_main
+    CFlushStats flushStats;
+
     // Every received block is assigned a unique and increasing identifier, so we
     // know which one to give priority in case of a fork.
     CCriticalSection cs_nBlockSequenceId;
@@ -217,6 +245,12 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // Whether this peer relays compact blocks (sent us sendcmpct)
+    bool fProvidesHeaderAndIDs;
+    // Whether this peer wants new blocks pushed to it as cmpctblock
+    bool fPreferHeaderAndIDs;
+    // Compact block from this peer waiting for its blocktxn
+    boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -225,12 +259,18 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
   // Map maintaining per-node state. Requires cs_main.
   map<NodeId, CNodeState> mapNodeState;
 
+// Peers we asked to push new blocks to us as cmpctblock, the one that most
+// recently gave us a new block last. Requires cs_main.
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -261,6 +301,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksToDownload.erase(hash);
 
     EraseOrphansFor(nodeid);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     mapNodeState.erase(nodeid);
 }
   
@@ -319,6 +360,39 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main. A peer that just gave us a new best block is likely to
+// be among the first with the next one: ask it to push new blocks to us as
+// cmpctblock, keeping at most MAX_HB_CMPCT_PEERS such peers.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom) {
+    CNodeState *state = State(pfrom->GetId());
+    if (state == NULL || !state->fProvidesHeaderAndIDs)
+        return;
+    for (list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCT_PEERS) {
+        NodeId nodeEvict = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->GetId() == nodeEvict)
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+// Requires cs_main. Fall back to downloading a block in full.
+void RequestFullBlock(CNode* pfrom, const uint256 &hash) {
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    MarkBlockAsInFlight(pfrom->GetId(), hash);
+    pfrom->PushMessage("getdata", vGetData);
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -397,7 +471,7 @@ CBlockLocator CChain::GetLocator(const CBlockIndex *pindex) const {
 CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, locator.vHave) {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -731,7 +805,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -983,7 +1057,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1110,54 +1184,169 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
         return error("WriteBlockToDisk : ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
     fileout << block;
-    
-    // Flush stdio buffers and commit to disk before returning
+
+    // Flush stdio buffers; FlushStateToDisk commits the file to disk before
+    // anything referring to the block is written
     fflush(fileout);
-    if (!IsInitialBlockDownload())
-        FileCommit(fileout);
 
     fileout.fclose();
     
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPoW)
 {
 
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (!filein) {
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-    }
+    CBlockFileView view;
+    if (MapBlockFileRecord(pos, "blk", 0, view)) {
+        // Deserialize straight from the mapped file
+        try {
+            CMemoryReader reader(view.pbegin, view.pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (!filein) {
+            return error("ReadBlockFromDisk : OpenBlockFile failed");
+        }
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (std::exception &e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Check the header
-    if (!CheckAuxPowProofOfWork(block, Params())) {
+    if (fCheckPoW && !CheckAuxPowProofOfWork(block, Params())) {
         return error("ReadBlockFromDisk : Errors in block header");
     }
 
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+{
+    return ReadBlockFromDisk(block, pos, true);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-  if (!ReadBlockFromDisk(block, pindex->GetBlockPos())) {
+    // The proof of work of an indexed block was checked when it was accepted;
+    // the hash comparison below catches a wrong or damaged header on disk.
+    bool fCheckPoW = fCheckBlockReads || !pindex->IsValidTree();
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), fCheckPoW)) {
         return false;
-  }
+    }
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    // The block hash does not cover the auxpow: check its merkle links,
+    // which is cheap next to the parent block's proof-of-work hash
+    if (!fCheckPoW && !CheckAuxPowLink(block, Params()))
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : Errors in auxpow");
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CBlockIndex* pindex)
+{
+    const CDiskBlockPos pos = pindex->GetBlockPos();
+    CBlockFileView view;
+    if (MapBlockFileRecord(pos, "blk", 0, view)) {
+        vchBlock.assign(view.pbegin, view.pend);
+    } else {
+        // Open history file to read, at the size in front of the block
+        if (pos.nPos < sizeof(unsigned int))
+            return error("ReadRawBlockFromDisk : bad position");
+        CDiskBlockPos posSize(pos.nFile, pos.nPos - sizeof(unsigned int));
+        CAutoFile filein = CAutoFile(OpenBlockFile(posSize, true), SER_DISK, CLIENT_VERSION);
+        if (!filein)
+            return error("ReadRawBlockFromDisk : OpenBlockFile failed");
+        try {
+            unsigned int nSize;
+            filein >> nSize;
+            if (nSize > MAX_BLOCK_SIZE * 4)
+                return error("ReadRawBlockFromDisk : block size %u too large", nSize);
+            vchBlock.resize(nSize);
+            if (nSize)
+                filein.read(&vchBlock[0], nSize);
+        }
+        catch (std::exception &e) {
+            return error("%s : I/O error - %s", __func__, e.what());
+        }
+    }
+
+    // Only the header is decoded, to match the bytes against the index
+    try {
+        CMemoryReader reader(vchBlock.empty() ? NULL : &vchBlock[0], vchBlock.empty() ? NULL : &vchBlock[0] + vchBlock.size(), SER_DISK, CLIENT_VERSION);
+        CPureBlockHeader header;
+        reader >> header;
+        if (header.GetHash() != pindex->GetBlockHash())
+            return error("ReadRawBlockFromDisk : GetHash() doesn't match index");
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
     return true;
 }
 
+/** Blocks as complete "block" messages, as last sent to peers. While peers
+ * catch up on a new block, or a batch of recent blocks during their sync,
+ * each is read from disk and hashed once, and its message shared. */
+class CRawBlockCache
+{
+private:
+    typedef std::list<uint256> Recent;
+    typedef std::map<uint256, std::pair<CSharedMessage, Recent::iterator> > Entries;
+
+    CCriticalSection cs;
+    Recent listRecent; // most recently used first
+    Entries mapEntries;
+    size_t nMaxSize;
+
+public:
+    CRawBlockCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    CSharedMessage Get(const CBlockIndex* pindex)
+    {
+        uint256 hash = pindex->GetBlockHash();
+        {
+            LOCK(cs);
+            Entries::iterator it = mapEntries.find(hash);
+            if (it != mapEntries.end()) {
+                listRecent.splice(listRecent.begin(), listRecent, it->second.second);
+                return it->second.first;
+            }
+        }
+
+        // The blk files hold the network serialization already
+        std::vector<char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pindex))
+            return CSharedMessage();
+        CSharedMessage pmsg = MakeSharedMessage("block", &vchBlock[0], &vchBlock[0] + vchBlock.size());
+
+        LOCK(cs);
+        if (mapEntries.count(hash))
+            return pmsg;
+        listRecent.push_front(hash);
+        mapEntries.insert(std::make_pair(hash, std::make_pair(pmsg, listRecent.begin())));
+        while (mapEntries.size() > nMaxSize) {
+            mapEntries.erase(listRecent.back());
+            listRecent.pop_back();
+        }
+        return pmsg;
+    }
+};
+
+static CRawBlockCache rawBlockCache(MAX_RAW_BLOCK_CACHE);
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
     map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
@@ -1874,7 +2063,7 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     }
     if (!state.CorruptionPossible()) {
         pindex->nStatus |= BLOCK_FAILED_VALID;
-        pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        setDirtyBlockIndex.insert(pindex);
         setBlockIndexValid.erase(pindex);
         InvalidChainFound(pindex);
     }
@@ -2024,8 +2213,11 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull())
         return error("DisconnectBlock() : no undo data available");
+    int64_t nStart = GetTimeMicros();
     if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
         return error("DisconnectBlock() : failure reading undo data");
+    if (fBenchmark)
+        LogPrintf("- Read undo data: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
@@ -2099,29 +2291,38 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+// Commit the blk and rev files of nFile to disk. With pinfoFinal, the file
+// is done with: cut off the preallocated space past the sizes in it.
+void static CommitBlockFile(int nFile, const CBlockFileInfo* pinfoFinal = NULL)
 {
-    LOCK(cs_LastBlockFile);
+    CDiskBlockPos posOld(nFile, 0);
 
-    CDiskBlockPos posOld(nLastBlockFile, 0);
+    if (pinfoFinal)
+        UnmapBlockFile(posOld.nFile);
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, infoLastBlockFile.nSize);
+        if (pinfoFinal)
+            TruncateFile(fileOld, pinfoFinal->nSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
 
     fileOld = OpenUndoFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, infoLastBlockFile.nUndoSize);
+        if (pinfoFinal)
+            TruncateFile(fileOld, pinfoFinal->nUndoSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
 }
 
+void static FlushBlockFile(bool fFinalize = false)
+{
+    LOCK(cs_LastBlockFile);
+    CommitBlockFile(nLastBlockFile, fFinalize ? &infoLastBlockFile : NULL);
+}
+
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
@@ -2131,6 +2332,25 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+// -assumevalid: the scripts of pindex need not be checked if it is an
+// ancestor of the assumed-valid block and both are on the most-work chain we
+// know of, well below its tip. Everything else (amounts, double spends,
+// proof of work, merkle roots) is still verified. There is no separate
+// header chain here, so the assumed-valid block only counts once its block
+// has been accepted into the index.
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindexAssume = it->second;
+    if (pindex->nHeight > pindexAssume->nHeight || !chainMostWork.Contains(pindexAssume) || !chainMostWork.Contains(pindex))
+        return false;
+    return chainMostWork.Tip()->GetBlockTime() - pindex->GetBlockTime() > ASSUMEVALID_MIN_BURY_TIME;
+}
+
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
   if (pindex->nHeight > 0) {
@@ -2190,7 +2410,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
       return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2341,9 +2561,11 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            std::vector<char> vchUndo;
+            blockundo.Encode(vchUndo);
+            if (!FindUndoPos(state, pindex->nFile, pos, vchUndo.size() + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, hashPrevBlock))
+            if (!CBlockUndo::WriteToDisk(pos, hashPrevBlock, vchUndo))
                 return state.Abort(_("Failed to write undo data"));
 
             // update nUndoPos in block index
@@ -2352,10 +2574,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         }
 
         pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
-
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
-            return state.Abort(_("Failed to write block index"));
+        setDirtyBlockIndex.insert(pindex);
     }
 
     if (fTxIndex)
@@ -2374,26 +2593,265 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     return true;
 }
 
-// Update the on-disk chain state.
-bool static WriteChainState(CValidationState &state) {
-    static int64_t nLastWrite = 0;
-    if (!IsInitialBlockDownload() || pcoinsTip->GetCacheSize() > nCoinCacheSize || GetTimeMicros() > nLastWrite + 600*1000000) {
-        // Typical CCoins structures on disk are around 100 bytes in size.
-        // Pushing a new one to the database can cause it to be written
-        // twice (once in the log, and once in the tables). This is already
-        // an overestimation, as most will delete an existing entry or
-        // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
-            return state.Error("out of disk space");
-        FlushBlockFile();
-        pblocktree->Sync();
-        if (!pcoinsTip->Flush())
-            return state.Abort(_("Failed to write to coin database"));
-        nLastWrite = GetTimeMicros();
+/** Most recently used auxpow headers of indexed blocks. The block index
+ * itself only keeps fixed-size header fields; CBlockIndex::GetAuxPow()
+ * falls back to the block tree database. Entries of blocks whose index
+ * entry has not been flushed yet are pinned until FlushStateToDisk. */
+class CAuxPowCache
+{
+private:
+    typedef std::list<uint256> Recent;
+    typedef std::map<uint256, std::pair<boost::shared_ptr<CAuxPow>, Recent::iterator> > Entries;
+
+    CCriticalSection cs;
+    Recent listRecent; // most recently used first
+    Entries mapEntries;
+    size_t nMaxSize;
+    std::map<uint256, boost::shared_ptr<CAuxPow> > mapPinned;
+
+public:
+    CAuxPowCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    bool Get(const uint256& hash, boost::shared_ptr<CAuxPow>& pauxpow)
+    {
+        LOCK(cs);
+        std::map<uint256, boost::shared_ptr<CAuxPow> >::iterator itPinned = mapPinned.find(hash);
+        if (itPinned != mapPinned.end()) {
+            pauxpow = itPinned->second;
+            return true;
+        }
+        Entries::iterator it = mapEntries.find(hash);
+        if (it == mapEntries.end())
+            return false;
+        listRecent.splice(listRecent.begin(), listRecent, it->second.second);
+        pauxpow = it->second.first;
+        return true;
+    }
+
+    void Insert(const uint256& hash, const boost::shared_ptr<CAuxPow>& pauxpow)
+    {
+        LOCK(cs);
+        Entries::iterator it = mapEntries.find(hash);
+        if (it != mapEntries.end()) {
+            it->second.first = pauxpow;
+            listRecent.splice(listRecent.begin(), listRecent, it->second.second);
+            return;
+        }
+        listRecent.push_front(hash);
+        mapEntries.insert(std::make_pair(hash, std::make_pair(pauxpow, listRecent.begin())));
+        while (mapEntries.size() > nMaxSize) {
+            mapEntries.erase(listRecent.back());
+            listRecent.pop_back();
+        }
     }
+
+    // Keep the auxpow in memory until UnpinAll, whatever the cache size
+    void Pin(const uint256& hash, const boost::shared_ptr<CAuxPow>& pauxpow)
+    {
+        LOCK(cs);
+        mapPinned[hash] = pauxpow;
+    }
+
+    void UnpinAll()
+    {
+        LOCK(cs);
+        mapPinned.clear();
+    }
+};
+
+static CAuxPowCache auxpowCache(MAX_AUXPOW_CACHE);
+
+// Read the info of block file nFile, including changes not yet flushed
+static bool ReadBlockFileInfo(int nFile, CBlockFileInfo &info)
+{
+    LOCK(cs_LastBlockFile);
+    map<int, CBlockFileInfo>::iterator it = mapDirtyFileInfo.find(nFile);
+    if (it != mapDirtyFileInfo.end()) {
+        info = it->second;
+        return true;
+    }
+    return pblocktree->ReadBlockFileInfo(nFile, info);
+}
+
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+    uint64_t nUsage = 0;
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+        CBlockFileInfo info;
+        if (nFile == nLastBlockFile)
+            info = infoLastBlockFile;
+        else
+            ReadBlockFileInfo(nFile, info);
+        nUsage += info.nSize + info.nUndoSize;
+    }
+    return nUsage;
+}
+
+// Mark every block stored in file nFile as no longer having data or undo
+// data, and forget the file's info. The caller removes the files after the
+// block index has been written.
+static void PruneOneBlockFile(int nFile)
+{
+    AssertLockHeld(cs_main);
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile != nFile || !(pindex->nStatus & BLOCK_HAVE_MASK))
+            continue;
+        pindex->nStatus &= ~BLOCK_HAVE_MASK;
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        setDirtyBlockIndex.insert(pindex);
+        // Side chain blocks without data can never be connected
+        if (!chainActive.Contains(pindex))
+            setBlockIndexValid.erase(pindex);
+    }
+
+    LOCK(cs_LastBlockFile);
+    mapDirtyFileInfo[nFile] = CBlockFileInfo();
+}
+
+// Choose the oldest block files to prune until the blk/rev files fit in
+// nPruneTarget again. Files holding any of the last nPruneDepth blocks stay.
+static void FindFilesToPrune(set<int>& setFilesToPrune)
+{
+    AssertLockHeld(cs_main);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0 || chainActive.Height() <= nPruneDepth)
+        return;
+    unsigned int nLastBlockWeCanPrune = chainActive.Height() - nPruneDepth;
+
+    LOCK(cs_LastBlockFile);
+    vector<CBlockFileInfo> vInfo(nLastBlockFile + 1);
+    uint64_t nCurrentUsage = 0;
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+        if (nFile == nLastBlockFile)
+            vInfo[nFile] = infoLastBlockFile;
+        else
+            ReadBlockFileInfo(nFile, vInfo[nFile]);
+        nCurrentUsage += vInfo[nFile].nSize + vInfo[nFile].nUndoSize;
+    }
+
+    // Leave room for the chunks the next blocks pre-allocate
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64_t nUsageBefore = nCurrentUsage;
+    for (int nFile = 0; nFile < nLastBlockFile && nCurrentUsage + nBuffer >= nPruneTarget; nFile++) {
+        const CBlockFileInfo& info = vInfo[nFile];
+        if (info.nSize == 0 || info.nHeightLast > nLastBlockWeCanPrune)
+            continue;
+        PruneOneBlockFile(nFile);
+        setFilesToPrune.insert(nFile);
+        nCurrentUsage -= info.nSize + info.nUndoSize;
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB usage=%dMiB->%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+             nPruneTarget >> 20, nUsageBefore >> 20, nCurrentUsage >> 20, nLastBlockWeCanPrune, setFilesToPrune.size());
+}
+
+void UnlinkPrunedFiles(const set<int>& setFilesToPrune)
+{
+    for (set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        UnmapBlockFile(*it);
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"), ec);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"), ec);
+        LogPrintf("Prune: deleted blk/rev (%05u)\n", *it);
+    }
+}
+
+bool FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
+    LOCK(cs_main);
+    static int64_t nLastFlush = 0;
+    int64_t nNow = GetTimeMicros();
+    if (nLastFlush == 0)
+        nLastFlush = nNow;
+
+    // Pruning marks blocks in the index, which has to be written before the
+    // files go. While reindexing, unread files may still be needed.
+    set<int> setFilesToPrune;
+    if (fPruneMode && fCheckForPruning && !fReindex) {
+        FindFilesToPrune(setFilesToPrune);
+        fCheckForPruning = false;
+        if (!setFilesToPrune.empty() && !fHavePruned) {
+            if (!pblocktree->WriteFlag("prunedblockfiles", true))
+                return state.Abort(_("Failed to write to block index"));
+            fHavePruned = true;
+        }
+    }
+
+    // A dirty block index entry keeps its auxpow pinned in memory until it is
+    // written, so count it as a few coins cache entries (~300 bytes each).
+    size_t nDirty = pcoinsTip->GetCacheSize() + 4 * setDirtyBlockIndex.size();
+    bool fCacheFull = nDirty > nCoinCacheSize;
+    bool fPeriodic = nNow > nLastFlush + nDbFlushInterval * 1000000;
+    if (mode == FLUSH_STATE_IF_NEEDED && !fCacheFull && !fPeriodic && setFilesToPrune.empty())
+        return true;
+
+    // Typical CCoins structures on disk are around 100 bytes in size.
+    // Pushing a new one to the database can cause it to be written
+    // twice (once in the log, and once in the tables). This is already
+    // an overestimation, as most will delete an existing entry or
+    // overwrite one. Still, use a conservative safety factor of 2.
+    if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        return state.Error("out of disk space");
+
+    uint64_t nBytesBefore = GetLevelDBBytesWritten();
+
+    {
+        LOCK(cs_LastBlockFile);
+
+        // First commit the block and undo data the index is going to point
+        // at: in the last block file, and in every older one written since
+        // the last flush (undo data while reindexing, imported blocks)
+        FlushBlockFile();
+        for (map<int, CBlockFileInfo>::iterator it = mapDirtyFileInfo.begin(); it != mapDirtyFileInfo.end(); ++it)
+            if (it->first != nLastBlockFile)
+                CommitBlockFile(it->first);
+
+        // Then the block file info and the block index, in one synchronous batch
+        vector<pair<int, const CBlockFileInfo*> > vFiles;
+        vFiles.reserve(mapDirtyFileInfo.size());
+        for (map<int, CBlockFileInfo>::iterator it = mapDirtyFileInfo.begin(); it != mapDirtyFileInfo.end(); ++it)
+            vFiles.push_back(make_pair(it->first, &it->second));
+        vector<const CBlockIndex*> vBlocks(setDirtyBlockIndex.begin(), setDirtyBlockIndex.end());
+        if (!vFiles.empty() || !vBlocks.empty() || fDirtyLastBlockFile) {
+            if (!pblocktree->WriteBatchSync(vFiles, fDirtyLastBlockFile ? nLastBlockFile : -1, vBlocks))
+                return state.Abort(_("Failed to write to block index"));
+        }
+        mapDirtyFileInfo.clear();
+        fDirtyLastBlockFile = false;
+    }
+    setDirtyBlockIndex.clear();
+    auxpowCache.UnpinAll();
+
+    // Finally the coins, which may now refer to any block in the index
+    if (!pcoinsTip->Flush())
+        return state.Abort(_("Failed to write to coin database"));
+
+    // The index no longer points into the pruned files
+    UnlinkPrunedFiles(setFilesToPrune);
+
+    int64_t nEnd = GetTimeMicros();
+    flushStats.nFlushes++;
+    flushStats.nBytesWritten += GetLevelDBBytesWritten() - nBytesBefore;
+    flushStats.nStallMicros += nEnd - nNow;
+    flushStats.nMaxStallMicros = std::max(flushStats.nMaxStallMicros, nEnd - nNow);
+    flushStats.nLastFlush = GetTime();
+    LogPrint("bench", "FlushStateToDisk: %s flush of %u cache entries in %.2fms\n",
+             mode == FLUSH_STATE_ALWAYS ? "forced" : (fCacheFull ? "cache full" : (fPeriodic ? "periodic" : "prune")), nDirty, (nEnd - nNow) * 0.001);
+    nLastFlush = nEnd;
     return true;
 }
 
+void GetFlushStats(CFlushStats &stats)
+{
+    LOCK(cs_main);
+    stats = flushStats;
+    stats.nDirtyBlockIndex = setDirtyBlockIndex.size();
+    stats.nCoinsCacheSize = pcoinsTip ? pcoinsTip->GetCacheSize() : 0;
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -2407,6 +2865,12 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+
+    // Wake up long-polling RPC requests
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+    }
+    cvBlockChange.notify_all();
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%d progress=%f nbits=%u algo=%d\n",chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx, chainActive.Tip()->GetBlockTime(),Checkpoints::GuessVerificationProgress(chainActive.Tip()), chainActive.Tip()->nBits,GetAlgo(chainActive.Tip()->nVersion));
     //char * blocktime = (char *)malloc(50);
     //sprintf(blocktime,"%d %d\n",chainActive.Tip()->nTime,GetAlgo(chainActive.Tip()->nVersion));
@@ -2456,7 +2920,7 @@ bool static DisconnectTip(CValidationState &state) {
     if (fBenchmark)
         LogPrintf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
-    if (!WriteChainState(state))
+    if (!FlushStateToDisk(state))
         return false;
     // Resurrect mempool transactions from the disconnected block.
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
@@ -2505,7 +2969,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     if (fBenchmark)
         LogPrintf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
-    if (!WriteChainState(state))
+    if (!FlushStateToDisk(state))
         return false;
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
@@ -2554,6 +3018,18 @@ void static FindMostWorkChain() {
         CBlockIndex *pindexTest = pindexNew;
         bool fInvalidAncestor = false;
         while (pindexTest && !chainActive.Contains(pindexTest)) {
+            if (fHavePruned && !(pindexTest->nStatus & BLOCK_HAVE_DATA)) {
+                // Candidate builds on a pruned block, so it cannot be connected;
+                // drop it and the blocks up to the pruned one from the set.
+                CBlockIndex *pindexMissing = pindexNew;
+                while (pindexMissing != pindexTest) {
+                    setBlockIndexValid.erase(pindexMissing);
+                    pindexMissing = pindexMissing->pprev;
+                }
+                setBlockIndexValid.erase(pindexTest);
+                fInvalidAncestor = true;
+                break;
+            }
             if (pindexTest->nStatus & BLOCK_FAILED_MASK) {
                 // Candidate has an invalid ancestor, remove entire chain from the set.
                 if (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
@@ -2626,11 +3102,33 @@ bool ActivateBestChain(CValidationState &state) {
             boost::replace_all(strCmd, "%s", chainActive.Tip()->GetBlockHash().GetHex());
             boost::thread t(runCommand, strCmd); // thread runs free
         }
+        if (!IsInitialBlockDownload())
+            uiInterface.NotifyBlockTip(chainActive.Tip()->GetBlockHash(), chainActive.Height());
     }
 
     return true;
 }
 
+boost::shared_ptr<CAuxPow> CBlockIndex::GetAuxPow() const
+{
+    boost::shared_ptr<CAuxPow> pauxpow;
+    if (!IsAuxpow())
+        return pauxpow;
+
+    uint256 hash = GetBlockHash();
+    if (auxpowCache.Get(hash, pauxpow))
+        return pauxpow;
+
+    CDiskBlockIndex diskindex;
+    if (!pblocktree->ReadBlockIndex(hash, diskindex) || !diskindex.pauxpow) {
+        error("CBlockIndex::GetAuxPow() : no auxpow for block %s in the block index", hash.ToString());
+        return pauxpow;
+    }
+    pauxpow = diskindex.pauxpow;
+    auxpowCache.Insert(hash, pauxpow);
+    return pauxpow;
+}
+
 bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos)
 {
     // Check for duplicate
@@ -2639,15 +3137,14 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString()), 0, "duplicate");
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate(block);
     {
          LOCK(cs_nBlockSequenceId);
          pindexNew->nSequenceId = nBlockSequenceId++;
     }
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2656,8 +3153,10 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
     if (block.IsAuxpow()) {
-      pindexNew->pauxpow = block.auxpow;
-      assert(NULL != pindexNew->pauxpow.get());
+      assert(NULL != block.auxpow.get());
+      // Written with the index entry by the next FlushStateToDisk
+      auxpowCache.Insert(hash, block.auxpow);
+      auxpowCache.Pin(hash, block.auxpow);
     }
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
@@ -2665,10 +3164,8 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
     pindexNew->nUndoPos = 0;
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
+    setDirtyBlockIndex.insert(pindexNew);
 
-    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
-        return state.Abort(_("Failed to write block index"));
-    
     // New best?
     if (!ActivateBestChain(state))
         return false;
@@ -2684,9 +3181,9 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
         hashPrevBestCoinBase = block.GetTxHash(0);
     } else
         CheckForkWarningConditionsOnNewFork(pindexNew);
-    
-    if (!pblocktree->Flush())
-        return state.Abort(_("Failed to sync block index"));
+
+    if (!FlushStateToDisk(state))
+        return false;
 
     uiInterface.NotifyBlocksChanged();
 
@@ -2704,7 +3201,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         if (nLastBlockFile != pos.nFile) {
             nLastBlockFile = pos.nFile;
             infoLastBlockFile.SetNull();
-            pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile);
+            ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile);
             fUpdatedLast = true;
         }
     } else {
@@ -2713,7 +3210,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
             FlushBlockFile(true);
             nLastBlockFile++;
             infoLastBlockFile.SetNull();
-            pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
+            ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
             fUpdatedLast = true;
         }
         pos.nFile = nLastBlockFile;
@@ -2734,16 +3231,16 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
+                fCheckForPruning = true;
             }
             else
                 return state.Error("out of disk space");
         }
     }
 
-    if (!pblocktree->WriteBlockFileInfo(nLastBlockFile, infoLastBlockFile))
-        return state.Abort(_("Failed to write file info"));
+    mapDirtyFileInfo[nLastBlockFile] = infoLastBlockFile;
     if (fUpdatedLast)
-        pblocktree->WriteLastBlockFile(nLastBlockFile);
+        fDirtyLastBlockFile = true;
 
     return true;
 }
@@ -2758,16 +3255,18 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     if (nFile == nLastBlockFile) {
         pos.nPos = infoLastBlockFile.nUndoSize;
         nNewSize = (infoLastBlockFile.nUndoSize += nAddSize);
-        if (!pblocktree->WriteBlockFileInfo(nLastBlockFile, infoLastBlockFile))
-            return state.Abort(_("Failed to write block info"));
+        mapDirtyFileInfo[nLastBlockFile] = infoLastBlockFile;
     } else {
+        // The info of a file written since the last flush is newer in memory
         CBlockFileInfo info;
-        if (!pblocktree->ReadBlockFileInfo(nFile, info))
+        map<int, CBlockFileInfo>::iterator it = mapDirtyFileInfo.find(nFile);
+        if (it != mapDirtyFileInfo.end())
+            info = it->second;
+        else if (!ReadBlockFileInfo(nFile, info))
             return state.Abort(_("Failed to read block info"));
         pos.nPos = info.nUndoSize;
         nNewSize = (info.nUndoSize += nAddSize);
-        if (!pblocktree->WriteBlockFileInfo(nFile, info))
-            return state.Abort(_("Failed to write block info"));
+        mapDirtyFileInfo[nFile] = info;
     }
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -2780,6 +3279,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
+            fCheckForPruning = true;
         }
         else
             return state.Error("out of disk space");
@@ -2789,6 +3289,25 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+bool CheckBlockProofOfWork(const CBlock& block, CValidationState& state)
+{
+    if (block.IsAuxpow()) {
+        if (!CheckAuxPowProofOfWork(block, Params()))
+            return state.DoS(50, error("CheckBlock() : auxpow proof of work failed"),
+                             REJECT_INVALID, "high-hash");
+        return true;
+    }
+
+    if (block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params()))
+        return state.DoS(50, error("CheckBlock() : Invalid Equihash Solution"),
+                         REJECT_INVALID, "bad-equihash-solution");
+
+    if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, block.GetAlgo()))
+        return state.DoS(50, error("CheckBlock() : proof of work failed"),
+                         REJECT_INVALID, "high-hash");
+    return true;
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
@@ -2805,7 +3324,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     /*
     bool blockOnFork = false;
     if (fCheckPOW && block.GetHash() != Params().HashGenesisBlock()) {
-      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+      BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
       if (mi == mapBlockIndex.end())
 	return state.DoS(10, error("CheckBlock() : prev block not found"), 0, "bad-prevblk");
       CBlockIndex * pindexPrev = (*mi).second;
@@ -2813,24 +3332,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
       }*/
     
     // Check proof of work matches claimed amount
-    if(fCheckPOW && block.IsAuxpow()) {
-      if (!CheckAuxPowProofOfWork(block, Params())) {
-	return state.DoS(50, error("CheckBlock() : auxpow proof of work failed"),
-			 REJECT_INVALID, "high-hash");
-      }
-    }
-    else {
-          if (fCheckPOW && block.GetAlgo() == ALGO_EQUIHASH && !CheckEquihashSolution(&block, Params())) {
-	    return state.DoS(50, error("CheckBlock() : Invalid Equihash Solution"),
-			     REJECT_INVALID, "bad-equihash-solution");      
-	  }
-
-	  //LogPrintf("check proof of work of block with algo %d\n",block.GetAlgo());
-	  if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(),block.nBits,block.GetAlgo())) {
-	    return state.DoS(50, error("CheckBlock() : proof of work failed"),
-			     REJECT_INVALID, "high-hash");
-	  }
-    }
+    if (fCheckPOW && !CheckBlockProofOfWork(block, state))
+        return false;
 
     // Check timestamp
     int64_t nNow = GetTime();
@@ -2911,7 +3414,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"), 0, "bad-prevblk");
         pindexPrev = (*mi).second;
@@ -3002,14 +3505,33 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
         return state.Abort(_("System error: ") + e.what());
     }
 
-    // Relay inventory, but don't relay old inventory during initial block download
+    // Relay inventory, but don't relay old inventory during initial block download.
+    // Peers that asked for it get the block pushed as a cmpctblock instead.
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (chainActive.Tip()->GetBlockHash() == hash)
     {
+        CInv inv(MSG_BLOCK, hash);
+        // Serialized once, and shared by every peer it goes to
+        CSharedMessage pcmpctblock;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            CNodeState *nodestate = State(pnode->GetId());
+            bool fKnown;
+            {
+                LOCK(pnode->cs_inventory);
+                fKnown = pnode->setInventoryKnown.count(inv);
+            }
+            if (nodestate && nodestate->fPreferHeaderAndIDs && !fKnown) {
+                if (!pcmpctblock)
+                    pcmpctblock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                pnode->PushSharedMessage(pcmpctblock);
+                pnode->AddInventoryKnown(inv);
+            } else
+                pnode->PushInventory(inv);
+        }
     }
     
     return true;
@@ -3027,7 +3549,7 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fCheckPOW)
 {
     AssertLockHeld(cs_main);
 
@@ -3039,7 +3561,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
     
     // Preliminary checks
-    if (!CheckBlock(*pblock, state))
+    if (!CheckBlock(*pblock, state, fCheckPOW))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     if (0) { // skip these extra checks until we have the fork height set
@@ -3293,14 +3815,12 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate();
     //LogPrintf("insert to mapBlockIndex hash %s\n",hash.GetHex().c_str());
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
@@ -3315,19 +3835,29 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Order the index by height with a counting sort (heights are dense),
+    // so that every block is visited after its parent
+    int nMaxHeight = -1;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+
+    // nChainWork is stored with the index; only records written by older
+    // versions need it computed, and are rewritten with it below
+    vector<CBlockIndex*> vUpgrade;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        if (pindex->nChainWork == 0) {
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+            vUpgrade.push_back(pindex);
+        }
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK)) {
 	  //LogPrintf("insert pindex at height %d (%s) as valid\n",pindex->nHeight,(pindex->phashBlock)->GetHex().c_str());
@@ -3337,6 +3867,15 @@ bool static LoadBlockIndexDB()
             pindexBestInvalid = pindex;
     }
 
+    if (!vUpgrade.empty()) {
+        LogPrintf("LoadBlockIndexDB(): storing chain work for %u block index entries\n", vUpgrade.size());
+        BOOST_FOREACH(CBlockIndex* pindex, vUpgrade) {
+            boost::this_thread::interruption_point();
+            if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+                return error("LoadBlockIndexDB() : failed to write block index");
+        }
+    }
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     //LogPrintf("LoadBlockIndexDB(): last block file = %i\n", nLastBlockFile);
@@ -3348,13 +3887,18 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
+    // Check whether block and undo files have ever been pruned
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): block files have been pruned before\n");
+
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
     // Load pointer to end of best chain
     //LogPrintf("load pcoinstip bestblock %s\n",pcoinsTip->GetBestBlock().GetHex().c_str());
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
@@ -3389,6 +3933,11 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         boost::this_thread::interruption_point();
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Nothing to check below the pruned blocks
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3444,8 +3993,18 @@ void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
+    setDirtyBlockIndex.clear();
+    {
+        LOCK(cs_LastBlockFile);
+        mapDirtyFileInfo.clear();
+        fDirtyLastBlockFile = false;
+    }
+    auxpowCache.UnpinAll();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    pindexBestForkTip = NULL;
+    pindexBestForkBase = NULL;
+    arenaBlockIndex.Clear();
 }
 
 bool LoadBlockIndex()
@@ -3501,6 +4060,8 @@ bool InitBlockIndex() {
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
             if (!AddToBlockIndex(block, state, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
+            if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+                return error("LoadBlockIndex() : failed to write genesis block");
         } catch(std::runtime_error &e) {
             return error("LoadBlockIndex() : failed to initialize block database: %s", e.what());
         }
@@ -3514,7 +4075,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3578,67 +4139,88 @@ void PrintBlockTree()
     }
 }
 
+namespace {
+
+/** Blocks found during -reindex before their parent, by parent hash. They
+ *  are read back from disk once the parent has been connected, rather than
+ *  kept in memory, and may span block files. */
+multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+} // anon namespace
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
+    FileAdviseSequential(fileIn);
     try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nStartByte = 0;
         if (dbp) {
             // (try to) skip already indexed part
             CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
+            if (ReadBlockFileInfo(dbp->nFile, info))
                 nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
         }
-        uint64_t nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
-            boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+        {
+            int nThreads = std::max((int)boost::thread::hardware_concurrency(), 1);
+            CBlockImportPipeline pipeline(fileIn, nStartByte, nThreads);
+            boost::shared_ptr<CImportBlock> job;
+            while ((job = pipeline.Pop())) {
+                if (!job->fValid)
                     continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                CBlock& block = job->block;
 
                 // process block
-                if (nBlockPos >= nStartByte) {
+                {
                     LOCK(cs_main);
+                    if (block.hashPrevBlock != 0 && !mapBlockIndex.count(block.hashPrevBlock)) {
+                        if (dbp) {
+                            LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__,
+                                     block.GetHash().ToString(), block.hashPrevBlock.ToString());
+                            mapBlocksUnknownParent.insert(make_pair(block.hashPrevBlock, CDiskBlockPos(dbp->nFile, job->nBlockPos)));
+                        } else {
+                            LogPrintf("%s: Skipping out of order block %s, parent %s not known\n", __func__,
+                                      block.GetHash().ToString(), block.hashPrevBlock.ToString());
+                        }
+                        continue;
+                    }
                     if (dbp)
-                        dbp->nPos = nBlockPos;
+                        dbp->nPos = job->nBlockPos;
                     CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
+                    // The pipeline already checked the proof of work
+                    if (ProcessBlock(state, NULL, &block, dbp, false))
                         nLoaded++;
                     if (state.IsError())
                         break;
                 }
-            } catch (std::exception &e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+
+                // Connect the blocks that were waiting for this one, recursively
+                deque<uint256> queueParents;
+                queueParents.push_back(block.GetHash());
+                while (!queueParents.empty()) {
+                    uint256 hashParent = queueParents.front();
+                    queueParents.pop_front();
+                    std::pair<multimap<uint256, CDiskBlockPos>::iterator, multimap<uint256, CDiskBlockPos>::iterator> range;
+                    range = mapBlocksUnknownParent.equal_range(hashParent);
+                    while (range.first != range.second) {
+                        multimap<uint256, CDiskBlockPos>::iterator it = range.first++;
+                        CDiskBlockPos pos = it->second;
+                        mapBlocksUnknownParent.erase(it);
+                        CBlock blockChild;
+                        if (!ReadBlockFromDisk(blockChild, pos))
+                            continue;
+                        LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__,
+                                 blockChild.GetHash().ToString(), hashParent.ToString());
+                        LOCK(cs_main);
+                        CValidationState state;
+                        if (ProcessBlock(state, NULL, &blockChild, &pos)) {
+                            nLoaded++;
+                            queueParents.push_back(blockChild.GetHash());
+                        }
+                    }
+                }
             }
         }
         fclose(fileIn);
@@ -3755,10 +4337,10 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     // If the requested block is at a height below our last
@@ -3776,15 +4358,46 @@ void static ProcessGetData(CNode* pfrom)
                         send = true;
                     }
                 }
+                // Pruned: we have the header but no longer the block
+                if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                {
+                    LogPrint("net", "ProcessGetData(): ignoring request for pruned block %s\n", inv.hash.ToString());
+                    vNotFound.push_back(inv);
+                    send = false;
+                }
+                // Compact blocks only help for blocks the peer likely has
+                // the transactions of; older ones are sent in full
+                bool fCompact = false;
+                if (send && inv.type == MSG_CMPCT_BLOCK)
+                {
+                    CNodeState *nodestate = State(pfrom->GetId());
+                    fCompact = nodestate && nodestate->fProvidesHeaderAndIDs &&
+                               mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    if (fCompact)
+                    {
+                        CBlock block;
+                        if (ReadBlockFromDisk(block, (*mi).second))
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            vNotFound.push_back(inv);
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Send the block as stored, in a message shared with
+                        // the other peers asking for it
+                        CSharedMessage pmsg = rawBlockCache.Get(mi->second);
+                        if (pmsg)
+                            pfrom->PushSharedMessage(pmsg);
+                        else
+                            vNotFound.push_back(inv);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        ReadBlockFromDisk(block, (*mi).second);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3824,9 +4437,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3867,6 +4480,22 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Requires cs_main. Process a block received from pfrom, in full or rebuilt
+// from a compact block.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    // Remember who we got this block from.
+    mapBlockSource[hash] = pfrom->GetId();
+    MarkBlockAsReceived(hash, pfrom->GetId());
+
+    CValidationState state;
+    ProcessBlock(state, pfrom, &block);
+
+    if (chainActive.Tip()->GetBlockHash() == hash && !IsInitialBlockDownload())
+        MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3999,6 +4628,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Tell the peer we relay compact blocks; whether to push new blocks
+        // to us without an inv is decided later, by how useful the peer is
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce;
+        uint64_t nCmpctVersion;
+        vRecv >> fAnnounce >> nCmpctVersion;
+        if (nCmpctVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounce;
+        }
     }
 
 
@@ -4154,6 +4802,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // When pruning, only announce blocks we have and are likely to
+            // still have during the hour the peer may take to ask for them
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) ||
+                               pindex->nHeight <= chainActive.Height() - (nPruneDepth - 3600 / nTargetSpacing)))
+            {
+                LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4178,7 +4834,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4318,12 +4974,126 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->AddInventoryKnown(inv);
 
         LOCK(cs_main);
-        // Remember who we got this block from.
-        mapBlockSource[inv.hash] = pfrom->GetId();
-        MarkBlockAsReceived(inv.hash, pfrom->GetId());
+        ProcessReceivedBlock(pfrom, block);
+    }
 
-        CValidationState state;
-        ProcessBlock(state, pfrom, &block);
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s (%u transactions)\n", hash.ToString(), cmpctblock.BlockTxCount());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash)) {
+            MarkBlockAsReceived(hash, pfrom->GetId());
+            return true;
+        }
+        // Don't spend effort on the mempool for a header that isn't even
+        // worked on (this checks the auxpow too)
+        if (!CheckAuxPowProofOfWork(cmpctblock.header, Params())) {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("cmpctblock %s : proof of work failed", hash.ToString());
+        }
+        // Blocks that don't connect go through the orphan handling of full blocks
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock(new CPartiallyDownloadedBlock());
+        ReadStatus status = partialBlock->InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("cmpctblock %s : malformed compact block", hash.ToString());
+        } else if (status == READ_STATUS_FAILED) {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        for (size_t i = 0; i < partialBlock->BlockTxCount(); i++)
+            if (!partialBlock->IsTxAvailable(i))
+                req.vIndexes.push_back(i);
+
+        if (req.vIndexes.empty()) {
+            CBlock block;
+            if (partialBlock->FillBlock(block, vector<CTransaction>()) == READ_STATUS_OK)
+                ProcessReceivedBlock(pfrom, block);
+            else
+                RequestFullBlock(pfrom, hash);
+        } else {
+            // Keep it in flight from this peer while the rest is fetched
+            MarkBlockAsInFlight(pfrom->GetId(), hash);
+            State(pfrom->GetId())->partialBlock = partialBlock;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->GetId());
+            return true;
+        }
+        // Only recent blocks are announced as compact blocks
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for block %s, which is too old\n", pfrom->GetId(), req.blockhash.ToString());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            return error("getblocktxn : cannot read block %s", req.blockhash.ToString());
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        for (size_t i = 0; i < req.vIndexes.size(); i++) {
+            if (req.vIndexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn : peer %d sent out of bounds transaction index", pfrom->GetId());
+            }
+            resp.vtx.push_back(block.vtx[req.vIndexes[i]]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        CNodeState *nodestate = State(pfrom->GetId());
+        boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+        if (!partialBlock || partialBlock->header.GetHash() != resp.blockhash) {
+            LogPrint("net", "Peer %d sent us a blocktxn for block %s we weren't expecting\n", pfrom->GetId(), resp.blockhash.ToString());
+            return true;
+        }
+        nodestate->partialBlock.reset();
+
+        CBlock block;
+        ReadStatus status = partialBlock->FillBlock(block, resp.vtx);
+        if (status == READ_STATUS_INVALID) {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("blocktxn %s : wrong number of transactions", resp.blockhash.ToString());
+        } else if (status == READ_STATUS_FAILED) {
+            RequestFullBlock(pfrom, resp.blockhash);
+            return true;
+        }
+        ProcessReceivedBlock(pfrom, block);
     }
 
     else if (strCommand == "getaddr")
@@ -4842,9 +5612,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
+        // Near the tip, peers relaying compact blocks send new blocks as such
+        bool fFetchCompact = state.fProvidesHeaderAndIDs && !IsInitialBlockDownload();
         while (!pto->fDisconnect && state.nBlocksToDownload && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
             uint256 hash = state.vBlocksToDownload.front();
-            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            vGetData.push_back(CInv(fFetchCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, hash));
             MarkBlockAsInFlight(pto->GetId(), hash);
             LogPrint("net", "Requesting block %s from %s\n", hash.ToString().c_str(), state.name.c_str());
             if (vGetData.size() >= 1000)
@@ -4886,10 +5658,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        arenaBlockIndex.Clear();
 
         // orphan blocks
         std::map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.begin();
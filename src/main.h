@@ -11,6 +11,8 @@
 #include "bitmark-config.h"
 #endif
 
+#include "blockfile.h"
+#include "blockindexmap.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "core.h"
@@ -19,6 +21,7 @@
 #include "sync.h"
 #include "txmempool.h"
 #include "uint256.h"
+#include "undo.h"
 
 #include <algorithm>
 #include <exception>
@@ -83,8 +86,11 @@ static const unsigned char REJECT_CHECKPOINT = 0x43;
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+/** Signalled, with csBestBlock, whenever the tip changes */
+extern CWaitableCriticalSection csBestBlock;
+extern CConditionVariable cvBlockChange;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern const std::string strMessageMagic;
@@ -95,7 +101,28 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern unsigned int nCoinCacheSize;
-
+extern int64_t nDbFlushInterval;
+extern bool fPruneMode;
+extern uint64_t nPruneTarget;
+extern int nPruneDepth;
+extern bool fHavePruned;
+extern uint256 hashAssumeValid;
+
+/** Default for -dbflushinterval, the longest time in seconds between chainstate flushes */
+static const int64_t DEFAULT_DB_FLUSH_INTERVAL = 600;
+/** Number of recently used auxpow headers kept in memory for the block index */
+static const unsigned int MAX_AUXPOW_CACHE = 2000;
+/** Number of recently served blocks kept in network serialization */
+static const unsigned int MAX_RAW_BLOCK_CACHE = 16;
+/** Block files holding any of the last this many blocks are never pruned, so
+ * reorgs up to this depth still find their block and undo data */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target in bytes: the last MIN_BLOCKS_TO_KEEP blocks with
+ * their undo data, the pre-allocated chunks and some room for orphans */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+/** Blocks must be buried this many seconds (by block time) below the best
+ * known block before -assumevalid lets them skip script checks */
+static const int64_t ASSUMEVALID_MIN_BURY_TIME = 2 * 7 * 24 * 60 * 60;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
@@ -125,8 +152,38 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
+/** How FlushStateToDisk decides whether to write */
+enum FlushStateMode {
+    FLUSH_STATE_IF_NEEDED, // when the caches are full or -dbflushinterval has passed
+    FLUSH_STATE_ALWAYS
+};
+/** Counters of chainstate flushes, for getflushstats */
+struct CFlushStats
+{
+    int64_t nFlushes;
+    uint64_t nBytesWritten;   // to the block index and coins databases
+    int64_t nStallMicros;     // total time spent flushing, with cs_main held
+    int64_t nMaxStallMicros;
+    int64_t nLastFlush;       // time of the last flush, 0 if none
+    unsigned int nDirtyBlockIndex;
+    unsigned int nCoinsCacheSize;
+
+    CFlushStats() : nFlushes(0), nBytesWritten(0), nStallMicros(0), nMaxStallMicros(0), nLastFlush(0), nDirtyBlockIndex(0), nCoinsCacheSize(0) {}
+};
+/** Write changed block file info, block index entries and the coins cache
+ *  to disk, in that order, if the flush policy (or mode) asks for it */
+bool FlushStateToDisk(CValidationState &state, FlushStateMode mode = FLUSH_STATE_IF_NEEDED);
+/** Get the flush counters */
+void GetFlushStats(CFlushStats &stats);
+
+/** Bytes used by blk/rev files, as recorded in their file info */
+uint64_t CalculateCurrentUsage();
+/** Remove the blk/rev files of the given numbers; their blocks must have been
+ *  marked pruned and written to the block index first */
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
+
 /** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fCheckPOW = true);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -282,11 +339,20 @@ class CBlockUndo
 public:
     std::vector<CTxUndo> vtxundo; // for all but the coinbase
 
+    // The original rev file format; records are now written in the compact
+    // format of undo.h, and DecodeBlockUndo reads both.
     IMPLEMENT_SERIALIZE(
         READWRITE(vtxundo);
     )
 
-    bool WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
+    /** Encode for the rev files; the size FindUndoPos needs is vchData.size() + 40 */
+    void Encode(std::vector<char> &vchData) const
+    {
+        EncodeBlockUndo(vtxundo, fCompressUndo, vchData);
+    }
+
+    /** Write data from Encode() */
+    static bool WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock, const std::vector<char> &vchData)
     {
         // Open history file to append
         CAutoFile fileout = CAutoFile(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -294,7 +360,7 @@ public:
             return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
 
         // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
+        unsigned int nSize = vchData.size();
         fileout << FLATDATA(Params().MessageStart()) << nSize;
 
         // Write undo data
@@ -302,46 +368,70 @@ public:
         if (fileOutPos < 0)
             return error("CBlockUndo::WriteToDisk : ftell failed");
         pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
+        fileout.write(&vchData[0], vchData.size());
 
         // calculate & write checksum
         CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
         hasher << hashBlock;
-        hasher << *this;
+        hasher.write(&vchData[0], vchData.size());
         fileout << hasher.GetHash();
 
-        // Flush stdio buffers and commit to disk before returning
+        // Flush stdio buffers; FlushStateToDisk commits the file to disk
         fflush(fileout);
-        if (!IsInitialBlockDownload())
-            FileCommit(fileout);
 
         return true;
     }
 
     bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
     {
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-        // Read block
-        uint256 hashChecksum;
-        try {
-            filein >> *this;
-            filein >> hashChecksum;
-        }
-        catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // The checksum covers the stored bytes, so check it before decoding
+        // (and without re-encoding, which would not give back records written
+        // in the original format)
+        CBlockFileView view;
+        std::vector<char> vchRecord;
+        const char *pbegin, *pend;
+        if (MapBlockFileRecord(pos, "rev", sizeof(uint256), view)) {
+            pbegin = view.pbegin;
+            pend = view.pend;
+        } else {
+            // Open history file to read, at the size in front of the record
+            if (pos.nPos < sizeof(unsigned int))
+                return error("CBlockUndo::ReadFromDisk : bad position");
+            CDiskBlockPos posSize(pos.nFile, pos.nPos - sizeof(unsigned int));
+            CAutoFile filein = CAutoFile(OpenUndoFile(posSize, true), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+            try {
+                unsigned int nSize;
+                filein >> nSize;
+                if (nSize > MAX_SIZE)
+                    return error("CBlockUndo::ReadFromDisk : record size %u too large", nSize);
+                vchRecord.resize(nSize + sizeof(uint256));
+                filein.read(&vchRecord[0], vchRecord.size());
+            }
+            catch (std::exception &e) {
+                return error("%s : I/O error - %s", __func__, e.what());
+            }
+            pbegin = &vchRecord[0];
+            pend = pbegin + vchRecord.size();
         }
 
         // Verify checksum
+        const char* pchecksum = pend - sizeof(uint256);
+        uint256 hashChecksum;
+        memcpy(hashChecksum.begin(), pchecksum, sizeof(uint256));
         CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
         hasher << hashBlock;
-        hasher << *this;
+        hasher.write(pbegin, pchecksum - pbegin);
         if (hashChecksum != hasher.GetHash())
             return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
 
+        try {
+            DecodeBlockUndo(pbegin, pchecksum, vtxundo);
+        }
+        catch (std::exception &e) {
+            return error("%s : Deserialize error - %s", __func__, e.what());
+        }
         return true;
     }
 };
@@ -474,6 +564,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block's bytes as stored, which is also its network serialization */
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -491,6 +583,8 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
 
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+// The proof of work part of CheckBlock; safe to call without cs_main
+bool CheckBlockProofOfWork(const CBlock& block, CValidationState& state);
 
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
@@ -108,44 +108,103 @@ public:
     }
 };
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool isAux)
+// What the template engine keeps of a mempool transaction. It depends only
+// on the transaction and the outputs it spends, which its txid fixes, so it
+// is worked out once, when the transaction is first considered, and dropped
+// once the transaction has left the mempool. Scripts are not checked again:
+// AcceptToMemoryPool verified them against the stricter standard flags.
+struct CTemplateCandidate
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
+    int64_t nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps; // legacy and P2SH
+    // Coinbase outputs spent, rechecked against the tip for maturity
+    std::vector<COutPoint> vCoinBaseIn;
+};
+
+// Guarded by cs_main
+static map<uint256, CTemplateCandidate> mapTemplateCandidates;
+
+static const CTemplateCandidate* GetTemplateCandidate(const uint256& hash, const CTransaction& tx, CCoinsViewCache& view)
+{
+    map<uint256, CTemplateCandidate>::const_iterator it = mapTemplateCandidates.find(hash);
+    if (it != mapTemplateCandidates.end())
+        return &it->second;
+
+    // The mempool should only hold transactions whose inputs are in the
+    // chain or in the mempool; do not remember the ones that are not, their
+    // parents may still turn up
+    if (!view.HaveInputs(tx))
+    {
+        LogPrintf("ERROR: mempool transaction %s missing input\n", hash.ToString());
+        if (fDebug) assert("mempool transaction missing input" == 0);
         return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (!confAlgoIsSet) {
-      miningAlgo = GetArg("-miningalgo", miningAlgo);
-      confAlgoIsSet = true;
     }
 
-    pblock->SetAuxpow(isAux);
+    CTemplateCandidate candidate;
+    candidate.nFee = view.GetValueIn(tx) - tx.GetValueOut();
+    candidate.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    candidate.nSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (view.GetCoins(txin.prevout.hash).IsCoinBase())
+            candidate.vCoinBaseIn.push_back(txin.prevout);
+    return &mapTemplateCandidates.insert(make_pair(hash, candidate)).first->second;
+}
 
-    // To simulate v3 blocks occuring after nForkHeight
-    if (TestNet() && pindexPrev->nHeight < 300 && miningAlgo==0) pblock->nVersion = 3;
-    //LogPrintf("pindexPrev nHeight = %d while nForkHeight = %d\n",pindexPrev->nHeight,nForkHeight);
-    if (pindexPrev->nHeight >= nForkHeight - 1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
-      //LogPrintf("algo set to %d\n",miningAlgo);
-      //pblock->nVersion = 3;
-      //LogPrintf("pblock nVersion is %d\n",pblock->nVersion);
-      pblock->SetAlgo(miningAlgo);
-      //pblock->SetChainId(Params().GetAuxpowChainId());
-      //LogPrintf("after setting algo to %d, it is %d\n",miningAlgo,pblock->nVersion);
+// A block disconnected since the transaction entered the mempool can have
+// taken the coinbase it spends with it, or made it immature again
+static bool CoinBaseInputsMature(const CTemplateCandidate& candidate, int nSpendHeight)
+{
+    BOOST_FOREACH(const COutPoint& prevout, candidate.vCoinBaseIn)
+    {
+        if (!pcoinsTip->HaveCoins(prevout.hash))
+            return false;
+        const CCoins& coins = pcoinsTip->GetCoins(prevout.hash);
+        if (!coins.IsAvailable(prevout.n) || nSpendHeight - coins.nHeight < COINBASE_MATURITY)
+            return false;
     }
+    return true;
+}
 
-    // Create coinbase tx
-    CTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+// Transactions picked from the mempool for the next block. The choice does
+// not depend on the algorithm, so templates for several algorithms on the
+// same tip share one selection, and only their header and coinbase differ.
+struct CTxSelection
+{
+    uint256 hashPrevBlock;
+    int nHeight;
+    unsigned int nTransactionsUpdated;
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    int64_t nFees;
+    uint64_t nTxSize;
+    unsigned int nSigOps;
+
+    CTxSelection() : nHeight(-1), nTransactionsUpdated(0), nFees(0), nTxSize(0), nSigOps(0) {}
+};
 
-    // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+// Last selection made, reused while the tip and the mempool are unchanged.
+// Guarded by cs_main.
+static CTxSelection txSelection;
+
+static void SelectTransactions(CBlockIndex* pindexPrev, CTxSelection& sel)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    // Height of the block being assembled
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    sel.hashPrevBlock = pindexPrev->GetBlockHash();
+    sel.nHeight = pindexPrev->nHeight;
+    sel.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    sel.vtx.clear();
+    sel.vTxFees.clear();
+    sel.vTxSigOps.clear();
+    sel.nFees = 0;
+    sel.nTxSize = 0;
+    sel.nSigOps = 0;
 
     // Largest block you're willing to create:
     unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
@@ -162,246 +221,294 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool isAux)
     unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    // Collect memory pool transactions into the block
-    int64_t nFees = 0;
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        CCoinsViewCache view(*pcoinsTip, true);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    // Only reads coins for transactions not seen before
+    CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+    CCoinsViewCache view(viewMemPool, true);
 
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+    // Priority order to process transactions
+    list<COrphan> vOrphan; // list memory doesn't move
+    map<uint256, vector<COrphan*> > mapDependers;
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+    // This vector will be sorted into a priority queue:
+    vector<TxPriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        const CTransaction& tx = mi->second.GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+            continue;
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+        const CTemplateCandidate* pcandidate = GetTemplateCandidate(mi->first, tx, view);
+        if (!pcandidate)
+            continue;
 
-            if (porphan)
+        // Has to wait for the parents still in the mempool
+        COrphan* porphan = NULL;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (!mempool.mapTx.count(txin.prevout.hash))
+                continue;
+            if (!porphan)
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                // Use list for automatic deletion
+                vOrphan.push_back(COrphan(&tx));
+                porphan = &vOrphan.back();
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
+            mapDependers[txin.prevout.hash].push_back(porphan);
+            porphan->setDependsOn.insert(txin.prevout.hash);
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        // Priority as of the next block, from what the mempool entry kept
+        double dPriority = mi->second.GetPriority(nHeight);
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb =  double(pcandidate->nFee) / (double(pcandidate->nTxSize)/1000.0);
 
-        while (!vecPriority.empty())
+        if (porphan)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            porphan->dPriority = dPriority;
+            porphan->dFeePerKb = dFeePerKb;
+        }
+        else
+            vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
+    }
+
+    // Forget transactions that have left the mempool
+    for (map<uint256, CTemplateCandidate>::iterator it = mapTemplateCandidates.begin(); it != mapTemplateCandidates.end(); )
+    {
+        if (mempool.mapTx.count(it->first))
+            ++it;
+        else
+            mapTemplateCandidates.erase(it++);
+    }
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+    // Collect transactions into block
+    uint64_t nBlockSize = 1000;
+    uint64_t nBlockTx = 0;
+    int nBlockSigOps = 100;
+    bool fSortedByFee = (nBlockPrioritySize <= 0);
+    set<COutPoint> setSpent;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+    TxPriorityCompare comparer(fSortedByFee);
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().get<0>();
+        double dFeePerKb = vecPriority.front().get<1>();
+        const CTransaction& tx = *(vecPriority.front().get<2>());
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        uint256 hash = tx.GetHash();
+        const CTemplateCandidate& candidate = mapTemplateCandidates[hash];
+
+        // Size limits
+        unsigned int nTxSize = candidate.nTxSize;
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        // Legacy and P2SH limits on sigOps:
+        unsigned int nTxSigOps = candidate.nSigOps;
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            continue;
+
+        // Prioritize by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (!fSortedByFee &&
+            ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        {
+            fSortedByFee = true;
+            comparer = TxPriorityCompare(fSortedByFee);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+        if (!CoinBaseInputsMature(candidate, nHeight))
+            continue;
+
+        // The mempool holds no conflicting transactions, but the block must
+        // not either, whatever state the mempool is in
+        bool fConflict = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setSpent.count(txin.prevout))
+                fConflict = true;
+        if (fConflict)
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setSpent.insert(txin.prevout);
+
+        int64_t nTxFees = candidate.nFee;
+
+        // Added
+        sel.vtx.push_back(tx);
+        sel.vTxFees.push_back(nTxFees);
+        sel.vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        sel.nFees += nTxFees;
+        sel.nTxSize += nTxSize;
+        sel.nSigOps += nTxSigOps;
+
+        if (fPrintPriority)
+        {
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, dFeePerKb, tx.GetHash().ToString());
+        }
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        // Add transactions that depend on this one to the priority queue
+        if (mapDependers.count(hash))
+        {
+            BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                if (!porphan->setDependsOn.empty())
+                {
+                    porphan->setDependsOn.erase(hash);
+                    if (porphan->setDependsOn.empty())
+                    {
+                        vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    }
+                }
             }
+        }
+    }
 
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrint("miner", "SelectTransactions() : %u transactions, total size %u\n", nBlockTx, nBlockSize);
+}
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+// Whether templates for the next block should set the SSF update flag, for
+// each algorithm. Working it out walks back up to nSSF blocks of the
+// algorithm, so it is done once per tip. Guarded by cs_main.
+static CBlockIndex* vpindexSSFChecked[NUM_ALGOS];
+static bool vfUpdateSSF[NUM_ALGOS];
 
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
+static bool NeedsUpdateSSF(CBlockIndex* pindexPrev, int algo)
+{
+    if (vpindexSSFChecked[algo] == pindexPrev)
+        return vfUpdateSSF[algo];
 
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
+    bool fUpdate = true;
+    CBlockIndex * pprev_algo = pindexPrev;
+    if (GetAlgo(pprev_algo->nVersion)!=algo) {
+      pprev_algo = get_pprev_algo(pindexPrev,algo);
+    }
+    if (pprev_algo) {
+      for (int i=0; i<nSSF; i++) {
+        if (update_ssf(pprev_algo->nVersion)) {
+          if (i!=nSSF-1) {
+            fUpdate = false;
+          }
+          break;
+        }
+        pprev_algo = get_pprev_algo(pprev_algo,-1);
+        if (!pprev_algo) break;
+      }
+    }
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    vpindexSSFChecked[algo] = pindexPrev;
+    vfUpdateSSF[algo] = fUpdate;
+    return fUpdate;
+}
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool isAux, int algo)
+{
+    // Create new block
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    if (!confAlgoIsSet) {
+      miningAlgo = GetArg("-miningalgo", miningAlgo);
+      confAlgoIsSet = true;
+    }
+    if (algo < 0)
+        algo = miningAlgo;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+    pblock->SetAuxpow(isAux);
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    // Create coinbase tx
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
 
-	if (pindexPrev->nHeight>=nForkHeight-1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100)) {
-	  //LogPrintf("miner on fork\n");
-	  CBlockIndex * pprev_algo = pindexPrev;
-	  if (GetAlgo(pprev_algo->nVersion)!=miningAlgo) {
-	    pprev_algo = get_pprev_algo(pindexPrev,miningAlgo);
-	  }
-	  if (!pprev_algo) {
-	    //LogPrintf("miner set update ssf\n");
-	    pblock->SetUpdateSSF();
-	  }
-	  else {
-	    //LogPrintf("check for update flag\n");
-	    char update = 1;
-	    for (int i=0; i<nSSF; i++) {
-	      if (update_ssf(pprev_algo->nVersion)) {
-		//LogPrintf("update ssf set on i=%d ago\n",i);
-		if (i!=nSSF-1) {
-		  update = 0;
-		}
-		break;
-	      }
-	      pprev_algo = get_pprev_algo(pprev_algo,-1);
-	      if (!pprev_algo) break;
-	    }
-	    if (update) pblock->SetUpdateSSF();
-	  }
-	}
+    // Add our coinbase tx as first transaction
+    pblock->vtx.push_back(txNew);
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-	//pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev, nFees);
-	pblocktemplate->vTxFees[0] = -nFees;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        bool fOnFork = pindexPrev->nHeight >= nForkHeight - 1 && CBlockIndex::IsSuperMajority(4,pindexPrev,75,100);
+
+        // To simulate v3 blocks occuring after nForkHeight
+        if (TestNet() && pindexPrev->nHeight < 300 && algo==0) pblock->nVersion = 3;
+        if (fOnFork) {
+          pblock->SetAlgo(algo);
+          if (NeedsUpdateSSF(pindexPrev, algo))
+            pblock->SetUpdateSSF();
+        }
 
-	// Fill in header
-	pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-	//printf("create new block with hash prev = %s (height %d)\n",pblock->hashPrevBlock.GetHex().c_str(),pindexPrev->nHeight);
+        // Take the mempool transactions, selecting them afresh only if the tip or
+        // the mempool changed since the last template
+        if (txSelection.hashPrevBlock != pindexPrev->GetBlockHash() ||
+            txSelection.nHeight != pindexPrev->nHeight ||
+            txSelection.nTransactionsUpdated != mempool.GetTransactionsUpdated())
+            SelectTransactions(pindexPrev, txSelection);
+
+        pblock->vtx.insert(pblock->vtx.end(), txSelection.vtx.begin(), txSelection.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), txSelection.vTxFees.begin(), txSelection.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), txSelection.vTxSigOps.begin(), txSelection.vTxSigOps.end());
+        int64_t nFees = txSelection.nFees;
+
+        pblocktemplate->vTxFees[0] = -nFees;
+
+        // Fill in header
+        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+        UpdateTime(*pblock, pindexPrev);
+        pblock->nBits          = GetNextWorkRequired(pindexPrev, algo);
+        pblock->nNonce         = 0;
+        if (algo==ALGO_EQUIHASH) {
+          pblock->nNonce256.SetNull();
+          pblock->nSolution.clear();
+        }
+        pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
-	UpdateTime(*pblock, pindexPrev);
-	pblock->nBits          = GetNextWorkRequired(pindexPrev, miningAlgo);
-	//LogPrintf("create block nBits = %s\n",CBigNum().SetCompact(pblock->nBits).getuint256().GetHex().c_str());
-	pblock->nNonce         = 0;
-	if (miningAlgo==ALGO_EQUIHASH) {
-	  pblock->nNonce256.SetNull();
-	  pblock->nSolution.clear();
-	}
-	pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
-	pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-	
         CBlockIndex indexDummy(*pblock);
         indexDummy.pprev = pindexPrev;
         indexDummy.nHeight = pindexPrev->nHeight + 1;
 
-	pblock->vtx[0].vout[0].nValue = GetBlockValue(&indexDummy, nFees, false);
+        pblock->vtx[0].vout[0].nValue = GetBlockValue(&indexDummy, nFees, false);
 
-        CCoinsViewCache viewNew(*pcoinsTip, true);
-
-        CValidationState state;	
-	
-        if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
-            throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        // The selected transactions were checked on their way into the
+        // mempool and into the selection; only the coinbase and the block
+        // totals are new to this template
+        CValidationState state;
+        if (!CheckTransaction(pblock->vtx[0], state))
+            throw std::runtime_error("CreateNewBlock() : invalid coinbase");
+        uint64_t nBlockSize = ::GetSerializeSize(CBlockHeader(*pblock), SER_NETWORK, PROTOCOL_VERSION) +
+            GetSizeOfCompactSize(pblock->vtx.size()) +
+            ::GetSerializeSize(pblock->vtx[0], SER_NETWORK, PROTOCOL_VERSION) + txSelection.nTxSize;
+        if (nBlockSize > MAX_BLOCK_SIZE)
+            throw std::runtime_error("CreateNewBlock() : block size limit exceeded");
+        if (pblocktemplate->vTxSigOps[0] + txSelection.nSigOps > MAX_BLOCK_SIGOPS)
+            throw std::runtime_error("CreateNewBlock() : block sigop limit exceeded");
     }
 
     return pblocktemplate.release();
@@ -421,7 +528,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->hashMerkleRoot = pblock->ComputeMerkleRoot();
 }
 
 
@@ -478,14 +585,14 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
-CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, bool isAux)
+CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, bool isAux, int algo)
 {
     CPubKey pubkey;
     if (!reservekey.GetReservedKey(pubkey))
         return NULL;
 
     CScript scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
-    return CreateNewBlock(scriptPubKey, isAux);
+    return CreateNewBlock(scriptPubKey, isAux, algo);
 }
 
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
@@ -18,9 +18,10 @@ class CWallet;
 
 /** Run the miner threads */
 void GenerateBitmarks(bool fGenerate, CWallet* pwallet, int nThreads);
-/** Generate a new block, without valid proof-of-work */
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool isAux = false);
-CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, bool isAux = false);
+/** Generate a new block, without valid proof-of-work, for the given
+ * algorithm (miningAlgo if negative) */
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool isAux = false, int algo = -1);
+CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, bool isAux = false, int algo = -1);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
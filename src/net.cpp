@@ -63,7 +63,7 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -690,13 +690,45 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+unsigned int FinishMessageHeader(char* pchMessage, size_t nMessageSize, const unsigned int* pnChecksum)
+{
+    assert(nMessageSize >= CMessageHeader::HEADER_SIZE);
+
+    // Set the size
+    unsigned int nSize = nMessageSize - CMessageHeader::HEADER_SIZE;
+    memcpy(pchMessage + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
+
+    // Set the checksum
+    unsigned int nChecksum = 0;
+    if (pnChecksum) {
+        nChecksum = *pnChecksum;
+    } else {
+        uint256 hash = Hash(pchMessage + CMessageHeader::HEADER_SIZE, pchMessage + nMessageSize);
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
+    memcpy(pchMessage + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+    return nSize;
+}
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const char* pbegin, const char* pend, const unsigned int* pnChecksum)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + (pend - pbegin));
+    ss << CMessageHeader(pszCommand, 0);
+    ss.write(pbegin, pend - pbegin);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    FinishMessageHeader(&(*pmsg)[0], pmsg->size(), pnChecksum);
+    return pmsg;
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CQueuedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = it->GetData();
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -731,6 +763,8 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
+    for (std::deque<CQueuedMessage>::iterator itSent = pnode->vSendMsg.begin(); itSent != it; itSent++)
+        CBufferPool::Instance().Release(itSent->vchData);
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
@@ -1811,13 +1845,10 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    RelayTransaction(tx, hash, MakeSharedMessage("tx", tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSharedMessage& pmsg)
 {
     CInv inv(MSG_TX, hash);
     {
@@ -1829,8 +1860,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved;
+        // every peer that asks for it is sent this one buffer
+        mapRelay.insert(std::make_pair(inv, pmsg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
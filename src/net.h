@@ -26,6 +26,7 @@
 #endif
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -61,6 +62,27 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete network message, header and payload, serialized and
+ * checksummed once. It is immutable, so the one buffer can sit in the send
+ * queues of every peer it goes to. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+// Fill in the size and checksum fields of the header at the start of
+// pchMessage (the checksum is computed unless given); returns the payload size
+unsigned int FinishMessageHeader(char* pchMessage, size_t nMessageSize, const unsigned int* pnChecksum = NULL);
+CSharedMessage MakeSharedMessage(const char* pszCommand, const char* pbegin, const char* pend, const unsigned int* pnChecksum = NULL);
+
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    FinishMessageHeader(&(*pmsg)[0], pmsg->size());
+    return pmsg;
+}
+
 typedef int NodeId;
 
 // Signals for message handling
@@ -110,7 +132,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -192,6 +214,16 @@ public:
 
 
 
+/** A message in a peer's send queue: either its own bytes, or a message
+ * shared with other peers */
+struct CQueuedMessage
+{
+    CSerializeData vchData;
+    CSharedMessage pshared;
+
+    const CSerializeData& GetData() const { return pshared ? *pshared : vchData; }
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -203,7 +235,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CQueuedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -499,22 +531,16 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        unsigned int nSize = FinishMessageHeader(&ssSend[0], ssSend.size());
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        // The message moves into the queue without a copy, and ssSend goes on
+        // with a spare buffer from the pool
+        std::deque<CQueuedMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CQueuedMessage());
+        CBufferPool::Instance().Get(it->vchData);
+        ssSend.GetAndClear(it->vchData);
+        nSendSize += it->vchData.size();
 
         // If write queue empty, attempt "optimistic write"
         if (it == vSendMsg.begin())
@@ -523,6 +549,27 @@ public:
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message made once for many peers by MakeSharedMessage
+    void PushSharedMessage(const CSharedMessage& pmsg)
+    {
+        LOCK(cs_vSend);
+        if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0)
+        {
+            LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+            return;
+        }
+        std::string strCommand(&(*pmsg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+        LogPrint("net", "sending: %s (%d bytes, shared)\n", strCommand.c_str(), pmsg->size() - CMessageHeader::HEADER_SIZE);
+
+        std::deque<CQueuedMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CQueuedMessage());
+        it->pshared = pmsg;
+        nSendSize += pmsg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (it == vSendMsg.begin())
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -722,7 +769,7 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CSharedMessage& pmsg);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
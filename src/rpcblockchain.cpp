@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "rpcserver.h"
+#include "rpcjson.h"
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
@@ -330,6 +331,61 @@ double GetAverageBlockSpacing (const CBlockIndex * blockindex, const int algo, c
   return ((double)nActualTimespan)/((double)averagingInterval)/60.;
 }
 
+static void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& result)
+{
+    result.BeginObject();
+    result.Key("hash").String(block.GetHash().GetHex());
+    result.Key("powhash").String(block.GetPoWHash().GetHex());
+    CMerkleTx txGen(block.vtx[0]);
+    txGen.SetMerkleBranch(&block);
+    result.Key("confirmations").Int(txGen.GetDepthInMainChain());
+    result.Key("size").Int(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.Key("height").Int(blockindex->nHeight);
+    result.Key("version").Int(block.nVersion);
+    int algo = GetAlgo(block.nVersion);
+    result.Key("algo").String(GetAlgoName(algo));
+    bool auxpow = block.IsAuxpow();
+    result.Key("auxpow").Bool(auxpow);
+    if (auxpow) {
+      result.Key("parentblockhash").String(block.auxpow->parentBlock.GetHash().GetHex());
+      result.Key("parentblockpowhash").String(block.auxpow->parentBlock.GetPoWHash().GetHex());
+      if (algo==ALGO_CRYPTONIGHT) {
+	char prev_id [65];
+	const std::vector<unsigned char>& vector_rep = block.auxpow->parentBlock.vector_rep;
+	for (int i=0; i<32; i++) {
+	  // 7 is the typical offset in monero, but not fully general
+	  sprintf(prev_id+2*i,"%02x",vector_rep[i+7]);
+	}
+	result.Key("parentblockprevhash").String(prev_id);
+      }
+      else {
+	result.Key("parentblockprevhash").String(block.auxpow->parentBlock.hashPrevBlock.GetHex());
+      }
+    }
+    result.Key("SSF height").Int(get_ssf_height(blockindex));
+    result.Key("SSF work").Int((int64_t)get_ssf_work(blockindex));
+    result.Key("SSF time").Real(get_ssf_time(blockindex));
+    result.Key("merkleroot").String(block.hashMerkleRoot.GetHex());
+    result.Key("tx").BeginArray();
+    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+        result.String(tx.GetHash().GetHex());
+    result.EndArray();
+    result.Key("time").Int(block.GetBlockTime());
+    result.Key("nonce").UInt(block.nNonce);
+    result.Key("bits").String(HexBits(block.nBits));
+    result.Key("difficulty").Real(GetDifficulty(blockindex,algo));
+    result.Key("chainwork").String(blockindex->nChainWork.GetHex());
+
+    if (blockindex->pprev)
+        result.Key("previousblockhash").String(blockindex->pprev->GetBlockHash().GetHex());
+    CBlockIndex *pnext = chainActive.Next(blockindex);
+    if (pnext)
+        result.Key("nextblockhash").String(pnext->GetBlockHash().GetHex());
+    result.EndObject();
+}
+
+// The same fields as the streaming encoder above, for callers outside the
+// RPC server (the GUI console) that want the tree
 Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
     Object result;
@@ -350,7 +406,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
       result.push_back(Pair("parentblockpowhash",block.auxpow->parentBlock.GetPoWHash().GetHex()));
       if (algo==ALGO_CRYPTONIGHT) {
 	char prev_id [65];
-	std::vector<unsigned char> vector_rep = block.auxpow->parentBlock.vector_rep;
+	const std::vector<unsigned char>& vector_rep = block.auxpow->parentBlock.vector_rep;
 	for (int i=0; i<32; i++) {
 	  // 7 is the typical offset in monero, but not fully general
 	  sprintf(prev_id+2*i,"%02x",vector_rep[i+7]);
@@ -416,6 +472,52 @@ Value getbestblockhash(const Array& params, bool fHelp)
     return chainActive.Tip()->GetBlockHash().GetHex();
 }
 
+// getrawmempool's result written straight to the reply; getrawmempool
+// builds the same as a tree
+static void mempoolToJSON(bool fVerbose, CJSONWriter& result)
+{
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        result.BeginObject();
+        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        {
+            const uint256& hash = entry.first;
+            const CTxMemPoolEntry& e = entry.second;
+            result.Key(hash.ToString()).BeginObject();
+            result.Key("size").Int(e.GetTxSize());
+            result.Key("fee").Amount(e.GetFee());
+            result.Key("time").Int(e.GetTime());
+            result.Key("height").Int(e.GetHeight());
+            result.Key("startingpriority").Real(e.GetPriority(e.GetHeight()));
+            result.Key("currentpriority").Real(e.GetPriority(chainActive.Height()));
+            const CTransaction& tx = e.GetTx();
+            set<string> setDepends;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (mempool.exists(txin.prevout.hash))
+                    setDepends.insert(txin.prevout.hash.ToString());
+            }
+            result.Key("depends").BeginArray();
+            BOOST_FOREACH(const string& strDepend, setDepends)
+                result.String(strDepend);
+            result.EndArray();
+            result.EndObject();
+        }
+        result.EndObject();
+    }
+    else
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        result.BeginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            result.String(hash.ToString());
+        result.EndArray();
+    }
+}
+
 Value getrawmempool(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -493,6 +595,14 @@ Value getrawmempool(const Array& params, bool fHelp)
     }
 }
 
+bool getrawmempool_stream(const Array& params, CJSONWriter& result)
+{
+    if (params.size() > 1)
+        return false;
+    mempoolToJSON(params.size() > 0 && params[0].get_bool(), result);
+    return true;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -516,6 +626,27 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+// The block getblock's parameters name, read from disk
+static CBlockIndex* ReadBlockForRPC(const Array& params, CBlock& block, bool& fVerbose)
+{
+    std::string strHash = params[0].get_str();
+    uint256 hash(strHash);
+
+    fVerbose = true;
+    if (params.size() > 1)
+        fVerbose = params[1].get_bool();
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    return pblockindex;
+}
+
 Value getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -552,20 +683,9 @@ Value getblock(const Array& params, bool fHelp)
             + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
-
-    bool fVerbose = true;
-    if (params.size() > 1)
-        fVerbose = params[1].get_bool();
-
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
+    bool fVerbose;
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex = ReadBlockForRPC(params, block, fVerbose);
 
     if (!fVerbose)
     {
@@ -578,6 +698,29 @@ Value getblock(const Array& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+bool getblock_stream(const Array& params, CJSONWriter& result)
+{
+    if (params.size() < 1 || params.size() > 2)
+        return false;
+
+    bool fVerbose;
+    CBlock block;
+    CBlockIndex* pblockindex = ReadBlockForRPC(params, block, fVerbose);
+
+    if (!fVerbose)
+    {
+        // Hex straight from the serialized block, which with a large
+        // auxpow is most of the reply
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        result.HexString((const unsigned char*)&ssBlock[0], (const unsigned char*)&ssBlock[0] + ssBlock.size());
+        return true;
+    }
+
+    blockToJSON(block, pblockindex, result);
+    return true;
+}
+
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -615,6 +758,45 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getflushstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getflushstats\n"
+            "\nReturns statistics about writing the cached chainstate to disk.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"flushes\": n,              (numeric) Number of flushes since startup\n"
+            "  \"bytes_written\": n,        (numeric) Bytes written to the block index and coin databases by them\n"
+            "  \"stall_ms\": x.xxx,         (numeric) Total time spent flushing, during which block processing waits\n"
+            "  \"max_stall_ms\": x.xxx,     (numeric) Longest single flush\n"
+            "  \"last_flush\": ttt,         (numeric) Time of the last flush in seconds since epoch, 0 if none\n"
+            "  \"dirty_blockindex\": n,     (numeric) Block index entries waiting for the next flush\n"
+            "  \"coins_cache_entries\": n,  (numeric) Entries in the coins cache\n"
+            "  \"coins_cache_limit\": n,    (numeric) Cache entries that trigger a flush (see -dbcache)\n"
+            "  \"flush_interval\": n        (numeric) Seconds between periodic flushes (see -dbflushinterval)\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getflushstats", "")
+            + HelpExampleRpc("getflushstats", "")
+        );
+
+    CFlushStats stats;
+    GetFlushStats(stats);
+
+    Object ret;
+    ret.push_back(Pair("flushes", stats.nFlushes));
+    ret.push_back(Pair("bytes_written", (int64_t)stats.nBytesWritten));
+    ret.push_back(Pair("stall_ms", stats.nStallMicros * 0.001));
+    ret.push_back(Pair("max_stall_ms", stats.nMaxStallMicros * 0.001));
+    ret.push_back(Pair("last_flush", stats.nLastFlush));
+    ret.push_back(Pair("dirty_blockindex", (int)stats.nDirtyBlockIndex));
+    ret.push_back(Pair("coins_cache_entries", (int)stats.nCoinsCacheSize));
+    ret.push_back(Pair("coins_cache_limit", (int)nCoinCacheSize));
+    ret.push_back(Pair("flush_interval", nDbFlushInterval));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -676,7 +858,7 @@ Value gettxout(const Array& params, bool fHelp)
     if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
         return Value::null;
 
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
     if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
@@ -733,6 +915,8 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored, only present if pruning is enabled\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -752,5 +936,12 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",    (double)GetDifficulty(NULL,-1)));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned",        fPruneMode));
+    if (fPruneMode) {
+        CBlockIndex *pindex = chainActive.Tip();
+        while (pindex && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+            pindex = pindex->pprev;
+        obj.push_back(Pair("pruneheight", pindex ? pindex->nHeight : 0));
+    }
     return obj;
 }
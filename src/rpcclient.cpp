@@ -6,6 +6,7 @@
 
 #include "rpcclient.h"
 
+#include "rpcjson.h"
 #include "rpcprotocol.h"
 #include "util.h"
 #include "ui_interface.h"
@@ -84,7 +85,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ParseJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -132,6 +133,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "setgenerate"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "setgenerate"            && n > 1) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getlockstats"           && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getnetworkhashps"       && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getnetworkhashps"       && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getnetworkhashps"       && n > 2) ConvertTo<int64_t>(params[2]);
@@ -159,6 +162,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listaccounts"           && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "getauxblock"            && n == 1) ConvertTo<int64_t>(params[0]);
+    // An algo and a longpollid rather than a block hash and an auxpow
+    if (strMethod == "getauxblock"            && n == 2 && !params[0].get_str().empty() && params[0].get_str().size() <= 2) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listsinceblock"         && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
@@ -0,0 +1,523 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace json_spirit;
+using namespace std;
+
+static const char* const pszHexDigits = "0123456789abcdef";
+
+void CJSONWriter::AppendQuoted(const char* pbegin, const char* pend)
+{
+    str += '"';
+    const char* pclean = pbegin;
+    for (const char* p = pbegin; p != pend; p++)
+    {
+        unsigned char c = *p;
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+            continue;
+        str.append(pclean, p);
+        pclean = p + 1;
+        switch (c)
+        {
+        case '"':  str += "\\\""; break;
+        case '\\': str += "\\\\"; break;
+        case '\b': str += "\\b"; break;
+        case '\f': str += "\\f"; break;
+        case '\n': str += "\\n"; break;
+        case '\r': str += "\\r"; break;
+        case '\t': str += "\\t"; break;
+        default:
+        {
+            // Upper case, as json_spirit writes them
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04X", (unsigned int)c);
+            str += buf;
+        }
+        }
+    }
+    str.append(pclean, pend);
+    str += '"';
+}
+
+CJSONWriter& CJSONWriter::BeginObject()
+{
+    Separate();
+    str += '{';
+    fComma = false;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::EndObject()
+{
+    str += '}';
+    fComma = true;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::BeginArray()
+{
+    Separate();
+    str += '[';
+    fComma = false;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::EndArray()
+{
+    str += ']';
+    fComma = true;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Key(const char* pszKey)
+{
+    Separate();
+    AppendQuoted(pszKey, pszKey + strlen(pszKey));
+    str += ':';
+    fComma = false;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Key(const std::string& strKey)
+{
+    Separate();
+    AppendQuoted(strKey.data(), strKey.data() + strKey.size());
+    str += ':';
+    fComma = false;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::String(const char* psz)
+{
+    Separate();
+    AppendQuoted(psz, psz + strlen(psz));
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::String(const std::string& s)
+{
+    Separate();
+    AppendQuoted(s.data(), s.data() + s.size());
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::HexString(const unsigned char* pbegin, const unsigned char* pend)
+{
+    Separate();
+    size_t nPos = str.size();
+    str.resize(nPos + 2 * (pend - pbegin) + 2);
+    str[nPos++] = '"';
+    for (const unsigned char* p = pbegin; p != pend; p++)
+    {
+        str[nPos++] = pszHexDigits[*p >> 4];
+        str[nPos++] = pszHexDigits[*p & 0x0f];
+    }
+    str[nPos] = '"';
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Int(int64_t n)
+{
+    if (n >= 0)
+        return UInt(n);
+    Separate();
+    // Negated as unsigned, which also holds for the most negative value
+    uint64_t u = -(uint64_t)n;
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    *--p = '-';
+    str.append(p, buf + sizeof(buf));
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::UInt(uint64_t n)
+{
+    Separate();
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    str.append(p, buf + sizeof(buf));
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Real(double d)
+{
+    Separate();
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.8f", d);
+    if (n >= 0 && n < (int)sizeof(buf))
+        str.append(buf, n);
+    else
+        str += strprintf("%.8f", d);
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Amount(int64_t nAmount)
+{
+    Separate();
+    uint64_t u = nAmount < 0 ? -(uint64_t)nAmount : nAmount;
+    char buf[32];
+    char* p = buf + sizeof(buf);
+    // 100000000 satoshis a coin: the last 8 digits are the decimals
+    for (int i = 0; i < 8; i++) {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    }
+    *--p = '.';
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    if (nAmount < 0)
+        *--p = '-';
+    str.append(p, buf + sizeof(buf));
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Bool(bool f)
+{
+    Separate();
+    str += f ? "true" : "false";
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Null()
+{
+    Separate();
+    str += "null";
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Write(const Value& value)
+{
+    switch (value.type())
+    {
+    case obj_type:
+    {
+        BeginObject();
+        const Object& obj = value.get_obj();
+        for (Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+        {
+            Key(it->name_);
+            Write(it->value_);
+        }
+        return EndObject();
+    }
+    case array_type:
+    {
+        BeginArray();
+        const Array& arr = value.get_array();
+        for (Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+            Write(*it);
+        return EndArray();
+    }
+    case str_type:
+        return String(value.get_str());
+    case bool_type:
+        return Bool(value.get_bool());
+    case int_type:
+        return value.is_uint64() ? UInt(value.get_uint64()) : Int(value.get_int64());
+    case real_type:
+        return Real(value.get_real());
+    case null_type:
+    default:
+        return Null();
+    }
+}
+
+CJSONWriter& CJSONWriter::Raw(const std::string& strJSON)
+{
+    Separate();
+    str += strJSON;
+    return *this;
+}
+
+namespace {
+
+// Recursive descent over the text, filling values in place
+class CJSONReader
+{
+private:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    // Deeper than any request, shallow enough for the stack
+    static const int MAX_DEPTH = 512;
+
+    void SkipSpace()
+    {
+        while (p != pend && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\f' || *p == '\v'))
+            p++;
+    }
+
+    bool Literal(const char* psz, size_t nLen)
+    {
+        if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool ParseHexChar(int nDigits, std::string& strRet)
+    {
+        if (pend - p < nDigits)
+            return false;
+        unsigned int n = 0;
+        for (int i = 0; i < nDigits; i++)
+        {
+            int nDigit = HexDigit(*p++);
+            if (nDigit < 0)
+                return false;
+            n = (n << 4) | nDigit;
+        }
+        // json_spirit keeps the low byte of \uXXXX
+        strRet += (char)n;
+        return true;
+    }
+
+    bool ParseString(std::string& strRet)
+    {
+        // At the opening quote
+        p++;
+        const char* pclean = p;
+        while (true)
+        {
+            if (p == pend)
+                return false;
+            char c = *p;
+            if (c == '"')
+                break;
+            if (c != '\\')
+            {
+                p++;
+                continue;
+            }
+            strRet.append(pclean, p);
+            if (++p == pend)
+                return false;
+            switch (*p++)
+            {
+            case '"':  strRet += '"'; break;
+            case '\\': strRet += '\\'; break;
+            case '/':  strRet += '/'; break;
+            case 'b':  strRet += '\b'; break;
+            case 'f':  strRet += '\f'; break;
+            case 'n':  strRet += '\n'; break;
+            case 'r':  strRet += '\r'; break;
+            case 't':  strRet += '\t'; break;
+            case 'u':
+                if (!ParseHexChar(4, strRet))
+                    return false;
+                break;
+            case 'x':
+                if (!ParseHexChar(2, strRet))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+            pclean = p;
+        }
+        strRet.append(pclean, p);
+        p++;
+        return true;
+    }
+
+    bool ParseNumber(Value& valueRet)
+    {
+        const char* pbegin = p;
+        bool fReal = false;
+        if (p != pend && (*p == '-' || *p == '+'))
+            p++;
+        const char* pdigits = p;
+        while (p != pend && *p >= '0' && *p <= '9')
+            p++;
+        bool fDigits = p != pdigits;
+        if (p != pend && *p == '.')
+        {
+            fReal = true;
+            const char* pfrac = ++p;
+            while (p != pend && *p >= '0' && *p <= '9')
+                p++;
+            fDigits = fDigits || p != pfrac;
+        }
+        if (!fDigits)
+            return false;
+        if (p != pend && (*p == 'e' || *p == 'E'))
+        {
+            fReal = true;
+            if (++p != pend && (*p == '-' || *p == '+'))
+                p++;
+            const char* pexp = p;
+            while (p != pend && *p >= '0' && *p <= '9')
+                p++;
+            if (p == pexp)
+                return false;
+        }
+
+        std::string strNumber(pbegin, p);
+        if (fReal)
+        {
+            valueRet = Value(strtod(strNumber.c_str(), NULL));
+            return true;
+        }
+        // Integers are int64 when they fit, uint64 when only that fits
+        errno = 0;
+        char* pparsed;
+        long long n = strtoll(strNumber.c_str(), &pparsed, 10);
+        if (errno == 0)
+        {
+            valueRet = Value((int64_t)n);
+            return true;
+        }
+        if (*pbegin == '-')
+            return false;
+        errno = 0;
+        unsigned long long u = strtoull(strNumber.c_str(), &pparsed, 10);
+        if (errno != 0)
+            return false;
+        valueRet = Value((uint64_t)u);
+        return true;
+    }
+
+    bool ParseValue(Value& valueRet)
+    {
+        SkipSpace();
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+        case '{':
+        {
+            if (++nDepth > MAX_DEPTH)
+                return false;
+            p++;
+            valueRet = Object();
+            Object& obj = valueRet.get_obj();
+            SkipSpace();
+            if (p != pend && *p == '}')
+            {
+                p++;
+                nDepth--;
+                return true;
+            }
+            while (true)
+            {
+                SkipSpace();
+                if (p == pend || *p != '"')
+                    return false;
+                obj.push_back(Pair(std::string(), Value()));
+                if (!ParseString(obj.back().name_))
+                    return false;
+                SkipSpace();
+                if (p == pend || *p++ != ':')
+                    return false;
+                if (!ParseValue(obj.back().value_))
+                    return false;
+                SkipSpace();
+                if (p == pend)
+                    return false;
+                if (*p == '}')
+                    break;
+                if (*p++ != ',')
+                    return false;
+            }
+            p++;
+            nDepth--;
+            return true;
+        }
+        case '[':
+        {
+            if (++nDepth > MAX_DEPTH)
+                return false;
+            p++;
+            valueRet = Array();
+            Array& arr = valueRet.get_array();
+            SkipSpace();
+            if (p != pend && *p == ']')
+            {
+                p++;
+                nDepth--;
+                return true;
+            }
+            while (true)
+            {
+                arr.push_back(Value());
+                if (!ParseValue(arr.back()))
+                    return false;
+                SkipSpace();
+                if (p == pend)
+                    return false;
+                if (*p == ']')
+                    break;
+                if (*p++ != ',')
+                    return false;
+            }
+            p++;
+            nDepth--;
+            return true;
+        }
+        case '"':
+        {
+            std::string strValue;
+            if (!ParseString(strValue))
+                return false;
+            valueRet = Value(strValue);
+            return true;
+        }
+        case 't':
+            valueRet = Value(true);
+            return Literal("true", 4);
+        case 'f':
+            valueRet = Value(false);
+            return Literal("false", 5);
+        case 'n':
+            valueRet = Value();
+            return Literal("null", 4);
+        default:
+            return ParseNumber(valueRet);
+        }
+    }
+
+public:
+    CJSONReader(const std::string& str) : p(str.data()), pend(str.data() + str.size()), nDepth(0) {}
+
+    bool Parse(Value& valueRet)
+    {
+        return ParseValue(valueRet);
+    }
+};
+
+}
+
+bool ParseJSON(const std::string& str, Value& valueRet)
+{
+    CJSONReader reader(str);
+    return reader.Parse(valueRet);
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_RPCJSON_H
+#define BITMARK_RPCJSON_H
+
+#include "json/json_spirit_value.h"
+
+#include <stdint.h>
+#include <string>
+
+/** Streaming JSON encoder. Appends to a string as values are written, with
+ * the output write_string gives for the equivalent json_spirit tree (compact,
+ * reals with 8 decimals, non-printable bytes as \u00XX), so that large RPC
+ * replies can be encoded without building the tree first.
+ *
+ * Commas are placed automatically; an object member is a Key() followed by
+ * one value.
+ */
+class CJSONWriter
+{
+private:
+    std::string& str;
+    // Something was written at the current level, so the next one needs a comma
+    bool fComma;
+
+    void Separate()
+    {
+        if (fComma)
+            str += ',';
+        fComma = true;
+    }
+    void AppendQuoted(const char* pbegin, const char* pend);
+
+public:
+    explicit CJSONWriter(std::string& strIn) : str(strIn), fComma(false) {}
+
+    CJSONWriter& BeginObject();
+    CJSONWriter& EndObject();
+    CJSONWriter& BeginArray();
+    CJSONWriter& EndArray();
+    CJSONWriter& Key(const char* pszKey);
+    CJSONWriter& Key(const std::string& strKey);
+
+    CJSONWriter& String(const char* psz);
+    CJSONWriter& String(const std::string& s);
+    // Lower case hex of a byte range, as HexStr
+    CJSONWriter& HexString(const unsigned char* pbegin, const unsigned char* pend);
+    CJSONWriter& Int(int64_t n);
+    CJSONWriter& UInt(uint64_t n);
+    CJSONWriter& Real(double d);
+    // Exact decimal of an amount in satoshis, as ValueFromAmount prints
+    CJSONWriter& Amount(int64_t nAmount);
+    CJSONWriter& Bool(bool f);
+    CJSONWriter& Null();
+    // A json_spirit value, for the parts not worth encoding by hand
+    CJSONWriter& Write(const json_spirit::Value& value);
+    // Already encoded JSON
+    CJSONWriter& Raw(const std::string& strJSON);
+};
+
+/** Parse a JSON text into a json_spirit value, as read_string does, with a
+ * hand-written parser in place of the much slower Spirit grammar. Content
+ * after the first value is ignored. */
+bool ParseJSON(const std::string& str, json_spirit::Value& valueRet);
+
+#endif // BITMARK_RPCJSON_H
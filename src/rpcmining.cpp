@@ -55,10 +55,76 @@ void ShutdownRPCMining()
 
 /* Set mining algo here for rpc mining */
 int miningAlgo = ALGO_SCRYPT;
-int miningAlgoGBT = miningAlgo;
-int miningAlgoGAB = miningAlgo;
 bool confAlgoIsSet = false;
 
+// Algorithm asked for by a getblocktemplate/getauxblock request, or
+// miningAlgo if the request names none
+static int GetRequestedAlgo(const Value& value)
+{
+    if (value.type() == null_type) {
+        if (!confAlgoIsSet) {
+            miningAlgo = GetArg("-miningalgo", miningAlgo);
+            confAlgoIsSet = true;
+        }
+        return miningAlgo;
+    }
+    int algo = value.get_int();
+    if (algo < 0 || algo >= NUM_ALGOS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid algo");
+    return algo;
+}
+
+// Long polling (BIP 22). A longpollid names the tip and the mempool state a
+// template was built from; a request carrying one waits until the tip moves
+// on or, checked after a minute and then every ten seconds, the mempool has
+// changed, so that pools need not poll for new work.
+static std::string GetLongPollId(const CBlockIndex* pindexPrev, unsigned int nTransactionsUpdated)
+{
+    return pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdated);
+}
+
+static void WaitForLongPoll(const std::string& strLongPollId)
+{
+    if (strLongPollId.size() <= 64)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    uint256 hashWatchedChain;
+    hashWatchedChain.SetHex(strLongPollId.substr(0, 64));
+    unsigned int nTransactionsUpdatedWatched = atoi64(strLongPollId.substr(64));
+
+    boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && !ShutdownRequested())
+    {
+        if (!cvBlockChange.timed_wait(lock, checktxtime))
+        {
+            // Timeout: check transactions for update
+            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedWatched)
+                break;
+            checktxtime += boost::posix_time::seconds(10);
+        }
+    }
+    if (ShutdownRequested())
+        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+}
+
+// Last template handed out for one algorithm. Each algorithm has its own,
+// so requests for different algorithms do not invalidate each other's work.
+struct CAlgoTemplateCache
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nStart;
+    CBlockTemplate* pblocktemplate;
+
+    CAlgoTemplateCache() : pindexPrev(NULL), nTransactionsUpdatedLast(0), nStart(0), pblocktemplate(NULL) {}
+
+    bool IsStale(int64_t nMaxAge) const
+    {
+        return pindexPrev != chainActive.Tip() ||
+            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > nMaxAge);
+    }
+};
+
 // Return average network hashes per second based on the last 'lookup' blocks,
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
@@ -509,7 +575,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
-            "         ]\n"
+            "         ],\n"
+            "       \"algo\":n             (numeric, optional) The algorithm to mine, see getminingalgo; default the one set by setminingalgo\n"
+            "       \"longpollid\":\"id\"     (string, optional) The longpollid of a previous template: wait until the tip or the mempool changes\n"
             "     }\n"
             "\n"
 
@@ -548,6 +616,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) compressed target of next block\n"
             "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"longpollid\" : \"xxx\"           (string) Pass back in the request to wait for work newer than this template\n"
             "}\n"
 
             "\nExamples:\n"
@@ -556,9 +625,13 @@ Value getblocktemplate(const Array& params, bool fHelp)
          );
 
     std::string strMode = "template";
+    Value algoval;
+    Value lpval;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        algoval = find_value(oparam, "algo");
+        lpval = find_value(oparam, "longpollid");
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -579,37 +652,43 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
 
+    int algo = GetRequestedAlgo(algoval);
+
+    // Not under cs_main while waiting: this call is marked thread-safe
+    if (lpval.type() != null_type)
+        WaitForLongPoll(lpval.get_str());
+
     // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() || miningAlgo != miningAlgoGBT ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    static CCriticalSection cs_blockTemplateCache;
+    LOCK2(cs_main, cs_blockTemplateCache);
+    static CAlgoTemplateCache vTemplateCache[NUM_ALGOS];
+    CAlgoTemplateCache& cache = vTemplateCache[algo];
+    if (cache.IsStale(5))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
+        cache.pindexPrev = NULL;
 
         // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        cache.nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
+        cache.nStart = GetTime();
 
         // Create new block
-        if(pblocktemplate)
+        if(cache.pblocktemplate)
         {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
+            delete cache.pblocktemplate;
+            cache.pblocktemplate = NULL;
         }
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
+        cache.pblocktemplate = CreateNewBlock(scriptDummy, false, algo);
+        if (!cache.pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
         // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-	miningAlgoGBT = miningAlgo;
+        cache.pindexPrev = pindexPrevNew;
     }
+    CBlockIndex* pindexPrev = cache.pindexPrev;
+    CBlockTemplate* pblocktemplate = cache.pblocktemplate;
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
@@ -678,6 +757,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", GetLongPollId(pindexPrev, cache.nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -726,14 +806,17 @@ Value submitblock(const Array& params, bool fHelp)
 
 Value getauxblock(const Array& params, bool fHelp)
 {
-  if (fHelp || (params.size() != 0 && params.size() != 2))
+  if (fHelp || params.size() > 2)
     throw runtime_error(
-			"getauxblock (hash auxpow)\n"
+			"getauxblock (algo (\"longpollid\")) (hash auxpow)\n"
 	                "\nCreate or submit a merge-mined block.\n"
-	                "\nWithout arguments, create a new block and return information\n"
-	                "required to merge-mine it.  With arguments, submit a solved\n"
+	                "\nWith no arguments or an algo, create a new block and return information\n"
+	                "required to merge-mine it.  With a hash and an auxpow, submit a solved\n"
 	                "auxpow for a previously returned block.\n"
-	                "\nArguments:\n"
+	                "\nArguments (create):\n"
+	                "1. algo        (numeric, optional) algorithm to mine; default the one set by setminingalgo\n"
+	                "2. \"longpollid\" (string, optional) longpollid of a previous result: wait until the tip or the mempool changes\n"
+	                "\nArguments (submit):\n"
 	                "1. \"hash\"    (string, optional) hash of the block to submit\n"
 	                "2. \"auxpow\"  (string, optional) serialised auxpow found\n"
 	                "\nResult (without arguments):\n"
@@ -745,6 +828,7 @@ Value getauxblock(const Array& params, bool fHelp)
 	                "  \"bits\"               (string) compressed target of the block\n"
 	                "  \"height\"             (numeric) height of the block\n"
 	                "  \"target\"             (string) target in reversed byte order\n"
+	                "  \"longpollid\"         (string) pass back to wait for work newer than this block\n"
 			"{\n"
 			"  \"hash\"               (string) hash of the created block\n"
 			"  \"chainid\"            (numeric) chain ID for this block\n"
@@ -758,6 +842,8 @@ Value getauxblock(const Array& params, bool fHelp)
 			"xxxxx        (boolean) whether the submitted block was correct\n"
 			"\nExamples:\n"
 			+ HelpExampleCli("getauxblock", "")
+			+ HelpExampleCli("getauxblock", "2")
+			+ HelpExampleCli("getauxblock", "2 \"longpollid\"")
 			+ HelpExampleCli("getauxblock", "\"hash\" \"serialised auxpow\"")
 			+ HelpExampleRpc("getauxblock", "")
 			);
@@ -767,50 +853,72 @@ Value getauxblock(const Array& params, bool fHelp)
     throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Bitmark is not connected!");
   if (IsInitialBlockDownload())
     throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitmark is downloading blocks...");
+  // An algo first asks for a new block, a hash for a submission
+  bool fCreate = params.size() < 2 || params[0].type() == int_type;
+  if (fCreate && params.size() == 2)
+    WaitForLongPoll(params[1].get_str());
+  LOCK2(cs_main, pwalletMain->cs_wallet);
   static CCriticalSection cs_auxblockCache;
   LOCK(cs_auxblockCache);
   static std::map<uint256, CBlock*> mapNewBlock;
   static std::vector<CBlockTemplate*> vNewBlockTemplate;
-  if (params.size() == 0) {
-    static unsigned nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev = NULL;
-    static uint64_t nStart;
-    static CBlockTemplate* pblocktemplate;
+  static CAlgoTemplateCache vTemplateCache[NUM_ALGOS];
+  // The tip the blocks in mapNewBlock were last swept against
+  static CBlockIndex* pindexNewBlock = NULL;
+  if (fCreate) {
+    int algo = GetRequestedAlgo(params.size() > 0 ? params[0] : Value::null);
+    CAlgoTemplateCache& cache = vTemplateCache[algo];
     static unsigned int nExtraNonce = 0;
     CReserveKey reservekey(pwalletMain);
 
     {
       LOCK(cs_main);
-      if (pindexPrev != chainActive.Tip() || miningAlgo != miningAlgoGAB
-	  || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast
-	      && GetTime() - nStart > 60)) {
-	if (pindexPrev != chainActive.Tip()) {
-	  mapNewBlock.clear();
-	  BOOST_FOREACH(CBlockTemplate* pbt, vNewBlockTemplate)
+      CBlockIndex* pindexTip = chainActive.Tip();
+      if (pindexNewBlock != pindexTip) {
+	// Drop only the work built on an older tip: blocks already handed out
+	// for the new one, whatever their algorithm, stay submittable
+	uint256 hashTip = pindexTip->GetBlockHash();
+	for (std::map<uint256, CBlock*>::iterator mi = mapNewBlock.begin(); mi != mapNewBlock.end(); ) {
+	  if (mi->second->hashPrevBlock != hashTip)
+	    mapNewBlock.erase(mi++);
+	  else
+	    mi++;
+	}
+	for (int i = 0; i < NUM_ALGOS; i++)
+	  if (vTemplateCache[i].pindexPrev != pindexTip)
+	    vTemplateCache[i] = CAlgoTemplateCache();
+	std::vector<CBlockTemplate*> vKeep;
+	BOOST_FOREACH(CBlockTemplate* pbt, vNewBlockTemplate) {
+	  if (pbt->block.hashPrevBlock == hashTip)
+	    vKeep.push_back(pbt);
+	  else
 	    delete pbt;
-	  vNewBlockTemplate.clear();
 	}
+	vNewBlockTemplate.swap(vKeep);
+	pindexNewBlock = pindexTip;
+      }
 
-	pblocktemplate = CreateNewBlockWithKey(reservekey, true);
-	if (!pblocktemplate)
+      if (cache.IsStale(60)) {
+	cache.pblocktemplate = CreateNewBlockWithKey(reservekey, true, algo);
+	if (!cache.pblocktemplate)
 	  throw JSONRPCError(RPC_OUT_OF_MEMORY, "out of memory");
 
-	nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-	pindexPrev = chainActive.Tip();
-	nStart = GetTime();
+	cache.nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+	cache.pindexPrev = chainActive.Tip();
+	cache.nStart = GetTime();
 
-	CBlock* pblock = &pblocktemplate->block;
-	IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+	CBlock* pblock = &cache.pblocktemplate->block;
+	IncrementExtraNonce(pblock, cache.pindexPrev, nExtraNonce);
 	pblock->SetChainId(Params().GetAuxpowChainId());
 	pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
 	mapNewBlock[pblock->GetHash()] = pblock;
-	vNewBlockTemplate.push_back(pblocktemplate);
-	miningAlgoGAB = miningAlgo;
+	vNewBlockTemplate.push_back(cache.pblocktemplate);
       }	    	  
     }
 
-    const CBlock& block = pblocktemplate->block;
+    CBlockIndex* pindexPrev = cache.pindexPrev;
+    const CBlock& block = cache.pblocktemplate->block;
 
     uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
@@ -836,6 +944,7 @@ Value getauxblock(const Array& params, bool fHelp)
     result.push_back(Pair("version",block.nVersion));
     result.push_back(Pair("curtime", (int64_t)block.nTime));
     result.push_back(Pair("scriptsig",HexStr(block.vtx[0].vin[0].scriptSig)));
+    result.push_back(Pair("longpollid", GetLongPollId(pindexPrev, cache.nTransactionsUpdatedLast)));
 
     return result;
   }
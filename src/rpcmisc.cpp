@@ -669,3 +669,72 @@ Value chaindynamics(const Array& params, bool fHelp)
 
     return obj;
 }
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getlockstats ( enable reset )\n"
+            "\nReturns lock contention statistics per LOCK site, most waited on first.\n"
+            "Profiling is off unless bitmarkd was started with -lockstats or it is enabled here.\n"
+            "\nArguments:\n"
+            "1. enable     (boolean, optional) Switch profiling on or off\n"
+            "2. reset      (boolean, optional, default=false) Clear the statistics after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,        (boolean) whether profiling is on\n"
+            "  \"sites\": [\n"
+            "    {\n"
+            "      \"lock\": \"name\",           (string) the locked critical section, e.g. cs_main\n"
+            "      \"site\": \"file:line\",      (string) where it was locked\n"
+            "      \"count\": n,               (numeric) times locked\n"
+            "      \"contended\": n,           (numeric) times the lock was already held by another thread\n"
+            "      \"wait_ms\": x.xxx,         (numeric) total time spent waiting\n"
+            "      \"maxwait_ms\": x.xxx,      (numeric) longest wait\n"
+            "      \"hold_ms\": x.xxx,         (numeric) total time held\n"
+            "      \"maxhold_ms\": x.xxx,      (numeric) longest hold\n"
+            "      \"hold_histogram\": {...}   (object) hold counts by duration (<10us, <100us, <1ms, <10ms, <100ms, <1s, >=1s)\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockstats", "true")
+            + HelpExampleCli("getlockstats", "")
+            + HelpExampleRpc("getlockstats", "true, true")
+        );
+
+    if (params.size() > 0)
+        fLockStats = params[0].get_bool();
+    bool fReset = params.size() > 1 && params[1].get_bool();
+
+    static const char* pszBuckets[LOCKSTATS_BUCKETS] = { "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+
+    std::vector<CLockSiteStats> vStats;
+    GetLockStats(vStats);
+    if (fReset)
+        ResetLockStats();
+
+    Array sites;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        Object site;
+        site.push_back(Pair("lock", stats.strName));
+        site.push_back(Pair("site", strprintf("%s:%d", stats.strFile, stats.nLine)));
+        site.push_back(Pair("count", (boost::uint64_t)stats.nCount));
+        site.push_back(Pair("contended", (boost::uint64_t)stats.nContended));
+        site.push_back(Pair("wait_ms", stats.nWaitMicros * 0.001));
+        site.push_back(Pair("maxwait_ms", stats.nMaxWaitMicros * 0.001));
+        site.push_back(Pair("hold_ms", stats.nHoldMicros * 0.001));
+        site.push_back(Pair("maxhold_ms", stats.nMaxHoldMicros * 0.001));
+        Object histogram;
+        for (int i = 0; i < LOCKSTATS_BUCKETS; i++)
+            histogram.push_back(Pair(pszBuckets[i], (boost::uint64_t)stats.vHoldHistogram[i]));
+        site.push_back(Pair("hold_histogram", histogram));
+        sites.push_back(site);
+    }
+
+    Object obj;
+    obj.push_back(Pair("enabled", (bool)fLockStats));
+    obj.push_back(Pair("sites", sites));
+    return obj;
+}
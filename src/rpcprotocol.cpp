@@ -6,6 +6,7 @@
 
 #include "rpcprotocol.h"
 
+#include "rpcjson.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -80,6 +81,7 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -241,8 +243,19 @@ Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 
 string JSONRPCReply(const Value& result, const Value& error, const Value& id)
 {
-    Object reply = JSONRPCReplyObj(result, error, id);
-    return write_string(Value(reply), false) + "\n";
+    string strReply;
+    CJSONWriter writer(strReply);
+    writer.BeginObject();
+    writer.Key("result");
+    if (error.type() != null_type)
+        writer.Null();
+    else
+        writer.Write(result);
+    writer.Key("error").Write(error);
+    writer.Key("id").Write(id);
+    writer.EndObject();
+    strReply += '\n';
+    return strReply;
 }
 
 Object JSONRPCError(int code, const string& message)
@@ -9,21 +9,26 @@
 #include "base58.h"
 #include "init.h"
 #include "main.h"
+#include "rpcjson.h"
 #include "ui_interface.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #endif
 
+#include <deque>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "json/json_spirit_writer_template.h"
 
 using namespace std;
@@ -41,6 +46,14 @@ static boost::thread_group* rpc_worker_group = NULL;
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
 
+// New best block notifications (-blocknotifyport): every local connection
+// gets a line "<hash> <height>\n" per new tip. Nothing is read from them, and
+// one that lets its socket buffer fill up is dropped rather than allowed to
+// stall block processing.
+static boost::shared_ptr<ip::tcp::acceptor> blocknotify_acceptor;
+static std::list< boost::shared_ptr<ip::tcp::socket> > blocknotify_sockets;
+static CCriticalSection cs_blocknotify;
+
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
                   bool fAllowNull)
@@ -231,6 +244,7 @@ static const CRPCCommand vRPCCommands[] =
     { "cd", 			&chaindynamics, 	 true, 	    false, 	false},
     { "help",                   &help,                   true,      true,       false },
     { "stop",                   &stop,                   true,      true,       false },
+    { "getlockstats",           &getlockstats,           true,      true,       false },
 
     /* P2P networking */
     { "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
@@ -257,17 +271,18 @@ static const CRPCCommand vRPCCommands[] =
     { "gbbh",                   &getbestblockhash,       true,      false,      false },
     { "getblockcount",          &getblockcount,          true,      false,      false },
     { "gbc",                    &getblockcount,          true,      false,      false },
-    { "getblock",               &getblock,               true,      false,      false },
-    { "gb",                     &getblock,               true,      false,      false },
+    { "getblock",               &getblock,               true,      false,      false,     &getblock_stream },
+    { "gb",                     &getblock,               true,      false,      false,     &getblock_stream },
     { "getblockhash",           &getblockhash,           true,      false,      false },
     { "gbh",                    &getblockhash,           true,      false,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "grmp",                   &getrawmempool,          true,      false,      false },
+    { "getrawmempool",          &getrawmempool,          true,      false,      false,     &getrawmempool_stream },
+    { "grmp",                   &getrawmempool,          true,      false,      false,     &getrawmempool_stream },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "gtxo",                   &gettxout,               true,      false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
     { "gtxosi",                 &gettxoutsetinfo,        true,      false,      false },
     { "verifychain",            &verifychain,            true,      false,      false },
+    { "getflushstats",          &getflushstats,          true,      false,      false },
     { "vc",                     &verifychain,            true,      false,      false },
     { "getblockspacing",        &getblockspacing,        true,      false,      false },
     { "gbs",        		&getblockspacing,        true,      false,      false },
@@ -279,16 +294,16 @@ static const CRPCCommand vRPCCommands[] =
     { "gd",                     &getdifficulty,          true,      false,      false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "gbt",                    &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
+    { "gbt",                    &getblocktemplate,       true,      true,       false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "gmi",                    &getmininginfo,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "gnhps",                  &getnetworkhashps,       true,      false,      false },
     { "submitblock",            &submitblock,            true,     false,      false },
     { "sb",                     &submitblock,            true,     false,      false },
-    { "getauxblock",            &getauxblock,            true,     false,      false },
-    { "gab",            	&getauxblock,            true,     false,      false },
+    { "getauxblock",            &getauxblock,            true,     true,       false },
+    { "gab",            	&getauxblock,            true,     true,       false },
 
     /* Raw transactions */
     { "createrawtransaction",   &createrawtransaction,   true,     false,      false },
@@ -346,11 +361,11 @@ static const CRPCCommand vRPCCommands[] =
     { "gub",                    &getunconfirmedbalance,  false,     false,      true },
     { "getwalletinfo",          &getwalletinfo,          false,      false,      true },
     { "gwi",                    &getwalletinfo,          false,      false,      true },
-    { "importprivkey",          &importprivkey,          true,     false,      true },
-    { "ipk",                    &importprivkey,          true,     false,      true },
-    { "importwallet",           &importwallet,           true,     false,      true },
-    { "importaddress",          &importaddress,          true,     false,      true },
-    { "iw",                     &importwallet,           true,     false,      true },
+    { "importprivkey",          &importprivkey,          true,     true,       true },
+    { "ipk",                    &importprivkey,          true,     true,       true },
+    { "importwallet",           &importwallet,           true,     true,       true },
+    { "importaddress",          &importaddress,          true,     true,       true },
+    { "iw",                     &importwallet,           true,     true,       true },
     { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "kpr",                    &keypoolrefill,          true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
@@ -437,15 +452,15 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string ErrorReply(const Object& objError, const Value& id)
 {
-    // Send error reply from json-rpc error object
+    // HTTP error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -471,120 +486,155 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
-
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
-
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+/**
+ * Bounded queue of RPC requests, served by its own worker threads. Requests
+ * past the depth limit are refused instead of queued, so a burst cannot pile
+ * up unbounded work behind slow handlers.
+ */
+class CRPCWorkQueue
 {
-public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+private:
+    boost::mutex cs;
+    CConditionVariable cond;
+    std::deque< boost::function<void()> > queue;
+    size_t nMaxDepth;
+    bool fRunning;
+    boost::thread_group threads;
+
+    void Run()
     {
+        while (true)
+        {
+            boost::function<void()> func;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    return;
+                func = queue.front();
+                queue.pop_front();
+            }
+            func();
+        }
     }
 
-    virtual std::iostream& stream()
+public:
+    CRPCWorkQueue(size_t nMaxDepthIn, int nThreads) : nMaxDepth(nMaxDepthIn), fRunning(true)
     {
-        return _stream;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CRPCWorkQueue::Run, this));
     }
 
-    virtual std::string peer_address_to_string() const
+    bool Enqueue(const boost::function<void()>& func)
     {
-        return peer.address().to_string();
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (!fRunning || queue.size() >= nMaxDepth)
+                return false;
+            queue.push_back(func);
+        }
+        cond.notify_one();
+        return true;
     }
 
-    virtual void close()
+    // Finish the requests being run, drop the queued ones
+    void Stop()
     {
-        _stream.close();
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fRunning = false;
+            queue.clear();
+        }
+        cond.notify_all();
+        threads.join_all();
     }
+};
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+// Handlers run under cs_main (those not marked threadSafe) are serialized by
+// it anyway. They get a queue and a worker of their own, so that thread-safe
+// handlers never wait in line behind them.
+static CRPCWorkQueue* rpc_queue_concurrent = NULL;
+static CRPCWorkQueue* rpc_queue_locked = NULL;
 
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+static bool RPCRunsLocked(const Value& valRequest)
+{
+    if (valRequest.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(valRequest.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && !pcmd->threadSafe;
+}
 
-void ServiceConnection(AcceptedConnection *conn);
+static CRPCWorkQueue* RPCWorkQueueFor(const Value& valRequest)
+{
+    if (valRequest.type() == array_type)
+    {
+        BOOST_FOREACH(const Value& req, valRequest.get_array())
+            if (RPCRunsLocked(req))
+                return rpc_queue_locked;
+        return rpc_queue_concurrent;
+    }
+    return RPCRunsLocked(valRequest) ? rpc_queue_locked : rpc_queue_concurrent;
+}
 
-// Forward declaration required for RPCListen
-template <typename Protocol>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol> > acceptor,
+class CRPCConnection;
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor, ssl::context& context, bool fUseSSL);
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error);
 
-/**
- * Sets up I/O resources to accept and handle a new connection.
- */
-template <typename Protocol>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol> > acceptor,
-                   ssl::context& context,
-                   const bool fUseSSL)
-{
-    // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
+static void BlockNotifyListen(boost::shared_ptr<ip::tcp::acceptor> acceptor);
 
-    acceptor->async_accept(
-            conn->sslStream.lowest_layer(),
-            conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol>,
-                acceptor,
-                boost::ref(context),
-                fUseSSL,
-                conn,
-                _1));
-}
-
-
-/**
- * Accept and handle incoming connection.
- */
-template <typename Protocol>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol> > acceptor,
-                             ssl::context& context,
-                             const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
-                             const boost::system::error_code& error)
+static void BlockNotifyAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
+                                     boost::shared_ptr<ip::tcp::socket> socket,
+                                     const boost::system::error_code& error)
 {
-    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
-    if (error != asio::error::operation_aborted && acceptor->is_open())
-        RPCListen(acceptor, context, fUseSSL);
-
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
+    if (error == asio::error::operation_aborted || !acceptor->is_open())
+        return;
+    BlockNotifyListen(acceptor);
 
     if (error)
     {
-        // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
+        return;
     }
-    // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
-    // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    boost::system::error_code ec;
+    socket->non_blocking(true, ec);
+    if (ec)
+        return;
+    LOCK(cs_blocknotify);
+    blocknotify_sockets.push_back(socket);
+}
+
+static void BlockNotifyListen(boost::shared_ptr<ip::tcp::acceptor> acceptor)
+{
+    boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(*rpc_io_service));
+    acceptor->async_accept(*socket, boost::bind(&BlockNotifyAcceptHandler, acceptor, socket, _1));
+}
+
+static void PublishBlockTip(const uint256& hash, int nHeight)
+{
+    std::string strLine = strprintf("%s %d\n", hash.GetHex(), nHeight);
+
+    LOCK(cs_blocknotify);
+    std::list< boost::shared_ptr<ip::tcp::socket> >::iterator it = blocknotify_sockets.begin();
+    while (it != blocknotify_sockets.end())
     {
-        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        conn->close();
-    }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
+        boost::system::error_code ec;
+        asio::write(**it, asio::buffer(strLine), ec);
+        if (ec)
+        {
+            LogPrint("rpc", "Dropping block notification listener: %s\n", ec.message());
+            (*it)->close(ec);
+            blocknotify_sockets.erase(it++);
+        }
+        else
+            ++it;
     }
 }
 
@@ -703,9 +753,37 @@ void StartRPCThreads()
         return;
     }
 
+    if (mapArgs.count("-blocknotifyport"))
+    {
+        // Local listeners only
+        ip::tcp::endpoint notifyEndpoint(asio::ip::address_v4::loopback(), GetArg("-blocknotifyport", 0));
+        try
+        {
+            blocknotify_acceptor.reset(new ip::tcp::acceptor(*rpc_io_service));
+            blocknotify_acceptor->open(notifyEndpoint.protocol());
+            blocknotify_acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+            blocknotify_acceptor->bind(notifyEndpoint);
+            blocknotify_acceptor->listen(socket_base::max_connections);
+            BlockNotifyListen(blocknotify_acceptor);
+            uiInterface.NotifyBlockTip.connect(&PublishBlockTip);
+        }
+        catch(boost::system::system_error &e)
+        {
+            uiInterface.ThreadSafeMessageBox(strprintf(_("An error occurred while setting up the block notification port %u for listening: %s"), notifyEndpoint.port(), e.what()),
+                                             "", CClientUIInterface::MSG_ERROR);
+            StartShutdown();
+            return;
+        }
+    }
+
+    // Calls that run under cs_main take turns anyway: give them one thread
+    // of their own, so that they cannot hold up the thread-safe ones
+    int nWorkQueue = std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORKQUEUE), 1);
+    rpc_queue_concurrent = new CRPCWorkQueue(nWorkQueue, std::max((int)GetArg("-rpcthreads", 4), 1));
+    rpc_queue_locked = new CRPCWorkQueue(nWorkQueue, 1);
+
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
 }
 
 void StartDummyRPCThread()
@@ -736,6 +814,18 @@ void StopRPCThreads()
             LogPrintf("%s: Warning: %s when cancelling acceptor", __func__, ec.message());
     }
     rpc_acceptors.clear();
+    uiInterface.NotifyBlockTip.disconnect(&PublishBlockTip);
+    if (blocknotify_acceptor)
+    {
+        blocknotify_acceptor->cancel(ec);
+        blocknotify_acceptor->close(ec);
+    }
+    {
+        LOCK(cs_blocknotify);
+        BOOST_FOREACH(const boost::shared_ptr<ip::tcp::socket>& socket, blocknotify_sockets)
+            socket->close(ec);
+        blocknotify_sockets.clear();
+    }
     BOOST_FOREACH(const PAIRTYPE(std::string, boost::shared_ptr<deadline_timer>) &timer, deadlineTimers)
     {
         timer.second->cancel(ec);
@@ -744,11 +834,25 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    // Wake up long-polling requests, which give up on shutdown
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+    }
+    cvBlockChange.notify_all();
+
+    if (rpc_queue_concurrent != NULL)
+        rpc_queue_concurrent->Stop();
+    if (rpc_queue_locked != NULL)
+        rpc_queue_locked->Stop();
+
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    blocknotify_acceptor.reset();
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
+    delete rpc_queue_concurrent; rpc_queue_concurrent = NULL;
+    delete rpc_queue_locked; rpc_queue_locked = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -814,16 +918,30 @@ void JSONRequest::parse(const Value& valRequest)
 }
 
 
-static Object JSONRPCExecOne(const Value& req)
+// Append the reply to a parsed request, its result written without building
+// a json_spirit tree. On an exception, what was appended is left behind.
+static void JSONRPCExecReply(const JSONRequest& jreq, string& strReply)
 {
+    CJSONWriter writer(strReply);
+    writer.BeginObject();
+    writer.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, writer);
+    writer.Key("error").Null();
+    writer.Key("id").Write(jreq.id);
+    writer.EndObject();
+}
+
+static void JSONRPCExecOne(const Value& req, string& strReply)
+{
+    size_t nMark = strReply.size();
     Object rpc_result;
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        JSONRPCExecReply(jreq, strReply);
+        return;
     }
     catch (Object& objError)
     {
@@ -835,101 +953,459 @@ static Object JSONRPCExecOne(const Value& req)
                                      JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
     }
 
-    return rpc_result;
+    strReply.resize(nMark);
+    CJSONWriter(strReply).Write(rpc_result);
 }
 
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
+    string strReply = "[";
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    {
+        if (reqIdx > 0)
+            strReply += ',';
+        JSONRPCExecOne(vReq[reqIdx], strReply);
+    }
+    strReply += "]\n";
 
-    return write_string(Value(ret), false) + "\n";
+    return strReply;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+// End of the HTTP headers: an empty line, with or without the CR
+typedef asio::buffers_iterator<asio::streambuf::const_buffers_type> HTTPBufferIterator;
+
+static std::pair<HTTPBufferIterator, bool> MatchHTTPHeadersEnd(HTTPBufferIterator begin, HTTPBufferIterator end)
 {
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    for (HTTPBufferIterator it = begin; it != end; ++it)
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        if (*it != '\n')
+            continue;
+        HTTPBufferIterator next = it;
+        ++next;
+        if (next != end && *next == '\r')
+            ++next;
+        if (next == end)
+            return std::make_pair(it, false);
+        if (*next == '\n')
+            return std::make_pair(++next, true);
+    }
+    return std::make_pair(end, false);
+}
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+/**
+ * An RPC client connection, served asynchronously. Each request is handed to
+ * a work queue as soon as it has been read, and the next one is read while
+ * it runs (pipelining, up to MAX_RPC_PIPELINE requests). Replies go out in
+ * request order as they finish. Everything but Execute runs on the strand.
+ */
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
+{
+private:
+    asio::io_service::strand strand;
+    asio::streambuf bufRecv;
+    deadline_timer timer;
+    bool fUseSSL;
+
+    // The request being read. bufRecv only ever holds headers; the body
+    // gets a buffer of its own once the headers give its length
+    int nReqProto;
+    string strReqURI;
+    map<string, string> mapReqHeaders;
+    int nReqLength;
+    string strReqBody;
+
+    // Sequence numbers of the next request to read and the next reply to send
+    uint64_t nNextRequest, nNextReply;
+    // Replies that wait for earlier ones
+    map<uint64_t, string> mapReplies;
+    string strSending;
+    bool fReading, fWriting;
+    // Once closing, nothing more is read, and the connection closes after
+    // the reply to request nCloseAfter
+    bool fClosing;
+    uint64_t nCloseAfter;
+
+    template <typename Handler>
+    void AsyncReadHeaders(Handler handler)
+    {
+        if (fUseSSL) asio::async_read_until(sslStream, bufRecv, MatchHTTPHeadersEnd, handler);
+        else asio::async_read_until(sslStream.next_layer(), bufRecv, MatchHTTPHeadersEnd, handler);
+    }
+    template <typename Handler>
+    void AsyncReadBytes(char* pch, size_t nBytes, Handler handler)
+    {
+        if (fUseSSL) asio::async_read(sslStream, asio::buffer(pch, nBytes), handler);
+        else asio::async_read(sslStream.next_layer(), asio::buffer(pch, nBytes), handler);
+    }
+    template <typename Handler>
+    void AsyncWrite(const string& str, Handler handler)
+    {
+        if (fUseSSL) asio::async_write(sslStream, asio::buffer(str), handler);
+        else asio::async_write(sslStream.next_layer(), asio::buffer(str), handler);
+    }
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+    void ArmIdleTimeout();
+    void HandleIdleTimeout(const boost::system::error_code& error);
+    void HandleHandshake(const boost::system::error_code& error);
+    void ReadRequest();
+    void HandleHeaders(const boost::system::error_code& error);
+    void HandleBody(const boost::system::error_code& error);
+    void StopReading();
+    void CloseAfter(uint64_t nSeq);
+    void QueueReply(uint64_t nSeq, const string& strReply, bool fClose);
+    void SendReplies();
+    void HandleWrite(const boost::system::error_code& error);
+    void Execute(uint64_t nSeq, const Value& valRequest, bool fKeepAlive);
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
+public:
+    ip::tcp::endpoint peer;
+    asio::ssl::stream<ip::tcp::socket> sslStream;
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close" || (!GetBoolArg("-rpckeepalive", true)))
-	  fRun = false;
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSLIn) :
+        strand(io_service), bufRecv(MAX_RPC_HEADERS_SIZE), timer(io_service), fUseSSL(fUseSSLIn),
+        nReqProto(0), nReqLength(0), nNextRequest(0), nNextReply(0), fReading(false), fWriting(false),
+        fClosing(false), nCloseAfter(std::numeric_limits<uint64_t>::max()), sslStream(io_service, context)
+    {
+    }
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+    void Start();
+    void Close();
+};
 
-            string strReply;
+void CRPCConnection::Start()
+{
+    if (fUseSSL)
+    {
+        strand.dispatch(boost::bind(&CRPCConnection::ArmIdleTimeout, shared_from_this()));
+        sslStream.async_handshake(ssl::stream_base::server,
+            strand.wrap(boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error)));
+    }
+    else
+        strand.dispatch(boost::bind(&CRPCConnection::ReadRequest, shared_from_this()));
+}
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+// While no request is in flight, the client has -rpcservertimeout seconds
+// to send the next one in full
+void CRPCConnection::ArmIdleTimeout()
+{
+    timer.expires_from_now(posix_time::seconds(GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT)));
+    timer.async_wait(strand.wrap(boost::bind(&CRPCConnection::HandleIdleTimeout, shared_from_this(), asio::placeholders::error)));
+}
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+void CRPCConnection::HandleIdleTimeout(const boost::system::error_code& error)
+{
+    // Cancelled, or the timer was set again since
+    if (error == asio::error::operation_aborted || timer.expires_at() > deadline_timer::traits_type::now())
+        return;
+    LogPrint("rpc", "ThreadRPCServer closing idle connection from %s\n", peer.address().to_string());
+    // The pending read fails, and the connection closes once earlier replies are out
+    boost::system::error_code ec;
+    sslStream.lowest_layer().cancel(ec);
+}
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+void CRPCConnection::Close()
+{
+    boost::system::error_code ec;
+    sslStream.lowest_layer().close(ec);
+    timer.cancel(ec);
+}
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+void CRPCConnection::HandleHandshake(const boost::system::error_code& error)
+{
+    if (error)
+    {
+        Close();
+        return;
+    }
+    ReadRequest();
+}
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
+void CRPCConnection::ReadRequest()
+{
+    fReading = true;
+    if (nNextRequest == nNextReply)
+        ArmIdleTimeout();
+    AsyncReadHeaders(strand.wrap(boost::bind(&CRPCConnection::HandleHeaders, shared_from_this(), asio::placeholders::error)));
+}
+
+void CRPCConnection::HandleHeaders(const boost::system::error_code& error)
+{
+    // Also where headers without an end, or larger than MAX_RPC_HEADERS_SIZE, land
+    if (error || fClosing)
+    {
+        StopReading();
+        return;
+    }
+
+    std::istream stream(&bufRecv);
+    string strMethod;
+    mapReqHeaders.clear();
+    if (!ReadHTTPRequestLine(stream, nReqProto, strMethod, strReqURI))
+    {
+        StopReading();
+        return;
+    }
+    nReqLength = ReadHTTPHeaders(stream, mapReqHeaders);
+    if (nReqLength < 0 || nReqLength > (int)MAX_SIZE)
+    {
+        StopReading();
+        return;
+    }
+
+    // Part of the body may have come with the headers
+    strReqBody.resize(nReqLength);
+    size_t nHave = std::min(bufRecv.size(), (size_t)nReqLength);
+    std::copy(asio::buffers_begin(bufRecv.data()), asio::buffers_begin(bufRecv.data()) + nHave, strReqBody.begin());
+    bufRecv.consume(nHave);
+    if (nHave == (size_t)nReqLength)
+        HandleBody(boost::system::error_code());
+    else
+        AsyncReadBytes(&strReqBody[nHave], nReqLength - nHave,
+            strand.wrap(boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error)));
+}
+
+void CRPCConnection::HandleBody(const boost::system::error_code& error)
+{
+    if (error || fClosing || ShutdownRequested())
+    {
+        StopReading();
+        return;
+    }
+    fReading = false;
+    timer.expires_at(posix_time::pos_infin);
+
+    string strRequest;
+    strRequest.swap(strReqBody);
+    uint64_t nSeq = nNextRequest++;
+
+    string strConnection = mapReqHeaders["connection"];
+    bool fKeepAlive = GetBoolArg("-rpckeepalive", true) &&
+        (strConnection == "keep-alive" || (nReqProto >= 1 && strConnection != "close"));
+    if (!fKeepAlive)
+        CloseAfter(nSeq);
+
+    if (strReqURI != "/")
+    {
+        QueueReply(nSeq, HTTPReply(HTTP_NOT_FOUND, "", false), true);
+        return;
+    }
+
+    // Check authorization
+    if (mapReqHeaders.count("authorization") == 0)
+    {
+        QueueReply(nSeq, HTTPReply(HTTP_UNAUTHORIZED, "", false), true);
+        return;
+    }
+    if (!HTTPAuthorized(mapReqHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", peer.address().to_string());
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed. */
+        CloseAfter(nSeq);
+        if (mapArgs["-rpcpassword"].size() < 20)
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            timer.expires_from_now(posix_time::milliseconds(250));
+            timer.async_wait(strand.wrap(boost::bind(&CRPCConnection::QueueReply, shared_from_this(),
+                                                     nSeq, HTTPReply(HTTP_UNAUTHORIZED, "", false), true)));
         }
-        catch (std::exception& e)
+        else
+            QueueReply(nSeq, HTTPReply(HTTP_UNAUTHORIZED, "", false), true);
+        return;
+    }
+
+    // Parse here, so that the request goes to the queue its method belongs to
+    Value valRequest;
+    if (!ParseJSON(strRequest, valRequest))
+    {
+        QueueReply(nSeq, ErrorReply(JSONRPCError(RPC_PARSE_ERROR, "Parse error"), Value::null), true);
+        return;
+    }
+    if (!RPCWorkQueueFor(valRequest)->Enqueue(boost::bind(&CRPCConnection::Execute, shared_from_this(), nSeq, valRequest, fKeepAlive)))
+    {
+        LogPrint("rpc", "ThreadRPCServer work queue full, refusing a request from %s\n", peer.address().to_string());
+        QueueReply(nSeq, HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false), true);
+        return;
+    }
+
+    if (!fClosing && nNextRequest - nNextReply < MAX_RPC_PIPELINE)
+        ReadRequest();
+}
+
+void CRPCConnection::StopReading()
+{
+    fReading = false;
+    if (nNextRequest == nNextReply)
+        Close();
+    else
+        CloseAfter(nNextRequest - 1);
+}
+
+void CRPCConnection::CloseAfter(uint64_t nSeq)
+{
+    fClosing = true;
+    nCloseAfter = std::min(nCloseAfter, nSeq);
+}
+
+void CRPCConnection::QueueReply(uint64_t nSeq, const string& strReply, bool fClose)
+{
+    if (fClose)
+        CloseAfter(nSeq);
+    if (nSeq <= nCloseAfter)
+        mapReplies[nSeq] = strReply;
+    SendReplies();
+}
+
+void CRPCConnection::SendReplies()
+{
+    if (fWriting)
+        return;
+    map<uint64_t, string>::iterator it = mapReplies.find(nNextReply);
+    if (it == mapReplies.end())
+        return;
+    fWriting = true;
+    strSending.swap(it->second);
+    mapReplies.erase(it);
+    AsyncWrite(strSending, strand.wrap(boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error)));
+}
+
+void CRPCConnection::HandleWrite(const boost::system::error_code& error)
+{
+    fWriting = false;
+    strSending.clear();
+    if (error || nNextReply >= nCloseAfter)
+    {
+        Close();
+        return;
+    }
+    nNextReply++;
+    if (fReading)
+    {
+        // The read already under way now waits with nothing in flight
+        if (!fClosing && nNextRequest == nNextReply)
+            ArmIdleTimeout();
+    }
+    // Room in the pipeline again
+    else if (!fClosing && nNextRequest - nNextReply < MAX_RPC_PIPELINE)
+        ReadRequest();
+    SendReplies();
+}
+
+// Runs on a work queue thread
+void CRPCConnection::Execute(uint64_t nSeq, const Value& valRequest, bool fKeepAlive)
+{
+    string strReply;
+    bool fClose = !fKeepAlive;
+    JSONRequest jreq;
+    try
+    {
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            string strResult;
+            JSONRPCExecReply(jreq, strResult);
+            strResult += '\n';
+
+            strReply = HTTPReply(HTTP_OK, strResult, fKeepAlive);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = HTTPReply(HTTP_OK, JSONRPCExecBatch(valRequest.get_array()), fKeepAlive);
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    }
+    catch (Object& objError)
+    {
+        strReply = ErrorReply(objError, jreq.id);
+        fClose = true;
+    }
+    catch (std::exception& e)
+    {
+        strReply = ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        fClose = true;
+    }
+    strand.post(boost::bind(&CRPCConnection::QueueReply, shared_from_this(), nSeq, strReply, fClose));
+}
+
+/**
+ * Sets up I/O resources to accept and handle a new connection.
+ */
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor, ssl::context& context, bool fUseSSL)
+{
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(*rpc_io_service, context, fUseSSL));
+
+    acceptor->async_accept(
+            conn->sslStream.lowest_layer(),
+            conn->peer,
+            boost::bind(&RPCAcceptHandler,
+                acceptor,
+                boost::ref(context),
+                fUseSSL,
+                conn,
+                _1));
+}
+
+/**
+ * Accept and handle incoming connection.
+ */
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
+                             ssl::context& context,
+                             bool fUseSSL,
+                             boost::shared_ptr<CRPCConnection> conn,
+                             const boost::system::error_code& error)
+{
+    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
+    if (error != asio::error::operation_aborted && acceptor->is_open())
+        RPCListen(acceptor, context, fUseSSL);
+
+    if (error)
+    {
+        // TODO: Actually handle errors
+        LogPrintf("%s: Error: %s\n", __func__, error.message());
+    }
+    // Restrict callers by IP.  It is important to
+    // do this before reading anything, to filter out
+    // certain DoS and misbehaving clients.
+    else if (!ClientAllowed(conn->peer.address()))
+    {
+        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
+        if (!fUseSSL)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            boost::system::error_code ec;
+            asio::write(conn->sslStream.next_layer(), asio::buffer(HTTPReply(HTTP_FORBIDDEN, "", false)), ec);
         }
+        conn->Close();
     }
+    else
+        conn->Start();
+}
+
+// The streaming actor if the caller takes JSON and the method has one
+static bool RunActor(const CRPCCommand *pcmd, const Array& params, Value& result, CJSONWriter* pwriter)
+{
+    if (pwriter && pcmd->streamActor && pcmd->streamActor(params, *pwriter))
+        return true;
+    result = pcmd->actor(params, false);
+    return false;
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    Value result;
+    execute(strMethod, params, result, NULL);
+    return result;
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& result) const
+{
+    Value value;
+    if (!execute(strMethod, params, value, &result))
+        result.Write(value);
+}
+
+bool CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params,
+                        json_spirit::Value& result, CJSONWriter* pwriter) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -949,26 +1425,26 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     try
     {
         // Execute
-        Value result;
+        bool fStreamed;
         {
             if (pcmd->threadSafe)
-                result = pcmd->actor(params, false);
+                fStreamed = RunActor(pcmd, params, result, pwriter);
 #ifdef ENABLE_WALLET
             else if (!pwalletMain) {
                 LOCK(cs_main);
-                result = pcmd->actor(params, false);
+                fStreamed = RunActor(pcmd, params, result, pwriter);
             } else {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
+                fStreamed = RunActor(pcmd, params, result, pwriter);
             }
 #else // ENABLE_WALLET
             else {
                 LOCK(cs_main);
-                result = pcmd->actor(params, false);
+                fStreamed = RunActor(pcmd, params, result, pwriter);
             }
 #endif // !ENABLE_WALLET
         }
-        return result;
+        return fStreamed;
     }
     catch (std::exception& e)
     {
@@ -20,6 +20,16 @@
 #include "json/json_spirit_writer_template.h"
 
 class CBlockIndex;
+class CJSONWriter;
+
+/** Requests queued for the RPC worker threads before new ones are refused */
+static const int DEFAULT_RPC_WORKQUEUE = 16;
+/** Requests of one connection in flight at a time */
+static const unsigned int MAX_RPC_PIPELINE = 8;
+/** Room for the HTTP headers of a request, besides its body */
+static const unsigned int MAX_RPC_HEADERS_SIZE = 64 * 1024;
+/** Seconds a connection with no request in flight may take to send one (-rpcservertimeout) */
+static const int DEFAULT_RPC_SERVER_TIMEOUT = 30;
 
 /* Start RPC threads */
 void StartRPCThreads();
@@ -52,6 +62,9 @@ void RPCTypeCheck(const json_spirit::Object& o,
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+/* Writes the result of a call straight into the reply, or returns false to
+   leave the call to the tree-building actor */
+typedef bool(*rpcstreamfn_type)(const json_spirit::Array& params, CJSONWriter& result);
 
 class CRPCCommand
 {
@@ -61,6 +74,7 @@ public:
     bool okSafeMode;
     bool threadSafe;
     bool reqWallet;
+    rpcstreamfn_type streamActor; // optional, for calls with large results
 };
 
 /**
@@ -83,6 +97,17 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing the result as JSON. Methods with a
+     * streamActor skip building a json_spirit tree.
+     * @throws as above; what was written by then must be discarded.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& result) const;
+
+private:
+    bool execute(const std::string &method, const json_spirit::Array &params,
+                 json_spirit::Value& resultRet, CJSONWriter* pwriter) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -179,6 +204,7 @@ extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool f
 extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendalert(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getlockstats(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
@@ -200,8 +226,12 @@ extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp)
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getflushstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockspacing(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockreward(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmoneysupply(const json_spirit::Array& params, bool fHelp);
 
+extern bool getrawmempool_stream(const json_spirit::Array& params, CJSONWriter& result); // streaming encoders
+extern bool getblock_stream(const json_spirit::Array& params, CJSONWriter& result);
+
 #endif
@@ -9,9 +9,11 @@
 #include <string.h>
 #include <atomic>
 
-#if defined(__x86_64__) || defined(__amd64__)
-#if defined(EXPERIMENTAL_ASM)
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#if defined(EXPERIMENTAL_ASM) || defined(ENABLE_SSE41) || defined(ENABLE_AVX2)
 #include <cpuid.h>
+#endif
+#if defined(EXPERIMENTAL_ASM)
 namespace sha256_sse4
 {
 void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
@@ -19,6 +21,20 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 #endif
 #endif
 
+#if defined(ENABLE_SSE41)
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#if defined(ENABLE_AVX2)
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -141,9 +157,33 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
     }
 }
 
+/** Double-SHA256 of a single 64-byte input, written as 32 bytes to out. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // Padding for a 64-byte message and for the 32-byte intermediate digest.
+    static const unsigned char pad64[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0};
+    static const unsigned char pad32[32] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0};
+    uint32_t s[8];
+    unsigned char buf[64];
+    Initialize(s);
+    Transform(s, in, 1);
+    Transform(s, pad64, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    memcpy(buf + 32, pad32, 32);
+    Initialize(s);
+    Transform(s, buf, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
 } // namespace sha256
 
 typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
 
 bool SelfTest(TransformType tr) {
     static const unsigned char in1[65] = {0, 0x80};
@@ -172,23 +212,97 @@ bool SelfTest(TransformType tr) {
     return true;
 }
 
+/** Check a multi-way double-SHA256 implementation against the scalar one. */
+bool SelfTestD64(TransformD64Type tr, size_t ways)
+{
+    unsigned char in[64 * 8], out[32 * 8], expected[32];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (unsigned char)(i * 7 + 1);
+    tr(out, in);
+    for (size_t i = 0; i < ways; i++) {
+        sha256::TransformD64(expected, in + 64 * i);
+        if (memcmp(out + 32 * i, expected, 32)) return false;
+    }
+    return true;
+}
+
 TransformType Transform = sha256::Transform;
+TransformD64Type TransformD64 = sha256::TransformD64;
+TransformD64Type TransformD64_4way = nullptr;
+TransformD64Type TransformD64_8way = nullptr;
+
+#if defined(ENABLE_AVX2) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+/** AVX2 needs both the CPU flag and OS support for saving the YMM registers. */
+bool HaveAVX2()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !((ecx >> 27) & 1)) return false;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) return false;
+    if (__get_cpuid_max(0, NULL) < 7) return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx >> 5) & 1;
+}
+#endif
 
 } // namespace
 
 std::string SHA256AutoDetect()
 {
+    std::string ret = "standard";
 #if defined(EXPERIMENTAL_ASM) && (defined(__x86_64__) || defined(__amd64__))
     uint32_t eax, ebx, ecx, edx;
     if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx >> 19) & 1) {
         Transform = sha256_sse4::Transform;
-        assert(SelfTest(Transform));
-        return "sse4";
+        ret = "sse4";
     }
 #endif
-
     assert(SelfTest(Transform));
-    return "standard";
+
+#if defined(ENABLE_SSE41) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    uint32_t a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c >> 19) & 1) {
+        TransformD64_4way = sha256d64_sse41::Transform_4way;
+        assert(SelfTestD64(TransformD64_4way, 4));
+        ret += ",sse41(4way)";
+    }
+#endif
+#if defined(ENABLE_AVX2) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    if (HaveAVX2()) {
+        TransformD64_8way = sha256d64_avx2::Transform_8way;
+        assert(SelfTestD64(TransformD64_8way, 8));
+        ret += ",avx2(8way)";
+    }
+#endif
+
+    return ret;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (TransformD64_8way) {
+        while (blocks >= 8) {
+            TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (blocks >= 4) {
+            TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
 }
 
 ////// SHA-256
@@ -0,0 +1,111 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 4-way double-SHA256 of 64-byte inputs using SSE4.1. This file is only
+// compiled with SSE41_CXXFLAGS and only called after a runtime CPU check,
+// see SHA256AutoDetect() in sha256.cpp.
+
+#ifdef ENABLE_SSE41
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "cryptocommon.h"
+
+namespace sha256d64_sse41 {
+namespace {
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline __m128i Set(uint32_t x) { return _mm_set1_epi32(x); }
+inline __m128i Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+inline __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+inline __m128i Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+inline __m128i And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+inline __m128i Rot(__m128i x, int n) { return Or(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+
+inline __m128i Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+inline __m128i Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+inline __m128i Sigma0(__m128i x) { return Xor(Xor(Rot(x, 2), Rot(x, 13)), Rot(x, 22)); }
+inline __m128i Sigma1(__m128i x) { return Xor(Xor(Rot(x, 6), Rot(x, 11)), Rot(x, 25)); }
+inline __m128i sigma0(__m128i x) { return Xor(Xor(Rot(x, 7), Rot(x, 18)), _mm_srli_epi32(x, 3)); }
+inline __m128i sigma1(__m128i x) { return Xor(Xor(Rot(x, 17), Rot(x, 19)), _mm_srli_epi32(x, 10)); }
+
+/** Run the 64 SHA-256 rounds of one block (message words in w) over the 4 lanes of state s. */
+inline void Transform(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i + 14) & 15])), Add(w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+        __m128i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), Add(Set(K[i]), w[i & 15])));
+        __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = Add(d, t1);
+        d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+/** Gather big-endian word 'offset' of four 64-byte inputs into one vector. */
+inline __m128i Read4(const unsigned char* in, int offset)
+{
+    return _mm_set_epi32(ReadBE32(in + 192 + offset), ReadBE32(in + 128 + offset),
+                         ReadBE32(in + 64 + offset), ReadBE32(in + offset));
+}
+
+/** Scatter one vector of state words into four 32-byte outputs as big-endian. */
+inline void Write4(unsigned char* out, int offset, __m128i v)
+{
+    WriteBE32(out + offset, _mm_extract_epi32(v, 0));
+    WriteBE32(out + 32 + offset, _mm_extract_epi32(v, 1));
+    WriteBE32(out + 64 + offset, _mm_extract_epi32(v, 2));
+    WriteBE32(out + 96 + offset, _mm_extract_epi32(v, 3));
+}
+
+} // namespace
+
+void Transform_4way(unsigned char* out, const unsigned char* in)
+{
+    __m128i s[8], w[16];
+
+    // First SHA-256: the 64 input bytes, then the constant padding block.
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(IV[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read4(in, 4 * i);
+    Transform(s, w);
+    for (int i = 0; i < 16; i++)
+        w[i] = Set(i == 0 ? 0x80000000 : (i == 15 ? 0x200 : 0));
+    Transform(s, w);
+
+    // Second SHA-256 over the 32-byte intermediate digest.
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        s[i] = Set(IV[i]);
+    }
+    for (int i = 8; i < 16; i++)
+        w[i] = Set(i == 8 ? 0x80000000 : (i == 15 ? 0x100 : 0));
+    Transform(s, w);
+
+    for (int i = 0; i < 8; i++)
+        Write4(out, 4 * i, s[i]);
+}
+
+} // namespace sha256d64_sse41
+
+#endif
@@ -0,0 +1,866 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "bignum.h"
+#include "chainparams.h"
+#include "init.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "rpcjson.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <deque>
+#include <map>
+#include <set>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace boost::asio;
+using namespace json_spirit;
+using namespace std;
+
+enum StratumErrorCode
+{
+    STRATUM_ERR_OTHER = 20,
+    STRATUM_ERR_JOB_NOT_FOUND = 21,
+    STRATUM_ERR_DUPLICATE = 22,
+    STRATUM_ERR_LOW_DIFFICULTY = 23,
+    STRATUM_ERR_UNAUTHORIZED = 24,
+    STRATUM_ERR_NOT_SUBSCRIBED = 25,
+};
+
+/** Jobs follow a new tip at once, and new transactions at most this often */
+static const int64_t STRATUM_JOB_REFRESH = 30;
+/** Vardiff aims at a share per STRATUM_SHARE_INTERVAL seconds, and looks at
+ * the rate over STRATUM_VARDIFF_WINDOW seconds */
+static const int64_t STRATUM_SHARE_INTERVAL = 15;
+static const int64_t STRATUM_VARDIFF_WINDOW = 120;
+static const double MIN_STRATUM_DIFFICULTY = 1.0 / 65536;
+static const double MAX_STRATUM_DIFFICULTY = 1e12;
+/** Disconnect miners that leave this many lines unread */
+static const unsigned int MAX_STRATUM_SEND_QUEUE = 1000;
+
+static string HexUint32(uint32_t n)
+{
+    return HexStr(BEGIN(n), END(n));
+}
+
+CStratumJob::CStratumJob(const string& strIdIn, const CBlock& blockIn, int nHeightIn, unsigned int nMinTimeIn) :
+    block(blockIn), strId(strIdIn), algo(blockIn.GetAlgo()), nHeight(nHeightIn), nMinTime(nMinTimeIn), nCreated(GetTime())
+{
+    // The extranonce follows the height (BIP34) as a push of zeros, which
+    // miners overwrite in place
+    CScript scriptPrefix = CScript() << nHeight;
+    CTransaction& txCoinbase = block.vtx[0];
+    txCoinbase.vin[0].scriptSig = scriptPrefix;
+    txCoinbase.vin[0].scriptSig << vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    txCoinbase.vin[0].scriptSig += COINBASE_FLAGS;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txCoinbase;
+    unsigned int nOffset = sizeof(txCoinbase.nVersion) + GetSizeOfCompactSize(txCoinbase.vin.size()) +
+        ::GetSerializeSize(txCoinbase.vin[0].prevout, SER_NETWORK, PROTOCOL_VERSION) +
+        GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptPrefix.size() + 1;
+    unsigned int nEnd = nOffset + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+    assert(nEnd <= ss.size());
+    vchCoinbase1.assign(ss.begin(), ss.begin() + nOffset);
+    vchCoinbase2.assign(ss.begin() + nEnd, ss.end());
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    vMerkleBranch = block.GetMerkleBranch(0);
+}
+
+Array CStratumJob::GetNotifyParams(bool fCleanJobs) const
+{
+    Array params;
+    params.push_back(strId);
+    if (algo == ALGO_EQUIHASH) {
+        // Header fields in their serialized byte order
+        params.push_back(HexUint32(block.nVersion));
+        params.push_back(HexStr(block.hashPrevBlock.begin(), block.hashPrevBlock.end()));
+        params.push_back(HexStr(block.hashMerkleRoot.begin(), block.hashMerkleRoot.end()));
+        params.push_back(HexStr(block.hashReserved.begin(), block.hashReserved.end()));
+        params.push_back(HexUint32(block.nTime));
+        params.push_back(HexUint32(block.nBits));
+    } else {
+        params.push_back(StratumPrevHash(block.hashPrevBlock));
+        params.push_back(HexStr(vchCoinbase1));
+        params.push_back(HexStr(vchCoinbase2));
+        Array branch;
+        BOOST_FOREACH(const uint256& hash, vMerkleBranch)
+            branch.push_back(HexStr(hash.begin(), hash.end()));
+        params.push_back(branch);
+        params.push_back(strprintf("%08x", block.nVersion));
+        params.push_back(strprintf("%08x", block.nBits));
+        params.push_back(strprintf("%08x", block.nTime));
+    }
+    params.push_back(fCleanJobs);
+    return params;
+}
+
+CBlockHeader CStratumJob::GetHeader(const vector<unsigned char>& vchExtraNonce, unsigned int nTime, unsigned int nNonce,
+                                    CTransaction& txCoinbase) const
+{
+    assert(vchExtraNonce.size() == STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+    vector<unsigned char> vch(vchCoinbase1);
+    vch.insert(vch.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vch.insert(vch.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+    CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> txCoinbase;
+
+    CBlockHeader header = block;
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    return header;
+}
+
+CBlockHeader CStratumJob::GetEquihashHeader(const uint256& nNonce256, unsigned int nTime,
+                                            const vector<unsigned char>& vchSolution) const
+{
+    CBlockHeader header = block;
+    header.nNonce256 = nNonce256;
+    header.nTime = nTime;
+    header.nSolution = vchSolution;
+    return header;
+}
+
+CBlock CStratumJob::GetBlock(const CBlockHeader& header, const CTransaction& txCoinbase) const
+{
+    CBlock blockOut = GetBlock(header);
+    blockOut.vtx[0] = txCoinbase;
+    return blockOut;
+}
+
+CBlock CStratumJob::GetBlock(const CBlockHeader& header) const
+{
+    CBlock blockOut(block);
+    *(CBlockHeader*)&blockOut = header;
+    blockOut.vMerkleTree.clear();
+    return blockOut;
+}
+
+string StratumPrevHash(const uint256& hash)
+{
+    vector<unsigned char> vch(hash.begin(), hash.end());
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+        reverse(vch.begin() + i, vch.begin() + i + 4);
+    return HexStr(vch);
+}
+
+// Difficulty 1 in the units miners of each algorithm expect
+static int64_t StratumDifficultyFactor(int algo)
+{
+    switch (algo) {
+    case ALGO_SCRYPT:
+    case ALGO_YESCRYPT:
+        return 65536;
+    case ALGO_LYRA2REv2:
+        return 256;
+    }
+    return 1;
+}
+
+uint256 StratumTarget(double dDifficulty, int algo)
+{
+    // Fixed point, for difficulties below 1
+    static const int64_t nScale = 65536;
+    dDifficulty = max(MIN_STRATUM_DIFFICULTY, min(MAX_STRATUM_DIFFICULTY, dDifficulty));
+    CBigNum bnTarget;
+    bnTarget.SetCompact(0x1d00ffff);
+    bnTarget = bnTarget * CBigNum(StratumDifficultyFactor(algo) * nScale) / CBigNum((int64_t)(dDifficulty * nScale));
+    if (bnTarget > CBigNum(~uint256(0)))
+        return ~uint256(0);
+    return bnTarget.getuint256();
+}
+
+class CStratumConnection;
+typedef boost::shared_ptr<CStratumConnection> StratumConnectionRef;
+typedef boost::shared_ptr<const CStratumJob> StratumJobRef;
+
+// These are created by StartStratumServer, destroyed in StopStratumServer
+static io_service* stratum_io_service = NULL;
+// Job updates run one at a time on this strand
+static io_service::strand* stratum_update_strand = NULL;
+static boost::thread_group* stratum_worker_group = NULL;
+static boost::shared_ptr<ip::tcp::acceptor> stratum_acceptor;
+static boost::shared_ptr<deadline_timer> stratum_timer;
+
+static CScript scriptStratumPayout;
+static double dStratumDifficulty = 1.0;
+
+static CCriticalSection cs_stratum;
+// Cleared by StopStratumServer, so that a connection accepted meanwhile closes
+static bool fStratumRunning = false;
+static set<StratumConnectionRef> setStratumConnections;
+// Jobs shares may still come in for, by id; cleared on a new tip
+static map<string, StratumJobRef> mapStratumJobs;
+// The latest job per algorithm, and the mempool state it was built from
+static StratumJobRef vStratumJobs[NUM_ALGOS];
+static unsigned int vStratumTxUpdated[NUM_ALGOS];
+static uint256 hashStratumTip;
+static uint32_t nStratumExtraNonce1 = 0;
+static uint64_t nStratumJobId = 0;
+
+static Array StratumError(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+// An algorithm by number or by name
+static int ParseStratumAlgo(const string& strAlgo)
+{
+    if (!strAlgo.empty() && strAlgo.find_first_not_of("0123456789") == string::npos) {
+        int algo = atoi(strAlgo);
+        return algo < NUM_ALGOS ? algo : -1;
+    }
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+        if (boost::iequals(strAlgo, GetAlgoName(algo)))
+            return algo;
+    return -1;
+}
+
+// Parse an 8-digit big-endian hex number
+static bool ParseHexUint32(const string& str, uint32_t& n)
+{
+    if (str.size() != 8 || !IsHex(str))
+        return false;
+    n = strtoul(str.c_str(), NULL, 16);
+    return true;
+}
+
+// Build a new job for an algorithm on the current tip, and make it current
+static StratumJobRef NewStratumJob(int algo)
+{
+    unsigned int nTxUpdated = mempool.GetTransactionsUpdated();
+    auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptStratumPayout, false, algo));
+    if (!pblocktemplate.get()) {
+        LogPrintf("StratumServer: could not create a %s block template\n", GetAlgoName(algo));
+        return StratumJobRef();
+    }
+    const CBlock& block = pblocktemplate->block;
+
+    int nHeight;
+    unsigned int nMinTime;
+    {
+        LOCK(cs_main);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        // The tip moved on meanwhile; the next update catches up
+        if (pindexPrev->GetBlockHash() != block.hashPrevBlock)
+            return StratumJobRef();
+        nHeight = pindexPrev->nHeight + 1;
+        nMinTime = pindexPrev->GetMedianTimePast() + 1;
+    }
+
+    LOCK(cs_stratum);
+    StratumJobRef job(new CStratumJob(strprintf("%x", ++nStratumJobId), block, nHeight, nMinTime));
+    if (block.hashPrevBlock != hashStratumTip) {
+        // Shares for the old tip are stale
+        mapStratumJobs.clear();
+        for (int i = 0; i < NUM_ALGOS; i++)
+            vStratumJobs[i].reset();
+        hashStratumTip = block.hashPrevBlock;
+    }
+    mapStratumJobs[job->strId] = job;
+    vStratumJobs[algo] = job;
+    vStratumTxUpdated[algo] = nTxUpdated;
+    return job;
+}
+
+// The current job for an algorithm, built if there is none yet
+static StratumJobRef GetStratumJob(int algo)
+{
+    {
+        LOCK(cs_stratum);
+        if (vStratumJobs[algo])
+            return vStratumJobs[algo];
+    }
+    if (IsInitialBlockDownload())
+        return StratumJobRef();
+    return NewStratumJob(algo);
+}
+
+class CStratumConnection : public boost::enable_shared_from_this<CStratumConnection>
+{
+private:
+    boost::asio::streambuf bufRecv;
+    deque<string> vSendQueue;
+    string strPeer;
+    string strWorker;
+
+    // Everything below is only touched on the strand
+    bool fSubscribed;
+    bool fFixedDifficulty;
+    vector<unsigned char> vchExtraNonce1;
+    double dDifficulty;
+    uint256 hashTarget;
+    // The target before the last vardiff change, still good until the next job
+    uint256 hashTargetPrev;
+    // Shares since the last clean job, to catch duplicates
+    set<uint256> setShares;
+    int64_t nVarDiffStart;
+    unsigned int nVarDiffShares;
+
+    void Read();
+    void HandleRead(const boost::system::error_code& error);
+    void HandleLine(const string& strLine);
+    void Write();
+    void HandleWrite(const boost::system::error_code& error);
+    void Reply(const Value& id, const Value& result, const Value& error);
+    void Notify(const string& strMethod, const Array& params);
+    void SendDifficulty();
+    void UpdateVarDiff();
+
+    Value Subscribe(const Array& params);
+    Value Authorize(const Array& params);
+    Value Submit(const Array& params);
+
+public:
+    ip::tcp::socket socket;
+    io_service::strand strand;
+
+    // Set by mining.authorize, under cs_stratum, for the job updates
+    bool fAuthorized;
+    int algo;
+
+    CStratumConnection(io_service& io) :
+        bufRecv(MAX_STRATUM_LINE), fSubscribed(false), fFixedDifficulty(false), dDifficulty(dStratumDifficulty),
+        nVarDiffStart(0), nVarDiffShares(0), socket(io), strand(io), fAuthorized(false), algo(miningAlgo) {}
+
+    void Start();
+    void Close();
+    void Send(const string& strLine);
+    void SendJob(StratumJobRef job, bool fCleanJobs);
+};
+
+void CStratumConnection::Start()
+{
+    boost::system::error_code ec;
+    ip::tcp::endpoint peer = socket.remote_endpoint(ec);
+    strPeer = ec ? "unknown" : strprintf("%s:%d", peer.address().to_string(), peer.port());
+    {
+        LOCK(cs_stratum);
+        if (!fStratumRunning) {
+            socket.close(ec);
+            return;
+        }
+        uint32_t nExtraNonce1 = ++nStratumExtraNonce1;
+        vchExtraNonce1.assign((unsigned char*)&nExtraNonce1, (unsigned char*)&nExtraNonce1 + STRATUM_EXTRANONCE1_SIZE);
+        setStratumConnections.insert(shared_from_this());
+    }
+    LogPrint("stratum", "Stratum connection from %s\n", strPeer);
+    strand.dispatch(boost::bind(&CStratumConnection::Read, shared_from_this()));
+}
+
+void CStratumConnection::Close()
+{
+    boost::system::error_code ec;
+    socket.close(ec);
+    LOCK(cs_stratum);
+    setStratumConnections.erase(shared_from_this());
+}
+
+void CStratumConnection::Read()
+{
+    async_read_until(socket, bufRecv, '\n',
+                     strand.wrap(boost::bind(&CStratumConnection::HandleRead, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void CStratumConnection::HandleRead(const boost::system::error_code& error)
+{
+    if (error) {
+        // Also the answer to a line longer than MAX_STRATUM_LINE
+        if (error != error::operation_aborted)
+            LogPrint("stratum", "Stratum connection from %s closed: %s\n", strPeer, error.message());
+        Close();
+        return;
+    }
+    istream is(&bufRecv);
+    string strLine;
+    getline(is, strLine);
+    boost::trim(strLine);
+    if (!strLine.empty())
+        HandleLine(strLine);
+    if (socket.is_open())
+        Read();
+}
+
+void CStratumConnection::HandleLine(const string& strLine)
+{
+    Value valRequest;
+    if (!ParseJSON(strLine, valRequest) || valRequest.type() != obj_type) {
+        LogPrint("stratum", "Stratum connection from %s sent a malformed request\n", strPeer);
+        Close();
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value method = find_value(request, "method");
+    Value params = find_value(request, "params");
+    try {
+        const Array& aParams = params.type() == array_type ? params.get_array() : Array();
+        if (method.type() != str_type)
+            throw StratumError(STRATUM_ERR_OTHER, "Missing method");
+        const string& strMethod = method.get_str();
+        if (strMethod == "mining.subscribe") {
+            Reply(id, Subscribe(aParams), Value::null);
+        } else if (strMethod == "mining.authorize") {
+            Reply(id, Authorize(aParams), Value::null);
+            // Then the difficulty and the work to go with it
+            SendDifficulty();
+            StratumJobRef job = GetStratumJob(algo);
+            if (job)
+                SendJob(job, true);
+        } else if (strMethod == "mining.submit") {
+            Reply(id, Submit(aParams), Value::null);
+        } else if (strMethod == "mining.extranonce.subscribe") {
+            // The extranonce never changes on a connection
+            Reply(id, true, Value::null);
+        } else {
+            throw StratumError(STRATUM_ERR_OTHER, "Method not found");
+        }
+    } catch (const Array& error) {
+        Reply(id, Value::null, error);
+    } catch (const std::exception& e) {
+        Reply(id, Value::null, StratumError(STRATUM_ERR_OTHER, e.what()));
+    }
+}
+
+void CStratumConnection::Send(const string& strLine)
+{
+    if (!socket.is_open())
+        return;
+    if (vSendQueue.size() >= MAX_STRATUM_SEND_QUEUE) {
+        LogPrint("stratum", "Stratum connection from %s is not reading\n", strPeer);
+        Close();
+        return;
+    }
+    vSendQueue.push_back(strLine);
+    if (vSendQueue.size() == 1)
+        Write();
+}
+
+void CStratumConnection::Write()
+{
+    async_write(socket, buffer(vSendQueue.front()),
+                strand.wrap(boost::bind(&CStratumConnection::HandleWrite, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void CStratumConnection::HandleWrite(const boost::system::error_code& error)
+{
+    if (error) {
+        Close();
+        return;
+    }
+    vSendQueue.pop_front();
+    if (!vSendQueue.empty())
+        Write();
+}
+
+void CStratumConnection::Reply(const Value& id, const Value& result, const Value& error)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    Send(write_string(Value(reply), false) + "\n");
+}
+
+void CStratumConnection::Notify(const string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    Send(write_string(Value(notification), false) + "\n");
+}
+
+void CStratumConnection::SendDifficulty()
+{
+    Array params;
+    if (algo == ALGO_EQUIHASH) {
+        params.push_back(hashTarget.GetHex());
+        Notify("mining.set_target", params);
+    } else {
+        params.push_back(dDifficulty);
+        Notify("mining.set_difficulty", params);
+    }
+}
+
+void CStratumConnection::SendJob(StratumJobRef job, bool fCleanJobs)
+{
+    if (fCleanJobs)
+        setShares.clear();
+    hashTargetPrev = 0;
+    Notify("mining.notify", job->GetNotifyParams(fCleanJobs));
+}
+
+Value CStratumConnection::Subscribe(const Array& params)
+{
+    fSubscribed = true;
+    // Zcash miners only read the extranonce, which is at the same place
+    string strExtraNonce1 = HexStr(vchExtraNonce1);
+    Array subscriptions, subscription;
+    subscription.push_back("mining.set_difficulty");
+    subscription.push_back(strExtraNonce1);
+    subscriptions.push_back(subscription);
+    subscription[0] = "mining.notify";
+    subscriptions.push_back(subscription);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(strExtraNonce1);
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    return result;
+}
+
+Value CStratumConnection::Authorize(const Array& params)
+{
+    if (!fSubscribed)
+        throw StratumError(STRATUM_ERR_NOT_SUBSCRIBED, "Not subscribed");
+    if (params.size() < 1)
+        throw StratumError(STRATUM_ERR_OTHER, "Missing worker name");
+
+    // The password carries options: algo=<name or number>,d=<difficulty>
+    int algoRequested = miningAlgo;
+    double dRequested = 0;
+    if (params.size() > 1 && params[1].type() == str_type) {
+        vector<string> vOptions;
+        boost::split(vOptions, params[1].get_str(), boost::is_any_of(","));
+        BOOST_FOREACH(const string& strOption, vOptions) {
+            size_t nPos = strOption.find('=');
+            if (nPos == string::npos)
+                continue;
+            string strKey = strOption.substr(0, nPos);
+            string strValue = strOption.substr(nPos + 1);
+            if (strKey == "algo") {
+                algoRequested = ParseStratumAlgo(strValue);
+                if (algoRequested < 0)
+                    throw StratumError(STRATUM_ERR_OTHER, "Unknown algorithm " + strValue);
+            } else if (strKey == "d") {
+                dRequested = atof(strValue.c_str());
+                if (!(dRequested >= MIN_STRATUM_DIFFICULTY && dRequested <= MAX_STRATUM_DIFFICULTY))
+                    throw StratumError(STRATUM_ERR_OTHER, "Bad difficulty " + strValue);
+            }
+        }
+    }
+
+    strWorker = params[0].get_str();
+    {
+        LOCK(cs_stratum);
+        algo = algoRequested;
+        fAuthorized = true;
+    }
+    fFixedDifficulty = dRequested > 0;
+    if (fFixedDifficulty)
+        dDifficulty = dRequested;
+    hashTarget = StratumTarget(dDifficulty, algo);
+    nVarDiffStart = GetTime();
+    nVarDiffShares = 0;
+    LogPrint("stratum", "Stratum connection from %s authorized as %s, mining %s\n", strPeer, strWorker, GetAlgoName(algo));
+    return true;
+}
+
+Value CStratumConnection::Submit(const Array& params)
+{
+    if (!fAuthorized)
+        throw StratumError(STRATUM_ERR_UNAUTHORIZED, "Unauthorized worker");
+    if (params.size() < 5)
+        throw StratumError(STRATUM_ERR_OTHER, "Missing parameters");
+
+    StratumJobRef job;
+    {
+        LOCK(cs_stratum);
+        map<string, StratumJobRef>::const_iterator it = mapStratumJobs.find(params[1].get_str());
+        if (it != mapStratumJobs.end())
+            job = it->second;
+    }
+    if (!job)
+        throw StratumError(STRATUM_ERR_JOB_NOT_FOUND, "Job not found");
+
+    CBlockHeader header;
+    CTransaction txCoinbase;
+    if (job->algo == ALGO_EQUIHASH) {
+        // time, the rest of the 256-bit nonce, and the solution with its size
+        vector<unsigned char> vchTime = ParseHex(params[2].get_str());
+        vector<unsigned char> vchNonce2 = ParseHex(params[3].get_str());
+        if (vchTime.size() != 4 || vchNonce2.size() != 32 - STRATUM_EXTRANONCE1_SIZE)
+            throw StratumError(STRATUM_ERR_OTHER, "Malformed time or nonce");
+        uint32_t nTime;
+        memcpy(&nTime, &vchTime[0], 4);
+        uint256 nNonce256;
+        memcpy(nNonce256.begin(), &vchExtraNonce1[0], STRATUM_EXTRANONCE1_SIZE);
+        memcpy(nNonce256.begin() + STRATUM_EXTRANONCE1_SIZE, &vchNonce2[0], vchNonce2.size());
+        vector<unsigned char> vchSolution;
+        CDataStream ss(ParseHex(params[4].get_str()), SER_NETWORK, PROTOCOL_VERSION);
+        try {
+            ss >> vchSolution;
+        } catch (const std::exception&) {
+            throw StratumError(STRATUM_ERR_OTHER, "Malformed solution");
+        }
+        if (!ss.empty())
+            throw StratumError(STRATUM_ERR_OTHER, "Malformed solution");
+        header = job->GetEquihashHeader(nNonce256, nTime, vchSolution);
+    } else {
+        // extranonce2, time and nonce
+        vector<unsigned char> vchExtraNonce = vchExtraNonce1;
+        vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+        if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+            throw StratumError(STRATUM_ERR_OTHER, "Incorrect size of extranonce2");
+        vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+        uint32_t nTime, nNonce;
+        if (!ParseHexUint32(params[3].get_str(), nTime) || !ParseHexUint32(params[4].get_str(), nNonce))
+            throw StratumError(STRATUM_ERR_OTHER, "Malformed time or nonce");
+        header = job->GetHeader(vchExtraNonce, nTime, nNonce, txCoinbase);
+    }
+
+    if (header.nTime < job->nMinTime || header.nTime > GetAdjustedTime() + 2 * 60 * 60)
+        throw StratumError(STRATUM_ERR_OTHER, "Time out of range");
+    if (!setShares.insert(header.GetHash()).second)
+        throw StratumError(STRATUM_ERR_DUPLICATE, "Duplicate share");
+    uint256 hashPoW = header.GetPoWHash(job->algo);
+    if (hashPoW > max(hashTarget, hashTargetPrev))
+        throw StratumError(STRATUM_ERR_LOW_DIFFICULTY, "Low difficulty share");
+    if (job->algo == ALGO_EQUIHASH && !CheckEquihashSolution(&header, Params()))
+        throw StratumError(STRATUM_ERR_OTHER, "Invalid solution");
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (hashPoW <= bnTarget.getuint256()) {
+        CBlock block = job->algo == ALGO_EQUIHASH ? job->GetBlock(header) : job->GetBlock(header, txCoinbase);
+        CValidationState state;
+        bool fAccepted;
+        {
+            LOCK(cs_main);
+            fAccepted = ProcessBlock(state, NULL, &block) && state.IsValid();
+        }
+        LogPrintf("StratumServer: %s block %s at height %d from %s (%s) %s\n", GetAlgoName(job->algo),
+                  block.GetHash().ToString(), job->nHeight, strWorker, strPeer, fAccepted ? "accepted" : "rejected");
+    }
+
+    UpdateVarDiff();
+    return true;
+}
+
+void CStratumConnection::UpdateVarDiff()
+{
+    if (fFixedDifficulty)
+        return;
+    nVarDiffShares++;
+    int64_t nElapsed = GetTime() - nVarDiffStart;
+    if (nElapsed < STRATUM_VARDIFF_WINDOW && nVarDiffShares < 4 * STRATUM_VARDIFF_WINDOW / STRATUM_SHARE_INTERVAL)
+        return;
+
+    // At most 4x per step, and not for small deviations
+    double dRatio = (double)nVarDiffShares * STRATUM_SHARE_INTERVAL / max(nElapsed, (int64_t)1);
+    dRatio = max(0.25, min(4.0, dRatio));
+    nVarDiffStart = GetTime();
+    nVarDiffShares = 0;
+    if (dRatio > 0.8 && dRatio < 1.25)
+        return;
+    double dNew = max(MIN_STRATUM_DIFFICULTY, min(MAX_STRATUM_DIFFICULTY, dDifficulty * dRatio));
+    if (dNew == dDifficulty)
+        return;
+    dDifficulty = dNew;
+    hashTargetPrev = hashTarget;
+    hashTarget = StratumTarget(dDifficulty, algo);
+    SendDifficulty();
+    LogPrint("stratum", "Stratum connection from %s now at difficulty %g\n", strPeer, dDifficulty);
+}
+
+// Rebuild jobs on a new tip, or on new transactions now and then, and hand
+// them to the miners of their algorithm
+static void UpdateStratumJobs()
+{
+    // Only on the update strand
+    static uint256 hashTipNotified;
+
+    if (IsInitialBlockDownload())
+        return;
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+    bool fNewTip = hashTip != hashTipNotified;
+
+    bool vMined[NUM_ALGOS] = {};
+    StratumJobRef vJobs[NUM_ALGOS];
+    {
+        LOCK(cs_stratum);
+        BOOST_FOREACH(const StratumConnectionRef& conn, setStratumConnections)
+            if (conn->fAuthorized)
+                vMined[conn->algo] = true;
+        for (int algo = 0; algo < NUM_ALGOS; algo++)
+            vJobs[algo] = vStratumJobs[algo];
+    }
+
+    unsigned int nTxUpdated = mempool.GetTransactionsUpdated();
+    bool fAnyNew = false;
+    for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        bool fDue = fNewTip || !vJobs[algo] || vJobs[algo]->GetTemplateHeader().hashPrevBlock != hashTip;
+        if (!fDue) {
+            LOCK(cs_stratum);
+            fDue = vStratumTxUpdated[algo] != nTxUpdated && GetTime() - vJobs[algo]->nCreated >= STRATUM_JOB_REFRESH;
+        }
+        if (!vMined[algo] || !fDue) {
+            vJobs[algo].reset();
+            continue;
+        }
+        vJobs[algo] = NewStratumJob(algo);
+        fAnyNew |= (bool)vJobs[algo];
+    }
+    if (fNewTip && fAnyNew)
+        hashTipNotified = hashTip;
+
+    LOCK(cs_stratum);
+    BOOST_FOREACH(const StratumConnectionRef& conn, setStratumConnections)
+        if (conn->fAuthorized && vJobs[conn->algo])
+            conn->strand.post(boost::bind(&CStratumConnection::SendJob, conn, vJobs[conn->algo], fNewTip));
+}
+
+static void StratumTimer(const boost::system::error_code& error)
+{
+    if (error)
+        return;
+    UpdateStratumJobs();
+    stratum_timer->expires_from_now(boost::posix_time::seconds(1));
+    stratum_timer->async_wait(stratum_update_strand->wrap(boost::bind(&StratumTimer, boost::asio::placeholders::error)));
+}
+
+static void StratumBlockTip(const uint256& hash, int nHeight)
+{
+    stratum_update_strand->post(&UpdateStratumJobs);
+}
+
+static void StratumListen();
+
+static void StratumAcceptHandler(StratumConnectionRef conn, const boost::system::error_code& error)
+{
+    if (error == error::operation_aborted || !stratum_acceptor->is_open())
+        return;
+    StratumListen();
+
+    if (error) {
+        LogPrintf("%s: Error: %s\n", __func__, error.message());
+        return;
+    }
+    conn->Start();
+}
+
+static void StratumListen()
+{
+    StratumConnectionRef conn(new CStratumConnection(*stratum_io_service));
+    stratum_acceptor->async_accept(conn->socket, boost::bind(&StratumAcceptHandler, conn, boost::asio::placeholders::error));
+}
+
+void StartStratumServer()
+{
+    CBitmarkAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid()) {
+        uiInterface.ThreadSafeMessageBox(_("The stratum server needs -stratumaddress=<addr>, the address mined blocks pay to"),
+                                         "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+    scriptStratumPayout.SetDestination(address.Get());
+    if (mapArgs.count("-stratumdifficulty"))
+        dStratumDifficulty = max(MIN_STRATUM_DIFFICULTY, min(MAX_STRATUM_DIFFICULTY, atof(mapArgs["-stratumdifficulty"].c_str())));
+
+    assert(stratum_io_service == NULL);
+    stratum_io_service = new io_service();
+    stratum_update_strand = new io_service::strand(*stratum_io_service);
+
+    ip::tcp::endpoint endpoint;
+    try
+    {
+        endpoint = ip::tcp::endpoint(ip::address::from_string(GetArg("-stratumbind", "127.0.0.1")),
+                                     GetArg("-stratumport", DEFAULT_STRATUM_PORT));
+        stratum_acceptor.reset(new ip::tcp::acceptor(*stratum_io_service));
+        stratum_acceptor->open(endpoint.protocol());
+        stratum_acceptor->set_option(ip::tcp::acceptor::reuse_address(true));
+        stratum_acceptor->bind(endpoint);
+        stratum_acceptor->listen(socket_base::max_connections);
+    }
+    catch(boost::system::system_error &e)
+    {
+        uiInterface.ThreadSafeMessageBox(strprintf(_("An error occurred while setting up the stratum port %u for listening: %s"), endpoint.port(), e.what()),
+                                         "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+    {
+        LOCK(cs_stratum);
+        fStratumRunning = true;
+    }
+    StratumListen();
+
+    stratum_timer.reset(new deadline_timer(*stratum_io_service));
+    stratum_timer->expires_from_now(boost::posix_time::seconds(1));
+    stratum_timer->async_wait(stratum_update_strand->wrap(boost::bind(&StratumTimer, boost::asio::placeholders::error)));
+    uiInterface.NotifyBlockTip.connect(&StratumBlockTip);
+
+    stratum_worker_group = new boost::thread_group();
+    for (int i = 0; i < max((int)GetArg("-stratumthreads", DEFAULT_STRATUM_THREADS), 1); i++)
+        stratum_worker_group->create_thread(boost::bind(&io_service::run, stratum_io_service));
+    LogPrintf("Stratum server listening on %s, paying to %s\n", endpoint.address().to_string(), address.ToString());
+}
+
+void StopStratumServer()
+{
+    if (stratum_io_service == NULL) return;
+
+    uiInterface.NotifyBlockTip.disconnect(&StratumBlockTip);
+    boost::system::error_code ec;
+    if (stratum_acceptor)
+    {
+        stratum_acceptor->cancel(ec);
+        stratum_acceptor->close(ec);
+    }
+    if (stratum_timer)
+        stratum_timer->cancel(ec);
+    {
+        // A connection's socket is only touched on its strand
+        LOCK(cs_stratum);
+        fStratumRunning = false;
+        BOOST_FOREACH(const StratumConnectionRef& conn, setStratumConnections)
+            conn->strand.post(boost::bind(&CStratumConnection::Close, conn));
+        setStratumConnections.clear();
+        mapStratumJobs.clear();
+        for (int i = 0; i < NUM_ALGOS; i++)
+            vStratumJobs[i].reset();
+        hashStratumTip = 0;
+    }
+
+    // With the acceptor, the timer and the sockets closed, the workers run
+    // out of handlers and return
+    if (stratum_worker_group != NULL)
+        stratum_worker_group->join_all();
+    else
+        stratum_io_service->stop();
+    stratum_timer.reset();
+    stratum_acceptor.reset();
+    delete stratum_worker_group; stratum_worker_group = NULL;
+    delete stratum_update_strand; stratum_update_strand = NULL;
+    delete stratum_io_service; stratum_io_service = NULL;
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_STRATUM_H
+#define BITMARK_STRATUM_H
+
+#include "core.h"
+#include "uint256.h"
+
+#include "json/json_spirit_value.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Stratum mining server (-stratum): miners connect over TCP, ask for an
+ * algorithm when they authorize, and get jobs built from the node's own
+ * block templates. Shares are checked by the server's threads, and blocks
+ * found go straight to ProcessBlock.
+ *
+ * Equihash speaks the Zcash flavour of the protocol: the connection's
+ * extranonce starts the 256-bit header nonce, and solutions come whole.
+ * The other algorithms hash an 80-byte header and speak the Bitcoin flavour,
+ * with the extranonce in the coinbase. */
+
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+static const int DEFAULT_STRATUM_THREADS = 2;
+/** Extranonce given to each connection, and the part rolled by the miner */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Longest request line accepted */
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+
+/** A unit of work handed to miners, immutable once built */
+class CStratumJob
+{
+private:
+    // The template, with the extranonce placeholder in its coinbase
+    CBlock block;
+    // The serialized coinbase before and after the extranonce
+    std::vector<unsigned char> vchCoinbase1, vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+
+public:
+    std::string strId;
+    int algo;
+    int nHeight;
+    // Earliest nTime a share may use
+    unsigned int nMinTime;
+    int64_t nCreated;
+
+    CStratumJob() : algo(0), nHeight(0), nMinTime(0), nCreated(0) {}
+    CStratumJob(const std::string& strIdIn, const CBlock& blockIn, int nHeightIn, unsigned int nMinTimeIn);
+
+    const CBlockHeader& GetTemplateHeader() const { return block; }
+
+    // mining.notify parameters
+    json_spirit::Array GetNotifyParams(bool fCleanJobs) const;
+
+    // The header a share describes, and its coinbase (Bitcoin flavour)
+    CBlockHeader GetHeader(const std::vector<unsigned char>& vchExtraNonce, unsigned int nTime, unsigned int nNonce,
+                           CTransaction& txCoinbase) const;
+    // The header of an Equihash share; the coinbase is the template's
+    CBlockHeader GetEquihashHeader(const uint256& nNonce256, unsigned int nTime,
+                                   const std::vector<unsigned char>& vchSolution) const;
+    // The full block around a winning header
+    CBlock GetBlock(const CBlockHeader& header, const CTransaction& txCoinbase) const;
+    CBlock GetBlock(const CBlockHeader& header) const;
+};
+
+/** prevhash as mining.notify sends it: each 32-bit word byte-swapped */
+std::string StratumPrevHash(const uint256& hash);
+/** Share target for a stratum difficulty. Difficulty 1 is the target of
+ * nBits 0x1d00ffff, as getdifficulty counts, scaled for the algorithms whose
+ * miners use a different difficulty 1 (scrypt-like hashes) */
+uint256 StratumTarget(double dDifficulty, int algo);
+
+void StartStratumServer();
+void StopStratumServer();
+
+#endif // BITMARK_STRATUM_H
@@ -8,6 +8,8 @@
 #include "util.h"
 
 #include <boost/foreach.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
 
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
@@ -147,3 +149,226 @@ void AssertLockHeldInternal(const char *pszName, const char* pszFile, int nLine,
 }
 
 #endif /* DEBUG_LOCKORDER */
+
+//
+// Lock contention profiling
+//
+
+volatile bool fLockStats = false;
+
+typedef std::pair<std::pair<const char*, int>, const char*> LockSiteKey; // file, line, name
+typedef std::map<LockSiteKey, CLockSiteStats> LockSiteMap;
+
+// Each thread records into its own table, so taking a lock never waits on
+// another thread's bookkeeping. The table's mutex is only contended while
+// GetLockStats or ResetLockStats walks the tables.
+struct CThreadLockStats
+{
+    boost::mutex mutex;
+    LockSiteMap mapStats;
+};
+
+// Allocated on first use and never freed, so locks taken by global
+// destructors at exit can still be recorded
+struct CLockStatsRegistry
+{
+    boost::mutex mutex;
+    std::vector<CThreadLockStats*> vThreads;
+    LockSiteMap mapExited; // merged from threads that have exited
+    boost::thread_specific_ptr<CThreadLockStats> threadStats;
+
+    CLockStatsRegistry() : threadStats(&ThreadExited) {}
+    static void ThreadExited(CThreadLockStats* pthreadStats);
+};
+
+static boost::once_flag lockStatsInitOnce = BOOST_ONCE_INIT;
+static CLockStatsRegistry* plockStatsRegistry = NULL;
+
+static void LockStatsInit()
+{
+    plockStatsRegistry = new CLockStatsRegistry();
+}
+
+static CLockStatsRegistry& LockStatsRegistry()
+{
+    boost::call_once(&LockStatsInit, lockStatsInitOnce);
+    return *plockStatsRegistry;
+}
+
+static void MergeLockSites(LockSiteMap& mapTo, const LockSiteMap& mapFrom)
+{
+    for (LockSiteMap::const_iterator it = mapFrom.begin(); it != mapFrom.end(); ++it)
+    {
+        CLockSiteStats& stats = mapTo[it->first];
+        if (stats.nLine == 0) {
+            stats.strName = it->second.strName;
+            stats.strFile = it->second.strFile;
+            stats.nLine = it->second.nLine;
+        }
+        stats.Add(it->second);
+    }
+}
+
+void CLockStatsRegistry::ThreadExited(CThreadLockStats* pthreadStats)
+{
+    CLockStatsRegistry& registry = *plockStatsRegistry;
+    {
+        boost::mutex::scoped_lock lock(registry.mutex);
+        registry.vThreads.erase(std::remove(registry.vThreads.begin(), registry.vThreads.end(), pthreadStats), registry.vThreads.end());
+        boost::mutex::scoped_lock lockThread(pthreadStats->mutex);
+        MergeLockSites(registry.mapExited, pthreadStats->mapStats);
+    }
+    delete pthreadStats;
+}
+
+static CThreadLockStats& ThreadLockStats()
+{
+    CLockStatsRegistry& registry = LockStatsRegistry();
+    CThreadLockStats* pthreadStats = registry.threadStats.get();
+    if (!pthreadStats)
+    {
+        pthreadStats = new CThreadLockStats();
+        registry.threadStats.reset(pthreadStats);
+        boost::mutex::scoped_lock lock(registry.mutex);
+        registry.vThreads.push_back(pthreadStats);
+    }
+    return *pthreadStats;
+}
+
+CLockSiteStats::CLockSiteStats() : nLine(0)
+{
+    Reset();
+}
+
+void CLockSiteStats::Reset()
+{
+    nCount = nContended = 0;
+    nWaitMicros = nMaxWaitMicros = nHoldMicros = nMaxHoldMicros = 0;
+    for (int i = 0; i < LOCKSTATS_BUCKETS; i++)
+        vHoldHistogram[i] = 0;
+}
+
+void CLockSiteStats::Add(const CLockSiteStats& other)
+{
+    nCount += other.nCount;
+    nContended += other.nContended;
+    nWaitMicros += other.nWaitMicros;
+    nMaxWaitMicros = std::max(nMaxWaitMicros, other.nMaxWaitMicros);
+    nHoldMicros += other.nHoldMicros;
+    nMaxHoldMicros = std::max(nMaxHoldMicros, other.nMaxHoldMicros);
+    for (int i = 0; i < LOCKSTATS_BUCKETS; i++)
+        vHoldHistogram[i] += other.vHoldHistogram[i];
+}
+
+int64_t LockStatsTime()
+{
+    return GetTimeMicros();
+}
+
+CLockSiteStats* LockStatsAcquired(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros)
+{
+    CThreadLockStats& threadStats = ThreadLockStats();
+    boost::mutex::scoped_lock lock(threadStats.mutex);
+    CLockSiteStats& stats = threadStats.mapStats[std::make_pair(std::make_pair(pszFile, nLine), pszName)];
+    if (stats.nLine == 0) {
+        stats.strName = pszName;
+        stats.strFile = pszFile;
+        stats.nLine = nLine;
+    }
+    stats.nCount++;
+    if (nWaitMicros > 0) {
+        stats.nContended++;
+        stats.nWaitMicros += nWaitMicros;
+        stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nWaitMicros);
+    }
+    // Entries are reset but never erased, and the lock is released on this
+    // thread, so the pointer stays valid until release
+    return &stats;
+}
+
+void LockStatsReleased(CLockSiteStats* pstats, int64_t nHoldMicros)
+{
+    int nBucket = 0;
+    for (int64_t n = nHoldMicros / 10; n > 0 && nBucket < LOCKSTATS_BUCKETS - 1; n /= 10)
+        nBucket++;
+
+    CThreadLockStats& threadStats = ThreadLockStats();
+    boost::mutex::scoped_lock lock(threadStats.mutex);
+    pstats->nHoldMicros += nHoldMicros;
+    pstats->nMaxHoldMicros = std::max(pstats->nMaxHoldMicros, nHoldMicros);
+    pstats->vHoldHistogram[nBucket]++;
+}
+
+static bool CompareWaitTime(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    return a.nWaitMicros > b.nWaitMicros;
+}
+
+void GetLockStats(std::vector<CLockSiteStats>& vStats)
+{
+    LockSiteMap mapAll;
+    {
+        CLockStatsRegistry& registry = LockStatsRegistry();
+        boost::mutex::scoped_lock lock(registry.mutex);
+        mapAll = registry.mapExited;
+        BOOST_FOREACH(CThreadLockStats* pthreadStats, registry.vThreads)
+        {
+            boost::mutex::scoped_lock lockThread(pthreadStats->mutex);
+            MergeLockSites(mapAll, pthreadStats->mapStats);
+        }
+    }
+
+    // A site in a header shows up once per translation unit; merge by file:line and name
+    std::map<std::string, CLockSiteStats> mapMerged;
+    for (LockSiteMap::const_iterator it = mapAll.begin(); it != mapAll.end(); ++it)
+    {
+        const CLockSiteStats& stats = it->second;
+        if (stats.nCount == 0)
+            continue;
+        CLockSiteStats& merged = mapMerged[stats.strFile + ":" + itostr(stats.nLine) + " " + stats.strName];
+        if (merged.nLine == 0) {
+            merged.strName = stats.strName;
+            merged.strFile = stats.strFile;
+            merged.nLine = stats.nLine;
+        }
+        merged.Add(stats);
+    }
+
+    vStats.clear();
+    for (std::map<std::string, CLockSiteStats>::const_iterator it = mapMerged.begin(); it != mapMerged.end(); ++it)
+        vStats.push_back(it->second);
+    std::sort(vStats.begin(), vStats.end(), CompareWaitTime);
+}
+
+void ResetLockStats()
+{
+    CLockStatsRegistry& registry = LockStatsRegistry();
+    boost::mutex::scoped_lock lock(registry.mutex);
+    registry.mapExited.clear();
+    BOOST_FOREACH(CThreadLockStats* pthreadStats, registry.vThreads)
+    {
+        boost::mutex::scoped_lock lockThread(pthreadStats->mutex);
+        for (LockSiteMap::iterator it = pthreadStats->mapStats.begin(); it != pthreadStats->mapStats.end(); ++it)
+            it->second.Reset();
+    }
+}
+
+void LogLockStats()
+{
+    if (!fLockStats)
+        return;
+
+    std::vector<CLockSiteStats> vStats;
+    GetLockStats(vStats);
+    if (vStats.empty())
+        return;
+
+    LogPrintf("Lock contention, top sites by wait time (count contended wait_ms maxwait_ms hold_ms maxhold_ms):\n");
+    for (unsigned int i = 0; i < vStats.size() && i < 20; i++)
+    {
+        const CLockSiteStats& stats = vStats[i];
+        LogPrintf("  %s %s:%d %u %u %.3f %.3f %.3f %.3f\n", stats.strName, stats.strFile, stats.nLine,
+                  stats.nCount, stats.nContended, stats.nWaitMicros * 0.001, stats.nMaxWaitMicros * 0.001,
+                  stats.nHoldMicros * 0.001, stats.nMaxHoldMicros * 0.001);
+    }
+}
@@ -9,6 +9,11 @@
 
 #include "threadsafety.h"
 
+#include <algorithm>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -85,6 +90,9 @@ typedef AnnotatedMixin<boost::recursive_mutex> CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
+/** Just a typedef for boost::condition_variable, can be wrapped later if desired */
+typedef boost::condition_variable CConditionVariable;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -101,16 +109,77 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Lock contention profiling (-lockstats, getlockstats RPC). While fLockStats
+ * is set, every LOCK/TRY_LOCK site records how often it was taken, how long
+ * it waited and how long it held the lock. When off, the cost is one test
+ * of the flag per lock. Each thread keeps its own counters; GetLockStats
+ * merges them.
+ */
+// -lockstatsinterval default, in seconds
+static const int DEFAULT_LOCKSTATS_INTERVAL = 600;
+static const int LOCKSTATS_BUCKETS = 7; // hold times <10us, <100us, <1ms, <10ms, <100ms, <1s, >=1s
+
+struct CLockSiteStats
+{
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nCount;
+    uint64_t nContended;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+    int64_t nHoldMicros;
+    int64_t nMaxHoldMicros;
+    uint64_t vHoldHistogram[LOCKSTATS_BUCKETS];
+
+    CLockSiteStats();
+    void Reset();
+    void Add(const CLockSiteStats& other);
+};
+
+extern volatile bool fLockStats;
+int64_t LockStatsTime();
+CLockSiteStats* LockStatsAcquired(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros);
+void LockStatsReleased(CLockSiteStats* pstats, int64_t nHoldMicros);
+/** Sites sorted by total wait time, longest first */
+void GetLockStats(std::vector<CLockSiteStats>& vStats);
+void ResetLockStats();
+void LogLockStats();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template<typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    CLockSiteStats* pLockStats;
+    int64_t nLockedAt;
+
+    void EnterProfiled(const char* pszName, const char* pszFile, int nLine)
+    {
+        int64_t nWait = 0;
+        if (!lock.try_lock())
+        {
+#ifdef DEBUG_LOCKCONTENTION
+            PrintLockContention(pszName, pszFile, nLine);
+#endif
+            int64_t nWaitStart = LockStatsTime();
+            lock.lock();
+            nWait = std::max(LockStatsTime() - nWaitStart, (int64_t)1); // non-zero marks contention
+        }
+        pLockStats = LockStatsAcquired(pszName, pszFile, nLine, nWait);
+        // The hold time starts after the bookkeeping
+        nLockedAt = LockStatsTime();
+    }
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fLockStats)
+        {
+            EnterProfiled(pszName, pszFile, nLine);
+            return;
+        }
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock())
         {
@@ -128,11 +197,16 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else if (fLockStats)
+        {
+            pLockStats = LockStatsAcquired(pszName, pszFile, nLine, 0);
+            nLockedAt = LockStatsTime();
+        }
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), pLockStats(NULL), nLockedAt(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -142,6 +216,8 @@ public:
 
     ~CMutexLock()
     {
+        if (pLockStats)
+            LockStatsReleased(pLockStats, LockStatsTime() - nLockedAt);
         if (lock.owns_lock())
             LeaveCritical();
     }
@@ -0,0 +1,308 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmarks for hot data structures. Not run by 'make check';
+// run ./bench_bitmark [filter] and compare the numbers between builds.
+
+#include "blockindexmap.h"
+#include "core.h"
+#include "main.h"
+#include "rpcjson.h"
+#include "rpcserver.h"
+#include "test/testutil.h"
+#include "undo.h"
+#include "util.h"
+
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace json_spirit;
+using namespace std;
+
+// Roughly the size of the mainnet block index
+static const int BENCH_CHAIN_LENGTH = 1000000;
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p += 4) {
+        uint32_t n = insecure_rand();
+        memcpy(p, &n, 4);
+    }
+    return hash;
+}
+
+static void Report(const char* pszName, const char* pszVariant, int64_t nStart, int64_t nOps)
+{
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    printf("%-28s %-10s %10.3f ms %10.1f ns/op\n", pszName, pszVariant,
+           nElapsed * 0.001, nOps ? nElapsed * 1000.0 / nOps : 0.0);
+}
+
+// Load a synthetic chain into mapT the way LoadBlockIndexGuts/InsertBlockIndex
+// do, then time the lookups block locators and incoming headers cause.
+template<typename MapType>
+static void BenchBlockIndex(const char* pszVariant, const vector<uint256>& vHash)
+{
+    MapType mapIndex;
+    CArena<CBlockIndex> arena;
+
+    int64_t nStart = GetTimeMicros();
+    CBlockIndex* pprev = NULL;
+    for (unsigned int i = 0; i < vHash.size(); i++) {
+        CBlockIndex* pindex = arena.Allocate();
+        typename MapType::iterator mi = mapIndex.insert(make_pair(vHash[i], pindex)).first;
+        pindex->phashBlock = &mi->first;
+        pindex->pprev = pprev;
+        pindex->nHeight = i;
+        pprev = pindex;
+    }
+    Report("blockindex_load", pszVariant, nStart, vHash.size());
+
+    // getblocks/getheaders: resolve a locator (dense near the tip, then
+    // exponentially sparser) against the index, mostly from the tip back
+    vector<uint256> vLocator;
+    int nStep = 1;
+    for (int nHeight = vHash.size() - 1; nHeight > 0; nHeight -= nStep) {
+        vLocator.push_back(vHash[nHeight]);
+        if (vLocator.size() > 10)
+            nStep *= 2;
+    }
+    nStart = GetTimeMicros();
+    int64_t nOps = 0;
+    int nFound = 0;
+    for (int nRound = 0; nRound < 100000; nRound++) {
+        // Peers slightly behind us: the first few entries are unknown
+        for (unsigned int i = nRound % 4; i < vLocator.size(); i++) {
+            nOps++;
+            typename MapType::iterator mi = mapIndex.find(i < 4 ? RandomHash() : vLocator[i]);
+            if (mi != mapIndex.end()) {
+                nFound += mi->second->nHeight & 1;
+                break;
+            }
+        }
+    }
+    Report("blockindex_locator", pszVariant, nStart, nOps);
+
+    // Header acceptance: duplicate check, then the previous block
+    nStart = GetTimeMicros();
+    nOps = 0;
+    for (int nRound = 0; nRound < 1000000; nRound++) {
+        const uint256& hashPrev = vHash[insecure_rand() % vHash.size()];
+        uint256 hash = RandomHash();
+        nOps++;
+        if (mapIndex.count(hash))
+            continue;
+        typename MapType::iterator mi = mapIndex.find(hashPrev);
+        if (mi != mapIndex.end())
+            nFound += mi->second->nHeight & 1;
+    }
+    Report("blockindex_header_accept", pszVariant, nStart, nOps);
+
+    // Full walk, as CheckForkWarningConditions and the RPCs do
+    nStart = GetTimeMicros();
+    for (typename MapType::iterator mi = mapIndex.begin(); mi != mapIndex.end(); ++mi)
+        nFound += mi->second->nHeight & 1;
+    Report("blockindex_iterate", pszVariant, nStart, mapIndex.size());
+
+    if (nFound == -1)
+        printf("\n"); // keep the lookups from being optimized away
+}
+
+static void BenchBlockIndexMaps()
+{
+    vector<uint256> vHash;
+    vHash.reserve(BENCH_CHAIN_LENGTH);
+    for (int i = 0; i < BENCH_CHAIN_LENGTH; i++)
+        vHash.push_back(RandomHash());
+
+    BenchBlockIndex<map<uint256, CBlockIndex*> >("std::map", vHash);
+    BenchBlockIndex<BlockMap>("BlockMap", vHash);
+}
+
+// Undo data of a full block: P2PKH outputs where a third of the inputs spend
+// from a few hot addresses (pools, exchanges), and every fourth input spends
+// the last output of its transaction
+static void MakeBlockUndo(CBlockUndo& blockundo, int nInputs)
+{
+    vector<CScript> vHot;
+    for (int i = 0; i < 20; i++)
+        vHot.push_back(RandomKeyIDScript());
+    CTxUndo txundo;
+    for (int i = 0; i < nInputs; i++) {
+        CTxOut txout(insecure_rand() % (100 * COIN), insecure_rand() % 3 == 0 ? vHot[insecure_rand() % vHot.size()] : RandomKeyIDScript());
+        if (i % 4 == 0)
+            txundo.vprevout.push_back(CTxInUndo(txout, insecure_rand() % 50 == 0, 400000 + insecure_rand() % 50000, 1));
+        else
+            txundo.vprevout.push_back(CTxInUndo(txout));
+        if (txundo.vprevout.size() == 2 || i == nInputs - 1) {
+            blockundo.vtxundo.push_back(txundo);
+            txundo.vprevout.clear();
+        }
+    }
+}
+
+// Rev file bytes per block and the encode/decode cost of each format; the
+// decode time is what DisconnectBlock adds on top of reading the record
+static void BenchUndo()
+{
+    CBlockUndo blockundo;
+    MakeBlockUndo(blockundo, 4000);
+    const int nRounds = 200;
+
+    int64_t nStart = GetTimeMicros();
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    for (int i = 0; i < nRounds; i++) {
+        ssLegacy.clear();
+        ssLegacy << blockundo;
+    }
+    Report("undo_encode", "original", nStart, nRounds);
+    nStart = GetTimeMicros();
+    vector<CTxUndo> vtxundo;
+    for (int i = 0; i < nRounds; i++)
+        DecodeBlockUndo(&ssLegacy[0], &ssLegacy[0] + ssLegacy.size(), vtxundo);
+    Report("undo_decode", "original", nStart, nRounds);
+    printf("%-28s %-10s %10u bytes\n", "undo_size", "original", (unsigned int)ssLegacy.size());
+
+    for (int fCompress = 0; fCompress < 2; fCompress++) {
+        const char* pszVariant = fCompress ? "compact+lz" : "compact";
+        vector<char> vch;
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nRounds; i++)
+            EncodeBlockUndo(blockundo.vtxundo, fCompress, vch);
+        Report("undo_encode", pszVariant, nStart, nRounds);
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nRounds; i++)
+            DecodeBlockUndo(&vch[0], &vch[0] + vch.size(), vtxundo);
+        Report("undo_decode", pszVariant, nStart, nRounds);
+        printf("%-28s %-10s %10u bytes\n", "undo_size", pszVariant, (unsigned int)vch.size());
+    }
+}
+
+static CTransaction RandomTransaction(const uint256& hashPrev)
+{
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[1].prevout = COutPoint(RandomHash(), 1);
+    tx.vout.resize(2);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = insecure_rand() % (100 * COIN);
+        tx.vout[i].scriptPubKey = RandomKeyIDScript();
+    }
+    return tx;
+}
+
+// Encoding of large RPC results: the json_spirit tree and write_string the
+// tree actors go through, against the streaming writer the server uses, and
+// decoding the result with the Spirit reader against ParseJSON
+static void BenchRPCJSON()
+{
+    const int nRounds = 20;
+    string strJSON;
+    Value value;
+
+    // getrawmempool true over a busy mempool, a third of it chained
+    uint256 hashPrev;
+    for (int i = 0; i < 5000; i++) {
+        CTransaction tx = RandomTransaction(i % 3 ? hashPrev : RandomHash());
+        hashPrev = tx.GetHash();
+        mempool.addUnchecked(hashPrev, CTxMemPoolEntry(tx, 10000 + i, GetTime(), i * 1000.0, 1000));
+    }
+    Array params;
+    params.push_back(true);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++)
+        strJSON = write_string(getrawmempool(params, false), false);
+    Report("rpc_getrawmempool_encode", "tree", nStart, nRounds);
+    size_t nTreeSize = strJSON.size();
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++) {
+        strJSON.clear();
+        CJSONWriter writer(strJSON);
+        getrawmempool_stream(params, writer);
+    }
+    Report("rpc_getrawmempool_encode", "writer", nStart, nRounds);
+    if (strJSON.size() != nTreeSize)
+        printf("rpc_getrawmempool_encode: outputs differ\n");
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++)
+        read_string(strJSON, value);
+    Report("rpc_getrawmempool_decode", "spirit", nStart, nRounds);
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++)
+        ParseJSON(strJSON, value);
+    Report("rpc_getrawmempool_decode", "ParseJSON", nStart, nRounds);
+    mempool.clear();
+
+    // getblock of a full block: the transaction list, and the hex of the
+    // whole block for verbose=false
+    CBlock block;
+    for (int i = 0; i < 4000; i++)
+        block.vtx.push_back(RandomTransaction(RandomHash()));
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++) {
+        Object result;
+        result.push_back(Pair("hash", block.GetHash().GetHex()));
+        Array txs;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            txs.push_back(tx.GetHash().GetHex());
+        result.push_back(Pair("tx", txs));
+        strJSON = write_string(Value(result), false);
+    }
+    Report("rpc_getblock_encode", "tree", nStart, nRounds);
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++) {
+        strJSON.clear();
+        CJSONWriter writer(strJSON);
+        writer.BeginObject();
+        writer.Key("hash").String(block.GetHash().GetHex());
+        writer.Key("tx").BeginArray();
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            writer.String(tx.GetHash().GetHex());
+        writer.EndArray();
+        writer.EndObject();
+    }
+    Report("rpc_getblock_encode", "writer", nStart, nRounds);
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++)
+        strJSON = write_string(Value(HexStr(ssBlock.begin(), ssBlock.end())), false);
+    Report("rpc_getblock_hex_encode", "tree", nStart, nRounds);
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++) {
+        strJSON.clear();
+        CJSONWriter(strJSON).HexString((const unsigned char*)&ssBlock[0], (const unsigned char*)&ssBlock[0] + ssBlock.size());
+    }
+    Report("rpc_getblock_hex_encode", "writer", nStart, nRounds);
+    printf("%-28s %-10s %10u bytes\n", "rpc_getblock_hex_size", "", (unsigned int)strJSON.size());
+}
+
+struct CBenchmark
+{
+    const char* pszName;
+    void (*fn)();
+};
+
+static const CBenchmark vBenchmarks[] =
+{
+    { "blockindex", BenchBlockIndexMaps },
+    { "undo", BenchUndo },
+    { "rpcjson", BenchRPCJSON },
+};
+
+int main(int argc, char* argv[])
+{
+    seed_insecure_rand(true);
+    string strFilter = argc > 1 ? argv[1] : "";
+    for (unsigned int i = 0; i < sizeof(vBenchmarks) / sizeof(vBenchmarks[0]); i++)
+        if (strFilter.empty() || string(vBenchmarks[i].pszName).find(strFilter) != string::npos)
+            vBenchmarks[i].fn();
+    return 0;
+}
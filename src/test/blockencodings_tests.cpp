@@ -0,0 +1,116 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "hash.h"
+#include "main.h"
+#include "test/testutil.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CBlock BuildBlock(int nTx)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1530000000;
+    block.vtx.push_back(RandomTransaction(true));
+    for (int i = 1; i < nTx; i++)
+        block.vtx.push_back(RandomTransaction(false));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vector of SipHash-2-4 over the bytes 00..1f
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CTxMemPool pool;
+    CBlock block = BuildBlock(50);
+    // The mempool has all but two of the block's transactions, and others
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 7 && i != 30)
+            pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+    for (int i = 0; i < 20; i++) {
+        CTransaction tx = RandomTransaction(false);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+    }
+
+    CBlockHeaderAndShortTxIDs cmpctblockSent(block);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblockSent;
+    BOOST_CHECK_EQUAL(ss.size(), cmpctblockSent.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) / 2);
+
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    CPartiallyDownloadedBlock partial;
+    BOOST_CHECK_EQUAL(partial.InitData(cmpctblock, pool), READ_STATUS_OK);
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    for (size_t i = 0; i < partial.BlockTxCount(); i++)
+        if (!partial.IsTxAvailable(i))
+            req.vIndexes.push_back(i);
+    BOOST_REQUIRE_EQUAL(req.vIndexes.size(), 2U);
+    BOOST_CHECK_EQUAL(req.vIndexes[0], 7);
+    BOOST_CHECK_EQUAL(req.vIndexes[1], 30);
+
+    // Differentially encoded indexes survive the round-trip
+    CDataStream ssReq(SER_NETWORK, PROTOCOL_VERSION);
+    ssReq << req;
+    CBlockTransactionsRequest req2;
+    ssReq >> req2;
+    BOOST_CHECK(req2.vIndexes == req.vIndexes);
+
+    vector<CTransaction> vtxMissing;
+    CBlock rebuilt;
+    // Too few or wrong transactions
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vtxMissing), READ_STATUS_INVALID);
+    vtxMissing.push_back(block.vtx[7]);
+    vtxMissing.push_back(block.vtx[31]);
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vtxMissing), READ_STATUS_FAILED);
+
+    vtxMissing[1] = block.vtx[30];
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vtxMissing), READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_coinbase_only)
+{
+    CTxMemPool pool;
+    CBlock block = BuildBlock(1);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK(cmpctblock.vShortTxIds.empty());
+
+    CPartiallyDownloadedBlock partial;
+    BOOST_CHECK_EQUAL(partial.InitData(cmpctblock, pool), READ_STATUS_OK);
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+
+    // An empty compact block is malformed
+    CBlockHeaderAndShortTxIDs empty;
+    empty.header = block;
+    BOOST_CHECK_EQUAL(partial.InitData(empty, pool), READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "chainparams.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Append a block to f the way it is stored in blk files, and return the
+// position of the block data
+static uint64_t WriteBlockRecord(FILE* f, const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    unsigned int nSize = ss.size();
+    fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, f);
+    fwrite(&nSize, 1, sizeof(nSize), f);
+    uint64_t nPos = ftell(f);
+    fwrite(&ss[0], 1, ss.size(), f);
+    return nPos;
+}
+
+static void WriteJunk(FILE* f)
+{
+    // Including a message start with an impossible size
+    fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, f);
+    unsigned int nSize = 5;
+    fwrite(&nSize, 1, sizeof(nSize), f);
+    for (int i = 0; i < 100; i++)
+        fputc(insecure_rand() & 0xff, f);
+}
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+BOOST_AUTO_TEST_CASE(blockimport_order)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CValidationState state;
+    BOOST_REQUIRE(CheckBlockProofOfWork(genesis, state));
+    CBlock blockBad = genesis;
+    blockBad.nBits = 0x03000001;
+
+    FILE* f = tmpfile();
+    BOOST_REQUIRE(f);
+    vector<uint64_t> vPos;
+    WriteJunk(f);
+    vPos.push_back(WriteBlockRecord(f, genesis));
+    WriteJunk(f);
+    vPos.push_back(WriteBlockRecord(f, blockBad));
+    vPos.push_back(WriteBlockRecord(f, genesis));
+    WriteJunk(f);
+    rewind(f);
+
+    {
+        CBlockImportPipeline pipeline(f, 0, 3);
+        for (unsigned int i = 0; i < vPos.size(); i++) {
+            boost::shared_ptr<CImportBlock> job = pipeline.Pop();
+            BOOST_REQUIRE(job);
+            BOOST_CHECK_EQUAL(job->nBlockPos, vPos[i]);
+            BOOST_CHECK_EQUAL(job->fValid, i != 1);
+            BOOST_CHECK(job->block.GetHash() == (i == 1 ? blockBad : genesis).GetHash());
+            BOOST_CHECK(job->vchRaw.empty());
+        }
+        BOOST_CHECK(!pipeline.Pop());
+    }
+
+    // Starting past the first block
+    rewind(f);
+    {
+        CBlockImportPipeline pipeline(f, vPos[1] - 8, 2);
+        boost::shared_ptr<CImportBlock> job = pipeline.Pop();
+        BOOST_REQUIRE(job);
+        BOOST_CHECK_EQUAL(job->nBlockPos, vPos[1]);
+    }
+    fclose(f);
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_queue_limit)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    FILE* f = tmpfile();
+    BOOST_REQUIRE(f);
+    vector<uint64_t> vPos;
+    for (int i = 0; i < 50; i++)
+        vPos.push_back(WriteBlockRecord(f, genesis));
+    rewind(f);
+
+    // A byte limit below one block still lets the blocks through one by one
+    CBlockImportPipeline pipeline(f, 0, 4, 1);
+    for (unsigned int i = 0; i < vPos.size(); i++) {
+        boost::shared_ptr<CImportBlock> job = pipeline.Pop();
+        BOOST_REQUIRE(job);
+        BOOST_CHECK_EQUAL(job->nBlockPos, vPos[i]);
+        BOOST_CHECK(job->fValid);
+    }
+    BOOST_CHECK(!pipeline.Pop());
+    fclose(f);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
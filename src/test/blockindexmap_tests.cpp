@@ -0,0 +1,103 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexmap.h"
+#include "core.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindexmap_tests)
+
+BOOST_AUTO_TEST_CASE(arena_stable_addresses)
+{
+    CArena<CBlockIndex, 16> arena;
+    vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 100; i++) {
+        CBlockIndex* pindex = arena.Allocate();
+        pindex->nHeight = i;
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 100U);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockmap_matches_std_map)
+{
+    BlockMap mapTest;
+    map<uint256, CBlockIndex*> mapReference;
+    vector<CBlockIndex> vIndex(5000);
+
+    BOOST_CHECK(mapTest.empty());
+    BOOST_CHECK(mapTest.find(GetRandHash()) == mapTest.end());
+    BOOST_CHECK(mapTest.begin() == mapTest.end());
+
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        uint256 hash = GetRandHash();
+        pair<BlockMap::iterator, bool> ret = mapTest.insert(make_pair(hash, &vIndex[i]));
+        BOOST_CHECK(ret.second);
+        BOOST_CHECK(ret.first->first == hash);
+        vIndex[i].phashBlock = &ret.first->first;
+        mapReference.insert(make_pair(hash, &vIndex[i]));
+
+        // Inserting again keeps the first value
+        ret = mapTest.insert(make_pair(hash, (CBlockIndex*)NULL));
+        BOOST_CHECK(!ret.second);
+        BOOST_CHECK(ret.first->second == &vIndex[i]);
+    }
+    BOOST_CHECK_EQUAL(mapTest.size(), mapReference.size());
+
+    // Keys must not move while the table grows
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        BOOST_CHECK(mapTest.find(vIndex[i].GetBlockHash())->second == &vIndex[i]);
+
+    for (map<uint256, CBlockIndex*>::iterator mi = mapReference.begin(); mi != mapReference.end(); ++mi) {
+        BOOST_CHECK_EQUAL(mapTest.count(mi->first), 1U);
+        BOOST_CHECK(mapTest[mi->first] == mi->second);
+    }
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(mapTest.count(GetRandHash()), 0U);
+
+    size_t nVisited = 0;
+    const BlockMap& mapConst = mapTest;
+    for (BlockMap::const_iterator it = mapConst.begin(); it != mapConst.end(); ++it) {
+        BOOST_CHECK(mapReference[it->first] == it->second);
+        nVisited++;
+    }
+    BOOST_CHECK_EQUAL(nVisited, mapReference.size());
+
+    // operator[] inserts a NULL entry for an unknown hash
+    uint256 hashNew = GetRandHash();
+    BOOST_CHECK(mapTest[hashNew] == NULL);
+    BOOST_CHECK_EQUAL(mapTest.size(), mapReference.size() + 1);
+
+    mapTest.clear();
+    BOOST_CHECK(mapTest.empty());
+    BOOST_CHECK(mapTest.begin() == mapTest.end());
+    BOOST_CHECK(mapTest.find(hashNew) == mapTest.end());
+}
+
+BOOST_AUTO_TEST_CASE(blockmap_reserve)
+{
+    BlockMap mapTest;
+    mapTest.reserve(10000);
+    vector<uint256> vHash;
+    for (int i = 0; i < 10000; i++) {
+        vHash.push_back(GetRandHash());
+        mapTest[vHash.back()] = NULL;
+    }
+    BOOST_CHECK_EQUAL(mapTest.size(), 10000U);
+    for (int i = 0; i < 10000; i++)
+        BOOST_CHECK(mapTest.find(vHash[i]) != mapTest.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
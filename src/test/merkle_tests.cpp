@@ -0,0 +1,92 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "hash.h"
+#include "sha256.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// The pair-at-a-time tree the batched BuildMerkleTree replaced
+static vector<uint256> ReferenceMerkleTree(const CBlock& block)
+{
+    vector<uint256> vTree;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vTree.push_back(block.vtx[i].GetHash());
+    int j = 0;
+    for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                 BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return vTree;
+}
+
+BOOST_AUTO_TEST_SUITE(merkle_tests)
+
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    for (int nBlocks = 0; nBlocks <= 37; nBlocks++) {
+        vector<unsigned char> vIn(64 * nBlocks), vOut(32 * nBlocks);
+        for (unsigned int i = 0; i < vIn.size(); i++)
+            vIn[i] = insecure_rand();
+        SHA256D64(vOut.data(), vIn.data(), nBlocks);
+        for (int i = 0; i < nBlocks; i++) {
+            uint256 expected = Hash(vIn.begin() + 64 * i, vIn.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(expected.begin(), &vOut[32 * i], 32) == 0);
+        }
+        // Reducing in place must give the same result
+        SHA256D64(vIn.data(), vIn.data(), nBlocks);
+        BOOST_CHECK(memcmp(vIn.data(), vOut.data(), vOut.size()) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_tree_matches_reference)
+{
+    for (unsigned int nTx = 0; nTx <= 70; nTx++) {
+        CBlock block;
+        for (unsigned int j = 0; j < nTx; j++) {
+            CTransaction tx;
+            tx.nLockTime = j;
+            block.vtx.push_back(tx);
+        }
+
+        vector<uint256> vReference = ReferenceMerkleTree(block);
+        uint256 root = block.BuildMerkleTree();
+        BOOST_CHECK(block.vMerkleTree == vReference);
+        BOOST_CHECK(root == (vReference.empty() ? 0 : vReference.back()));
+        BOOST_CHECK(block.ComputeMerkleRoot() == root);
+
+        for (unsigned int j = 0; j < nTx; j++)
+            BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[j].GetHash(), block.GetMerkleBranch(j), j) == root);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_duplicate_last)
+{
+    // An odd level pairs the last node with itself, so duplicating the last
+    // transaction must not change the root (CVE-2012-2459 behaviour).
+    CBlock block;
+    for (unsigned int j = 0; j < 5; j++) {
+        CTransaction tx;
+        tx.nLockTime = j;
+        block.vtx.push_back(tx);
+    }
+    uint256 root = block.ComputeMerkleRoot();
+    block.vtx.push_back(block.vtx.back());
+    BOOST_CHECK(block.ComputeMerkleRoot() == root);
+    BOOST_CHECK(block.BuildMerkleTree() == root);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -49,7 +49,20 @@ struct {
     {2, 0xbbbeb305}, {2, 0xfe1c810a},
 };
 
-// NOTE: These tests rely on CreateNewBlock doing its own self-validation!
+// CreateNewBlock no longer connects the template itself; this is the check
+// it used to make
+static bool TemplateConnects(CBlock& block)
+{
+    CBlockIndex indexDummy(block);
+    indexDummy.pprev = chainActive.Tip();
+    indexDummy.nHeight = chainActive.Tip()->nHeight + 1;
+    CCoinsViewCache viewNew(*pcoinsTip, true);
+    CValidationState state;
+    return ConnectBlock(block, state, &indexDummy, viewNew, true);
+}
+
+// NOTE: These tests rely on CreateNewBlock doing its own self-validation of
+// everything but scripts, which it leaves to AcceptToMemoryPool!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
 
@@ -196,7 +209,9 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     delete pblocktemplate;
     mempool.clear();
 
-    // invalid (pre-p2sh) txn in mempool
+    // invalid (pre-p2sh) txn in mempool: CreateNewBlock does not check
+    // scripts again, but both spend a coinbase that is immature this early
+    // in the chain, so neither is taken and the template still connects
     tx.vin[0].prevout.hash = txFirst[0]->GetHash();
     tx.vin[0].prevout.n = 0;
     tx.vin[0].scriptSig = CScript() << OP_1;
@@ -211,6 +226,8 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+    BOOST_CHECK(TemplateConnects(pblocktemplate->block));
     delete pblocktemplate;
     mempool.clear();
 
@@ -0,0 +1,83 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "net.h"
+#include "serialize.h"
+#include "test/testutil.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CService ip(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CService(CNetAddr(s), Params().GetDefaultPort());
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(shared_message_bytes)
+{
+    // Without a socket the queued messages stay in the send queue
+    CNode dummyNode(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), "", true);
+    CTransaction tx = RandomTransaction();
+    dummyNode.PushMessage("tx", tx);
+    BOOST_REQUIRE_EQUAL(dummyNode.vSendMsg.size(), 1U);
+    const CSerializeData& data = dummyNode.vSendMsg.back().GetData();
+
+    // The same bytes as a message built for one peer
+    CSharedMessage pmsg = MakeSharedMessage("tx", tx);
+    BOOST_CHECK(*pmsg == data);
+
+    // and from an already serialized payload, with or without the checksum
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    BOOST_CHECK(*MakeSharedMessage("tx", &ss[0], &ss[0] + ss.size()) == data);
+    unsigned int nChecksum;
+    memcpy(&nChecksum, &data[CMessageHeader::CHECKSUM_OFFSET], sizeof(nChecksum));
+    BOOST_CHECK(*MakeSharedMessage("tx", &ss[0], &ss[0] + ss.size(), &nChecksum) == data);
+
+    CMessageHeader hdr;
+    CDataStream ssHeader(data.begin(), data.begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_fanout)
+{
+    CSharedMessage pmsg = MakeSharedMessage("tx", RandomTransaction());
+
+    vector<CNode*> vNodesTest;
+    for (unsigned int i = 0; i < 3; i++)
+        vNodesTest.push_back(new CNode(INVALID_SOCKET, CAddress(ip(0xa0b0c002 + i)), "", true));
+    BOOST_FOREACH(CNode* pnode, vNodesTest) {
+        pnode->PushSharedMessage(pmsg);
+        pnode->PushMessage("ping");
+    }
+
+    // Every queue holds the one buffer, and counts it in its send size
+    BOOST_CHECK_EQUAL(pmsg.use_count(), 4);
+    BOOST_FOREACH(CNode* pnode, vNodesTest) {
+        BOOST_REQUIRE_EQUAL(pnode->vSendMsg.size(), 2U);
+        BOOST_CHECK(&pnode->vSendMsg[0].GetData() == pmsg.get());
+        BOOST_CHECK(pnode->vSendMsg[0].vchData.empty());
+        BOOST_CHECK(!pnode->vSendMsg[1].pshared);
+        BOOST_CHECK_EQUAL(pnode->nSendSize, pmsg->size() + pnode->vSendMsg[1].vchData.size());
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesTest)
+        delete pnode;
+    BOOST_CHECK_EQUAL(pmsg.use_count(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "rpcjson.h"
+#include "rpcserver.h"
+#include "test/testutil.h"
+#include "util.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+static string RandomBytes(int nLen)
+{
+    string str;
+    for (int i = 0; i < nLen; i++)
+        str += (char)insecure_rand();
+    return str;
+}
+
+static Value RandomValue(int nDepth)
+{
+    switch (insecure_rand() % (nDepth > 3 ? 5 : 7))
+    {
+    case 0: return RandomBytes(insecure_rand() % 20);
+    case 1: return (int64_t)insecure_rand() * (int64_t)(insecure_rand() % 2 ? 1 : -1) * 1000003;
+    case 2: return (uint64_t)0xfffffffffffffff0ULL + insecure_rand() % 10;
+    case 3: return ((int)(insecure_rand() % 2000000) - 1000000) / 1000.0;
+    case 4: return insecure_rand() % 2 ? Value(true) : Value();
+    case 5:
+    {
+        Array arr;
+        for (int i = insecure_rand() % 5; i > 0; i--)
+            arr.push_back(RandomValue(nDepth + 1));
+        return arr;
+    }
+    default:
+    {
+        Object obj;
+        for (int i = insecure_rand() % 5; i > 0; i--)
+            obj.push_back(Pair(RandomBytes(insecure_rand() % 6), RandomValue(nDepth + 1)));
+        return obj;
+    }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(rpcjson_tests)
+
+BOOST_AUTO_TEST_CASE(rpcjson_writer_matches_write_string)
+{
+    // Any bytes, including escapes and non-ASCII, nested values and the
+    // integer and real formats
+    for (int i = 0; i < 2000; i++)
+    {
+        Value value = RandomValue(0);
+        string strJSON;
+        CJSONWriter(strJSON).Write(value);
+        BOOST_CHECK_EQUAL(strJSON, write_string(value, false));
+    }
+
+    string strJSON;
+    CJSONWriter writer(strJSON);
+    writer.BeginObject();
+    writer.Key("a").BeginArray().Int(-5).UInt(7).Bool(false).Null().EndArray();
+    writer.Key("h").HexString((const unsigned char*)"\x01\xab", (const unsigned char*)"\x01\xab" + 2);
+    writer.Key("s").String("q\"\\\n\x7f");
+    writer.Key("o").BeginObject().EndObject();
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(strJSON, "{\"a\":[-5,7,false,null],\"h\":\"01ab\",\"s\":\"q\\\"\\\\\\n\\u007F\",\"o\":{}}");
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_amounts)
+{
+    const int64_t vAmounts[] = { 0, 1, 17622195LL, 50000000LL, 100000000LL, 2099999999999990LL, 2099999999999999LL, -1, -150000000LL };
+    for (unsigned int i = 0; i < sizeof(vAmounts) / sizeof(vAmounts[0]); i++)
+    {
+        string strJSON;
+        CJSONWriter(strJSON).Amount(vAmounts[i]);
+        BOOST_CHECK_EQUAL(strJSON, write_string(ValueFromAmount(vAmounts[i]), false));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_reader_matches_read_string)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        string strJSON = write_string(RandomValue(0), false);
+        Value value;
+        BOOST_REQUIRE(ParseJSON(strJSON, value));
+        BOOST_CHECK_EQUAL(write_string(value, false), strJSON);
+    }
+
+    // Accepted and rejected the same way
+    const char* vInputs[] = {
+        " {\"method\" : \"getblock\", \"params\" : [\"00ff\", true], \"id\" : 1} \n",
+        "[1, 2.5, -3e2, \"x\\u0041\\n\\/\"]", "1.", "+5", ".5", "18446744073709551615",
+        "[", "{\"a\" 1}", "tru", "-", "[1,]", "\"abc", "18446744073709551616", "-9223372036854775809",
+    };
+    for (unsigned int i = 0; i < sizeof(vInputs) / sizeof(vInputs[0]); i++)
+    {
+        Value valueSpirit, value;
+        bool fSpirit = read_string(string(vInputs[i]), valueSpirit);
+        BOOST_CHECK_EQUAL(ParseJSON(vInputs[i], value), fSpirit);
+        if (fSpirit)
+            BOOST_CHECK_EQUAL(write_string(value, false), write_string(valueSpirit, false));
+    }
+
+    // Nesting is limited rather than left to the stack
+    Value value;
+    BOOST_CHECK(!ParseJSON(string(100000, '['), value));
+}
+
+// The streaming encoders write what the tree actors return
+BOOST_AUTO_TEST_CASE(rpcjson_stream_matches_tree)
+{
+    CTransaction txParent = RandomTransaction();
+    CTransaction txChild = RandomTransaction();
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 12345, GetTime(), 1234.56789012345, 7));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1, GetTime(), 0.000000001, 8));
+
+    for (int fVerbose = 0; fVerbose < 2; fVerbose++)
+    {
+        Array params;
+        params.push_back((bool)fVerbose);
+        string strJSON;
+        CJSONWriter writer(strJSON);
+        BOOST_REQUIRE(getrawmempool_stream(params, writer));
+        BOOST_CHECK_EQUAL(strJSON, write_string(getrawmempool(params, false), false));
+
+        params.clear();
+        params.push_back(Params().GenesisBlock().GetHash().GetHex());
+        params.push_back((bool)fVerbose);
+        strJSON.clear();
+        CJSONWriter writerBlock(strJSON);
+        BOOST_REQUIRE(getblock_stream(params, writerBlock));
+        BOOST_CHECK_EQUAL(strJSON, write_string(getblock(params, false), false));
+    }
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -161,4 +161,102 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    vector<unsigned int> v;
+    for (unsigned int i = 0; i < 100; i++)
+        v.push_back(i * 7);
+    string str = "mapped";
+    ss << v << str << VARINT(123456789);
+
+    vector<char> vch(ss.begin(), ss.end());
+    CMemoryReader reader(&vch[0], &vch[0] + vch.size(), SER_DISK, 0);
+    vector<unsigned int> v2;
+    string str2;
+    unsigned int n;
+    reader >> v2 >> str2 >> VARINT(n);
+    BOOST_CHECK(v2 == v);
+    BOOST_CHECK_EQUAL(str2, str);
+    BOOST_CHECK_EQUAL(n, 123456789U);
+    BOOST_CHECK(reader.empty());
+
+    // Reading past the end throws and leaves the buffer untouched
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    CMemoryReader reader2(&vch[0], &vch[0] + 3, SER_DISK, 0);
+    BOOST_CHECK_THROW(reader2 >> n, std::ios_base::failure);
+    BOOST_CHECK_EQUAL(reader2.size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(getandclear)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << string("payload");
+    vector<char> vchExpected(ss.begin(), ss.end());
+
+    // Into an empty buffer, the data moves over and the stream keeps the
+    // memory the buffer had
+    CSerializeData d;
+    d.reserve(1000);
+    ss.GetAndClear(d);
+    BOOST_CHECK(vector<char>(d.begin(), d.end()) == vchExpected);
+    BOOST_CHECK_EQUAL(ss.size(), 0U);
+    BOOST_CHECK(ss.capacity() >= 1000U);
+
+    // Onto a buffer that has data, it is appended
+    ss << string("payload");
+    ss.GetAndClear(d);
+    BOOST_CHECK_EQUAL(d.size(), 2 * vchExpected.size());
+
+    // Only what has not been read yet
+    ss << 'x' << string("payload");
+    char c;
+    ss >> c;
+    CSerializeData d2;
+    ss.GetAndClear(d2);
+    BOOST_CHECK(vector<char>(d2.begin(), d2.end()) == vchExpected);
+
+    // Between the secure and plain kinds, by copy
+    CSecureDataStream ssSecure(d2, SER_DISK, 0);
+    string str;
+    ssSecure >> str;
+    BOOST_CHECK_EQUAL(str, "payload");
+    ssSecure << str;
+    CSerializeData d3;
+    ssSecure.GetAndClear(d3);
+    BOOST_CHECK(vector<char>(d3.begin(), d3.end()) == vchExpected);
+    BOOST_CHECK_EQUAL(ssSecure.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(buffer_pool)
+{
+    CBufferPool& pool = CBufferPool::Instance();
+    size_t nCount = pool.GetCount();
+
+    // A pooled stream gives its buffer back, and the next one takes it
+    const char* pData;
+    {
+        CPooledDataStream ss(SER_DISK, 0);
+        ss.reserve(5000);
+        ss << string("pooled");
+        pData = &ss[0];
+    }
+    BOOST_CHECK_EQUAL(pool.GetCount(), nCount + 1);
+    {
+        CPooledDataStream ss(SER_DISK, 0);
+        BOOST_CHECK_EQUAL(ss.size(), 0U);
+        BOOST_CHECK(ss.capacity() >= 5000U);
+        ss << 'x';
+        BOOST_CHECK(&ss[0] == pData);
+        BOOST_CHECK_EQUAL(pool.GetCount(), nCount);
+    }
+
+    // Buffers too large to keep are freed
+    CSerializeData vchLarge;
+    vchLarge.reserve(CBufferPool::MAX_BUFFER_SIZE + 1);
+    pool.Release(vchLarge);
+    BOOST_CHECK_EQUAL(vchLarge.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetCount(), nCount + 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
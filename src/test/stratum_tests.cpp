@@ -0,0 +1,336 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "base58.h"
+#include "bignum.h"
+#include "checkpoints.h"
+#include "compat.h"
+#include "hash.h"
+#include "key.h"
+#include "main.h"
+#include "rpcjson.h"
+#include "stratum.h"
+#include "test/testutil.h"
+#include "util.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace json_spirit;
+using namespace std;
+
+static CBlock BuildTemplate(int algo, int nTx)
+{
+    CBlock block;
+    block.SetAlgo(algo);
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1530000000;
+    block.vtx.push_back(RandomTransaction(true));
+    for (int i = 1; i < nTx; i++)
+        block.vtx.push_back(RandomTransaction(false));
+    return block;
+}
+
+// What a miner does with the fields of mining.notify
+
+static void AppendHex(vector<unsigned char>& vch, const Value& val)
+{
+    vector<unsigned char> vchHex = ParseHex(val.get_str());
+    vch.insert(vch.end(), vchHex.begin(), vchHex.end());
+}
+
+// A big-endian hex number, as a little-endian header field
+static void AppendHexLE(vector<unsigned char>& vch, const Value& val)
+{
+    vector<unsigned char> vchHex = ParseHex(val.get_str());
+    vch.insert(vch.end(), vchHex.rbegin(), vchHex.rend());
+}
+
+static uint256 ClientHeaderHash(const Array& notify, const vector<unsigned char>& vchExtraNonce1,
+                                const vector<unsigned char>& vchExtraNonce2, uint32_t nNonce)
+{
+    vector<unsigned char> vchCoinbase = ParseHex(notify[2].get_str());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    AppendHex(vchCoinbase, notify[3]);
+    uint256 hashRoot = Hash(vchCoinbase.begin(), vchCoinbase.end());
+    BOOST_FOREACH(const Value& branch, notify[4].get_array()) {
+        vector<unsigned char> vch(hashRoot.begin(), hashRoot.end());
+        AppendHex(vch, branch);
+        hashRoot = Hash(vch.begin(), vch.end());
+    }
+
+    vector<unsigned char> vchHeader;
+    AppendHexLE(vchHeader, notify[5]);
+    vector<unsigned char> vchPrev = ParseHex(notify[1].get_str());
+    for (unsigned int i = 0; i < vchPrev.size(); i += 4)
+        reverse(vchPrev.begin() + i, vchPrev.begin() + i + 4);
+    vchHeader.insert(vchHeader.end(), vchPrev.begin(), vchPrev.end());
+    vchHeader.insert(vchHeader.end(), hashRoot.begin(), hashRoot.end());
+    AppendHexLE(vchHeader, notify[7]);
+    AppendHexLE(vchHeader, notify[6]);
+    vchHeader.insert(vchHeader.end(), (unsigned char*)&nNonce, (unsigned char*)&nNonce + 4);
+    BOOST_CHECK_EQUAL(vchHeader.size(), 80U);
+    return Hash(vchHeader.begin(), vchHeader.end());
+}
+
+// A miner's side of a connection to the server, one JSON object per line
+class CStratumTestClient
+{
+private:
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf bufRecv;
+
+public:
+    // The last mining.notify seen
+    Array notify;
+
+    CStratumTestClient(unsigned short nPort) : socket(io)
+    {
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), nPort));
+        // A server that stays silent fails the test rather than hanging it
+#ifdef WIN32
+        DWORD nTimeout = 30 * 1000;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, (const char*)&nTimeout, sizeof(nTimeout));
+#else
+        struct timeval timeout;
+        timeout.tv_sec = 30;
+        timeout.tv_usec = 0;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+    }
+
+    void Request(int nId, const string& strMethod, const Array& params)
+    {
+        Object request;
+        request.push_back(Pair("id", nId));
+        request.push_back(Pair("method", strMethod));
+        request.push_back(Pair("params", params));
+        boost::asio::write(socket, boost::asio::buffer(write_string(Value(request), false) + "\n"));
+    }
+
+    Object ReadLine()
+    {
+        boost::asio::read_until(socket, bufRecv, '\n');
+        istream is(&bufRecv);
+        string strLine;
+        getline(is, strLine);
+        Value val;
+        BOOST_REQUIRE(ParseJSON(strLine, val) && val.type() == obj_type);
+        return val.get_obj();
+    }
+
+    // The reply to a request, keeping the notifications that come before it
+    Object ReadReply(int nId)
+    {
+        while (true) {
+            Object obj = ReadLine();
+            const Value& id = find_value(obj, "id");
+            if (id.type() == int_type && id.get_int() == nId)
+                return obj;
+            if (find_value(obj, "method") == Value("mining.notify"))
+                notify = find_value(obj, "params").get_array();
+        }
+    }
+
+    void ReadNotify()
+    {
+        while (true) {
+            Object obj = ReadLine();
+            if (find_value(obj, "method") == Value("mining.notify")) {
+                notify = find_value(obj, "params").get_array();
+                return;
+            }
+        }
+    }
+};
+
+static int ErrorCode(const Object& reply)
+{
+    const Value& error = find_value(reply, "error");
+    return error.type() == array_type ? error.get_array()[0].get_int() : 0;
+}
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(stratum_prevhash)
+{
+    uint256 hash;
+    for (unsigned int i = 0; i < 32; i++)
+        *(hash.begin() + i) = i;
+    BOOST_CHECK_EQUAL(StratumPrevHash(hash), "03020100070605040b0a09080f0e0d0c13121110171615141b1a19181f1e1d1c");
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job_header)
+{
+    vector<unsigned char> vchExtraNonce1 = ParseHex("01020304");
+    vector<unsigned char> vchExtraNonce2 = ParseHex("a0b0c0d0");
+    vector<unsigned char> vchExtraNonce(vchExtraNonce1);
+    vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+
+    // Coinbase only, and odd and even transaction counts
+    for (int nTx = 1; nTx <= 8; nTx += 3) {
+        CBlock blockTemplate = BuildTemplate(ALGO_SHA256D, nTx);
+        CStratumJob job("1a", blockTemplate, 1000, blockTemplate.nTime - 600);
+        Array notify = job.GetNotifyParams(true);
+        BOOST_REQUIRE_EQUAL(notify.size(), 9U);
+        BOOST_CHECK_EQUAL(notify[0].get_str(), "1a");
+        BOOST_CHECK_EQUAL(notify[4].get_array().size(), nTx == 1 ? 0U : nTx <= 4 ? 2U : 3U);
+        BOOST_CHECK(notify[8].get_bool());
+
+        uint32_t nTime = blockTemplate.nTime + 5, nNonce = insecure_rand();
+        CTransaction txCoinbase;
+        CBlockHeader header = job.GetHeader(vchExtraNonce, nTime, nNonce, txCoinbase);
+        BOOST_CHECK_EQUAL(header.GetAlgo(), ALGO_SHA256D);
+        BOOST_CHECK(header.GetHash() == ClientHeaderHash(notify, vchExtraNonce1, vchExtraNonce2, nNonce));
+
+        // The coinbase keeps the height first, then the extranonce
+        CScript scriptPrefix = CScript() << 1000;
+        const CScript& scriptSig = txCoinbase.vin[0].scriptSig;
+        BOOST_CHECK(equal(scriptPrefix.begin(), scriptPrefix.end(), scriptSig.begin()));
+        BOOST_CHECK(search(scriptSig.begin(), scriptSig.end(), vchExtraNonce.begin(), vchExtraNonce.end()) != scriptSig.end());
+
+        CBlock block = job.GetBlock(header, txCoinbase);
+        BOOST_CHECK(block.GetHash() == header.GetHash());
+        BOOST_CHECK(block.BuildMerkleTree() == header.hashMerkleRoot);
+        BOOST_REQUIRE_EQUAL(block.vtx.size(), blockTemplate.vtx.size());
+        for (int i = 1; i < nTx; i++)
+            BOOST_CHECK(block.vtx[i].GetHash() == blockTemplate.vtx[i].GetHash());
+
+        // Another extranonce, another block
+        vchExtraNonce[7]++;
+        CTransaction txCoinbase2;
+        BOOST_CHECK(job.GetHeader(vchExtraNonce, nTime, nNonce, txCoinbase2).hashMerkleRoot != header.hashMerkleRoot);
+        vchExtraNonce[7]--;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job_equihash)
+{
+    CBlock blockTemplate = BuildTemplate(ALGO_EQUIHASH, 5);
+    blockTemplate.hashReserved = GetRandHash();
+    CStratumJob job("2", blockTemplate, 1000, blockTemplate.nTime - 600);
+    Array notify = job.GetNotifyParams(false);
+    BOOST_REQUIRE_EQUAL(notify.size(), 8U);
+    BOOST_CHECK(!notify[7].get_bool());
+
+    // The miner fills the nonce after the extranonce, and finds a solution
+    vector<unsigned char> vchNonce = ParseHex("01020304");
+    for (unsigned int i = vchNonce.size(); i < 32; i++)
+        vchNonce.push_back(insecure_rand());
+    vector<unsigned char> vchSolution(1344);
+    for (unsigned int i = 0; i < vchSolution.size(); i++)
+        vchSolution[i] = insecure_rand();
+
+    vector<unsigned char> vchHeader;
+    for (unsigned int i = 1; i <= 6; i++)
+        AppendHex(vchHeader, notify[i]);
+    vchHeader.insert(vchHeader.end(), vchNonce.begin(), vchNonce.end());
+    AppendHex(vchHeader, Value("fd4005"));
+    vchHeader.insert(vchHeader.end(), vchSolution.begin(), vchSolution.end());
+
+    uint256 nNonce256;
+    memcpy(nNonce256.begin(), &vchNonce[0], 32);
+    CBlockHeader header = job.GetEquihashHeader(nNonce256, blockTemplate.nTime, vchSolution);
+    BOOST_CHECK(header.GetHash() == Hash(vchHeader.begin(), vchHeader.end()));
+
+    CBlock block = job.GetBlock(header);
+    BOOST_CHECK(block.GetHash() == header.GetHash());
+    BOOST_CHECK(block.BuildMerkleTree() == header.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_target)
+{
+    CBigNum bnDiff1;
+    bnDiff1.SetCompact(0x1d00ffff);
+    BOOST_CHECK(StratumTarget(1, ALGO_SHA256D) == bnDiff1.getuint256());
+    BOOST_CHECK(StratumTarget(4, ALGO_SHA256D) == (bnDiff1 / 4).getuint256());
+    BOOST_CHECK(StratumTarget(0.5, ALGO_SHA256D) == (bnDiff1 * 2).getuint256());
+    // Scrypt miners count difficulty 1 as 65536 times easier
+    BOOST_CHECK(StratumTarget(65536, ALGO_SCRYPT) == bnDiff1.getuint256());
+    // Difficulty has a floor
+    BOOST_CHECK(StratumTarget(0, ALGO_SCRYPT) == (bnDiff1 * 65536 * 65536).getuint256());
+}
+
+BOOST_AUTO_TEST_CASE(stratum_session)
+{
+    // Jobs are only built outside the initial block download, which takes
+    // the tip to have been current for a while
+    bool fCheckpoints = Checkpoints::fEnabled;
+    Checkpoints::fEnabled = false;
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+    IsInitialBlockDownload();
+    SetMockTime(nNow + 60);
+    BOOST_REQUIRE(!IsInitialBlockDownload());
+
+    CKey key;
+    key.MakeNewKey(true);
+    unsigned short nPort = 20000 + insecure_rand() % 10000;
+    mapArgs["-stratumaddress"] = CBitmarkAddress(key.GetPubKey().GetID()).ToString();
+    mapArgs["-stratumport"] = itostr(nPort);
+    StartStratumServer();
+
+    {
+        CStratumTestClient client(nPort);
+        Array params;
+
+        // Shares need an authorized worker
+        client.Request(1, "mining.submit", params);
+        BOOST_CHECK_EQUAL(ErrorCode(client.ReadReply(1)), 24);
+
+        client.Request(2, "mining.subscribe", params);
+        Object reply = client.ReadReply(2);
+        BOOST_CHECK_EQUAL(ErrorCode(reply), 0);
+        const Array& subscribed = find_value(reply, "result").get_array();
+        BOOST_REQUIRE_EQUAL(subscribed.size(), 3U);
+        BOOST_CHECK_EQUAL(subscribed[1].get_str().size(), 2 * STRATUM_EXTRANONCE1_SIZE);
+        BOOST_CHECK_EQUAL(subscribed[2].get_int(), (int)STRATUM_EXTRANONCE2_SIZE);
+
+        // At the highest difficulty any share is too weak, so none makes a block
+        params.push_back("worker");
+        params.push_back(strprintf("algo=%d,d=1000000000000", ALGO_SHA256D));
+        client.Request(3, "mining.authorize", params);
+        reply = client.ReadReply(3);
+        BOOST_CHECK_EQUAL(ErrorCode(reply), 0);
+        BOOST_CHECK(find_value(reply, "result") == Value(true));
+        if (client.notify.empty())
+            client.ReadNotify();
+        BOOST_REQUIRE_EQUAL(client.notify.size(), 9U);
+        {
+            LOCK(cs_main);
+            BOOST_CHECK_EQUAL(client.notify[1].get_str(), StratumPrevHash(chainActive.Tip()->GetBlockHash()));
+        }
+
+        params.clear();
+        params.push_back("worker");
+        params.push_back("unknown");
+        params.push_back("00000000");
+        params.push_back(client.notify[7]);
+        params.push_back("00000000");
+        client.Request(4, "mining.submit", params);
+        BOOST_CHECK_EQUAL(ErrorCode(client.ReadReply(4)), 21);
+
+        params[1] = client.notify[0];
+        client.Request(5, "mining.submit", params);
+        BOOST_CHECK_EQUAL(ErrorCode(client.ReadReply(5)), 23);
+    }
+
+    StopStratumServer();
+    mapArgs.erase("-stratumaddress");
+    mapArgs.erase("-stratumport");
+    SetMockTime(0);
+    Checkpoints::fEnabled = fCheckpoints;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 
 
 #include "main.h"
+#include "sha256.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -32,6 +33,7 @@ struct TestingSetup {
 
     TestingSetup() {
         fPrintToDebugLog = false; // don't want to write to debug.log file
+        SHA256AutoDetect();
         noui_connect();
 #ifdef ENABLE_WALLET
         bitdb.MakeMock();
@@ -0,0 +1,44 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_TEST_TESTUTIL_H
+#define BITMARK_TEST_TESTUTIL_H
+
+#include "core.h"
+#include "script.h"
+#include "util.h"
+
+/** Random data shared by the unit tests and bench_bitmark */
+
+// A pay-to-pubkey-hash script to a random key id
+inline CScript RandomKeyIDScript()
+{
+    uint160 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = insecure_rand();
+    CScript script;
+    script << OP_DUP << OP_HASH160 << hash << OP_EQUALVERIFY << OP_CHECKSIG;
+    return script;
+}
+
+// A transaction with one OP_TRUE output: a coinbase with a random script, so
+// that no two are the same, or a spend of a random outpoint
+inline CTransaction RandomTransaction(bool fCoinBase = false)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    if (fCoinBase) {
+        tx.vin[0].prevout.SetNull();
+        tx.vin[0].scriptSig << (int64_t)insecure_rand() << OP_0;
+    } else {
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig << OP_1;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = insecure_rand() % 100000;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+#endif // BITMARK_TEST_TESTUTIL_H
@@ -0,0 +1,137 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "lzcompress.h"
+#include "main.h"
+#include "test/testutil.h"
+#include "undo.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Undo data for a block that spends from a handful of addresses repeatedly,
+// plus some non-standard scripts and coinbase/last-output metadata
+static void MakeBlockUndo(CBlockUndo& blockundo, int nTx)
+{
+    vector<CScript> vScripts;
+    for (int i = 0; i < 5; i++)
+        vScripts.push_back(RandomKeyIDScript());
+    CScript scriptOdd;
+    scriptOdd << OP_RETURN << vector<unsigned char>(50, 0x42);
+    vScripts.push_back(scriptOdd);
+
+    for (int i = 0; i < nTx; i++) {
+        CTxUndo txundo;
+        int nIn = 1 + insecure_rand() % 4;
+        for (int j = 0; j < nIn; j++) {
+            CTxOut txout((insecure_rand() % 100000) * CENT, insecure_rand() % 3 ? vScripts[insecure_rand() % vScripts.size()] : RandomKeyIDScript());
+            if (j % 2)
+                txundo.vprevout.push_back(CTxInUndo(txout, j == 3, 100000 + i, 1));
+            else
+                txundo.vprevout.push_back(CTxInUndo(txout));
+        }
+        blockundo.vtxundo.push_back(txundo);
+    }
+}
+
+static void CheckEqual(const CBlockUndo& a, const vector<CTxUndo>& b)
+{
+    BOOST_REQUIRE_EQUAL(a.vtxundo.size(), b.size());
+    for (unsigned int i = 0; i < b.size(); i++) {
+        BOOST_REQUIRE_EQUAL(a.vtxundo[i].vprevout.size(), b[i].vprevout.size());
+        for (unsigned int j = 0; j < b[i].vprevout.size(); j++) {
+            const CTxInUndo& x = a.vtxundo[i].vprevout[j];
+            const CTxInUndo& y = b[i].vprevout[j];
+            BOOST_CHECK(x.txout == y.txout);
+            BOOST_CHECK_EQUAL(x.fCoinBase, y.fCoinBase);
+            BOOST_CHECK_EQUAL(x.nHeight, y.nHeight);
+            if (x.nHeight > 0)
+                BOOST_CHECK_EQUAL(x.nVersion, y.nVersion);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(undo_tests)
+
+BOOST_AUTO_TEST_CASE(lz_roundtrip)
+{
+    vector<unsigned char> vchIn, vchCompressed, vchOut;
+    for (int nSize = 0; nSize < 2000; nSize += 1 + nSize / 3) {
+        // Repetitive but not constant, with random stretches
+        vchIn.clear();
+        for (int i = 0; i < nSize; i++)
+            vchIn.push_back(i % 64 < 32 ? insecure_rand() : i % 7);
+        vchCompressed.clear();
+        LZCompress(vchIn.empty() ? NULL : &vchIn[0], vchIn.empty() ? NULL : &vchIn[0] + vchIn.size(), vchCompressed);
+        BOOST_CHECK(LZDecompress(&vchCompressed[0], &vchCompressed[0] + vchCompressed.size(), vchIn.size(), vchOut));
+        BOOST_CHECK(vchOut == vchIn);
+    }
+
+    // Long runs and long matches need the length extension bytes
+    vchIn.assign(100000, 'a');
+    vchCompressed.clear();
+    LZCompress(&vchIn[0], &vchIn[0] + vchIn.size(), vchCompressed);
+    BOOST_CHECK(vchCompressed.size() < 1000);
+    BOOST_CHECK(LZDecompress(&vchCompressed[0], &vchCompressed[0] + vchCompressed.size(), vchIn.size(), vchOut));
+    BOOST_CHECK(vchOut == vchIn);
+
+    // Wrong size and truncated input are rejected
+    BOOST_CHECK(!LZDecompress(&vchCompressed[0], &vchCompressed[0] + vchCompressed.size(), vchIn.size() - 1, vchOut));
+    BOOST_CHECK(!LZDecompress(&vchCompressed[0], &vchCompressed[0] + vchCompressed.size() / 2, vchIn.size(), vchOut));
+}
+
+BOOST_AUTO_TEST_CASE(compact_undo_roundtrip)
+{
+    CBlockUndo blockundo;
+    MakeBlockUndo(blockundo, 200);
+
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << blockundo;
+
+    for (int fCompress = 0; fCompress < 2; fCompress++) {
+        vector<char> vch;
+        EncodeBlockUndo(blockundo.vtxundo, fCompress, vch);
+        // Repeated scripts become back-references
+        BOOST_CHECK(vch.size() < ssLegacy.size());
+
+        vector<CTxUndo> vtxundo;
+        DecodeBlockUndo(&vch[0], &vch[0] + vch.size(), vtxundo);
+        CheckEqual(blockundo, vtxundo);
+
+        // Truncated records fail to decode
+        BOOST_CHECK_THROW(DecodeBlockUndo(&vch[0], &vch[0] + vch.size() - 1, vtxundo), std::ios_base::failure);
+    }
+
+    // Empty block
+    vector<char> vch;
+    EncodeBlockUndo(vector<CTxUndo>(), false, vch);
+    vector<CTxUndo> vtxundo(1);
+    DecodeBlockUndo(&vch[0], &vch[0] + vch.size(), vtxundo);
+    BOOST_CHECK(vtxundo.empty());
+}
+
+BOOST_AUTO_TEST_CASE(legacy_undo_read)
+{
+    // Records written before the compact format still decode
+    CBlockUndo blockundo;
+    MakeBlockUndo(blockundo, 50);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockundo;
+    vector<CTxUndo> vtxundo;
+    DecodeBlockUndo(&ss[0], &ss[0] + ss.size(), vtxundo);
+    CheckEqual(blockundo, vtxundo);
+
+    CBlockUndo emptyundo;
+    CDataStream ssEmpty(SER_DISK, CLIENT_VERSION);
+    ssEmpty << emptyundo;
+    DecodeBlockUndo(&ssEmpty[0], &ssEmpty[0] + ssEmpty.size(), vtxundo);
+    BOOST_CHECK(vtxundo.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
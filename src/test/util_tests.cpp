@@ -341,4 +341,70 @@ BOOST_AUTO_TEST_CASE(gettime)
     BOOST_CHECK((GetTime() & ~0xFFFFFFFFLL) == 0);
 }
 
+static void LockTwice(CCriticalSection* pcs)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        LOCK(*pcs);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(util_lockstats)
+{
+    CCriticalSection cs_test;
+    ResetLockStats();
+    fLockStats = true;
+    int nLine = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        LOCK(cs_test); nLine = __LINE__;
+    }
+    {
+        TRY_LOCK(cs_test, lockTest);
+        bool fLocked = lockTest;
+        BOOST_CHECK(fLocked);
+    }
+    fLockStats = false;
+    {
+        LOCK(cs_test); // not recorded
+    }
+
+    std::vector<CLockSiteStats> vStats;
+    GetLockStats(vStats);
+    const CLockSiteStats* pstats = NULL;
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        if (vStats[i].strName == "cs_test" && vStats[i].nLine == nLine)
+            pstats = &vStats[i];
+    BOOST_REQUIRE(pstats != NULL);
+    BOOST_CHECK_EQUAL(pstats->nCount, 3U);
+    BOOST_CHECK_EQUAL(pstats->nContended, 0U);
+    uint64_t nHistogram = 0;
+    for (int i = 0; i < LOCKSTATS_BUCKETS; i++)
+        nHistogram += pstats->vHoldHistogram[i];
+    BOOST_CHECK_EQUAL(nHistogram, 3U);
+
+    int nSites = 0;
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        if (vStats[i].strName == "cs_test")
+            nSites++;
+    BOOST_CHECK_EQUAL(nSites, 2); // the LOCK loop and the TRY_LOCK
+
+    // A thread's counters survive the thread
+    fLockStats = true;
+    boost::thread threadTest(LockTwice, &cs_test);
+    threadTest.join();
+    fLockStats = false;
+    GetLockStats(vStats);
+    pstats = NULL;
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        if (vStats[i].strName == "*pcs")
+            pstats = &vStats[i];
+    BOOST_REQUIRE(pstats != NULL);
+    BOOST_CHECK_EQUAL(pstats->nCount, 2U);
+
+    ResetLockStats();
+    GetLockStats(vStats);
+    BOOST_CHECK(vStats.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
+#include "main.h"
 #include "wallet.h"
 
 #include <set>
@@ -304,4 +306,116 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(unspent_index_tests)
+{
+    CWallet w;
+    LOCK2(cs_main, w.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(w.AddKeyPubKey(key, key.GetPubKey()));
+    CTxDestination dest = key.GetPubKey().GetID();
+    CScript scriptMine;
+    scriptMine.SetDestination(dest);
+
+    // Funding transaction: output 0 is ours, output 1 is not
+    CTransaction txFund;
+    txFund.vout.resize(2);
+    txFund.vout[0].nValue = 5 * CENT;
+    txFund.vout[0].scriptPubKey = scriptMine;
+    txFund.vout[1].nValue = 7 * CENT;
+    txFund.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    w.AddToWallet(CWalletTx(&w, txFund), true);
+    const uint256 hashFund = txFund.GetHash();
+
+    set<COutPoint> setExpected;
+    setExpected.insert(COutPoint(hashFund, 0));
+    BOOST_CHECK(w.GetUnspentOutputs(dest) == setExpected);
+
+    // A spender that has not been seen in a block leaves the output indexed
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(hashFund, 0)));
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 4 * CENT;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    w.AddToWallet(CWalletTx(&w, txSpend), true);
+    BOOST_CHECK(w.GetUnspentOutputs(dest) == setExpected);
+
+    // A block on top of the tip that holds the spender
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlock block;
+    block.hashPrevBlock = pindexTip->GetBlockHash();
+    block.vtx.push_back(txSpend);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    CBlockIndex* pindex = new CBlockIndex(block); // stays in mapBlockIndex, which has no erase
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    pindex->pprev = pindexTip;
+    pindex->nHeight = pindexTip->nHeight + 1;
+
+    // Once the spender is in the active chain the output leaves the index
+    chainActive.SetTip(pindex);
+    w.SyncTransaction(txSpend.GetHash(), txSpend, &block);
+    BOOST_CHECK(w.GetUnspentOutputs(dest).empty());
+
+    vector<const CWalletTx*> vpwtx;
+    w.GetUnspentWalletTxs(vpwtx);
+    BOOST_CHECK(vpwtx.empty());
+
+    // Rebuilding from mapWallet gives the same index
+    w.ReindexUnspent();
+    BOOST_CHECK(w.GetUnspentOutputs(dest).empty());
+
+    // Disconnecting the block brings the output back, as DisconnectTip
+    // notifies the wallet of the transactions it held
+    chainActive.SetTip(pindexTip);
+    w.SyncTransaction(txSpend.GetHash(), txSpend, NULL);
+    BOOST_CHECK(w.GetUnspentOutputs(dest) == setExpected);
+    w.ReindexUnspent();
+    BOOST_CHECK(w.GetUnspentOutputs(dest) == setExpected);
+
+    // and connecting it again takes it out
+    chainActive.SetTip(pindex);
+    w.SyncTransaction(txSpend.GetHash(), txSpend, &block);
+    BOOST_CHECK(w.GetUnspentOutputs(dest).empty());
+
+    chainActive.SetTip(pindexTip);
+}
+
+BOOST_AUTO_TEST_CASE(rescan_tests)
+{
+    CBlockIndex* pindexGenesis;
+    {
+        LOCK(cs_main);
+        pindexGenesis = chainActive.Genesis();
+    }
+    BOOST_REQUIRE(pindexGenesis);
+    const CTransaction& txGenesis = Params().GenesisBlock().vtx[0];
+
+    CWallet walletScan;
+    walletScan.AddWatchOnly(txGenesis.vout[0].scriptPubKey);
+    BOOST_CHECK_EQUAL(walletScan.ScanForWalletTransactions(pindexGenesis), 1);
+    {
+        LOCK(walletScan.cs_wallet);
+        BOOST_CHECK(walletScan.mapWallet.count(txGenesis.GetHash()));
+    }
+
+    // A block that cannot be read stops the rescan rather than being skipped
+    CWallet walletFail;
+    walletFail.AddWatchOnly(txGenesis.vout[0].scriptPubKey);
+    {
+        LOCK(cs_main);
+        pindexGenesis->nStatus &= ~BLOCK_HAVE_DATA;
+    }
+    BOOST_CHECK_EQUAL(walletFail.ScanForWalletTransactions(pindexGenesis), -1);
+    {
+        LOCK(cs_main);
+        pindexGenesis->nStatus |= BLOCK_HAVE_DATA;
+    }
+    {
+        LOCK(walletFail.cs_wallet);
+        BOOST_CHECK(walletFail.mapWallet.empty());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
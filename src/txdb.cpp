@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <inttypes.h>
 
+#include <boost/thread.hpp>
+
 using namespace std;
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -75,6 +77,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256 &hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
 {
     // Obsolete; only written for backward compatibility.
@@ -93,6 +100,17 @@ bool CBlockTreeDB::WriteLastBlockFile(int nFile) {
     return Write('l', nFile);
 }
 
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it = fileInfo.begin(); it != fileInfo.end(); it++)
+        batch.Write(make_pair('f', it->first), *it->second);
+    if (nLastFile >= 0)
+        batch.Write('l', nLastFile);
+    for (std::vector<const CBlockIndex*>::const_iterator it = blockinfo.begin(); it != blockinfo.end(); it++)
+        batch.Write(make_pair('b', (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::WriteReindexing(bool fReindexing) {
     if (fReindexing)
         return Write('R', '1');
@@ -183,57 +201,134 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+namespace {
+
+/** A slice of raw 'b' records decoded by one LoadBlockIndexGuts worker */
+struct CBlockIndexDecoder
+{
+    const std::vector<std::string>* pvRaw;
+    std::vector<CDiskBlockIndex>* pvIndex;
+    std::vector<uint256>* pvHash;
+    size_t nBegin;
+    size_t nEnd;
+    std::string strError;
+
+    void operator()()
+    {
+        try {
+            for (size_t i = nBegin; i < nEnd; i++) {
+                const std::string& strRaw = (*pvRaw)[i];
+                CDataStream ssValue(strRaw.data(), strRaw.data() + strRaw.size(), SER_DISK, CLIENT_VERSION);
+                CDiskBlockIndex& diskindex = (*pvIndex)[i];
+                diskindex.SetNull();
+                ssValue >> diskindex;
+                diskindex.pauxpow.reset(); // stays on disk, see CBlockIndex::GetAuxPow()
+                (*pvHash)[i] = diskindex.GetBlockHash();
+            }
+        } catch (std::exception &e) {
+            strError = e.what();
+        }
+    }
+};
+
+} // anon namespace
+
+// Append up to nMax raw block index ('b') records from pcursor to vRaw.
+// Returns false once the cursor has moved past the last one.
+static bool ReadBlockIndexBatch(leveldb::Iterator *pcursor, std::vector<std::string>& vRaw, size_t nMax)
+{
+    while (vRaw.size() < nMax) {
+        if (!pcursor->Valid())
+            return false;
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != 'b')
+            return false; // finished loading block index
+        leveldb::Slice slValue = pcursor->value();
+        vRaw.push_back(std::string(slValue.data(), slValue.size()));
+        pcursor->Next();
+    }
+    return true;
+}
+
+// Block index records are read from LevelDB in batches; while the next batch
+// is being read, worker threads deserialize the current one (the auxpow and
+// header hashing are the expensive part). Insertion into mapBlockIndex stays
+// on this thread.
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    static const size_t nBatchSize = 16384;
+    int nThreads = std::max((int)boost::thread::hardware_concurrency(), 1);
+
     leveldb::Iterator *pcursor = NewIterator();
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    std::vector<std::string> vRaw, vRawNext;
+    std::vector<CDiskBlockIndex> vIndex(nBatchSize);
+    std::vector<uint256> vHash(nBatchSize);
+    std::vector<CBlockIndexDecoder> vDecoders(nThreads);
+    bool fOk = true;
+    vRaw.reserve(nBatchSize);
+    vRawNext.reserve(nBatchSize);
+
+
+    bool fMore = ReadBlockIndexBatch(pcursor, vRaw, nBatchSize);
+    while (!vRaw.empty())
+    {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
 
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-		pindexNew->pauxpow        = diskindex.pauxpow;
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
-            }
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        boost::thread_group decoders;
+        size_t nPerThread = (vRaw.size() + nThreads - 1) / nThreads;
+        for (int t = 0; t < nThreads; t++) {
+            CBlockIndexDecoder& decoder = vDecoders[t];
+            decoder.pvRaw = &vRaw;
+            decoder.pvIndex = &vIndex;
+            decoder.pvHash = &vHash;
+            decoder.nBegin = std::min(vRaw.size(), t * nPerThread);
+            decoder.nEnd = std::min(vRaw.size(), (t + 1) * nPerThread);
+            decoder.strError.clear();
+            if (decoder.nBegin < decoder.nEnd)
+                decoders.create_thread(boost::ref(decoder));
+        }
+        vRawNext.clear();
+        if (fMore)
+            fMore = ReadBlockIndexBatch(pcursor, vRawNext, nBatchSize);
+        decoders.join_all();
+
+        for (int t = 0; t < nThreads && fOk; t++)
+            if (!vDecoders[t].strError.empty())
+                fOk = error("%s : Deserialize or I/O error - %s", __func__, vDecoders[t].strError);
+
+        // Construct block index objects
+        for (size_t i = 0; fOk && i < vRaw.size(); i++) {
+            const CDiskBlockIndex& diskindex = vIndex[i];
+            CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nChainWork     = diskindex.nChainWork;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            if (!pindexNew->CheckIndex())
+                fOk = error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString());
         }
+        if (!fOk)
+            break;
+
+        vRaw.swap(vRawNext);
     }
     delete pcursor;
 
-    return true;
+    return fOk;
 }
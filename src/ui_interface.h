@@ -84,6 +84,9 @@ public:
     /** Block chain changed. */
     boost::signals2::signal<void ()> NotifyBlocksChanged;
 
+    /** New best block, once out of the initial block download */
+    boost::signals2::signal<void (const uint256& hash, int nHeight)> NotifyBlockTip;
+
     /** Number of network connections changed. */
     boost::signals2::signal<void (int newNumConnections)> NotifyNumConnectionsChanged;
 
@@ -0,0 +1,177 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undo.h"
+
+#include "core.h"
+#include "lzcompress.h"
+#include "serialize.h"
+#include "util.h"
+#include "version.h"
+
+#include <map>
+
+using namespace std;
+
+bool fCompressUndo = DEFAULT_COMPRESS_UNDO;
+
+/* Compact record layout:
+ *
+ *   0xff                       marker
+ *   uint8 nFormat              UNDO_FORMAT_COMPACT
+ *   uint8 nFlags               UNDO_FLAG_LZ: the body is LZ compressed and
+ *                              preceded by its VARINT uncompressed size
+ *   body:
+ *     VARINT nTx
+ *     per transaction: VARINT nIn, then per input:
+ *       VARINT nHeight * 4 + fScriptRef * 2 + fCoinBase
+ *       VARINT nVersion        only if nHeight > 0, as in CTxInUndo
+ *       VARINT CompressAmount(nValue)
+ *       VARINT nScript         if fScriptRef: the nScript'th script written
+ *                              in full earlier in this record
+ *       CScriptCompressor      otherwise
+ *
+ * An original record starts with the transaction count as a CompactSize, for
+ * which 0xff would announce a 64-bit count; so that format never starts with
+ * the marker, and old rev files keep reading as before.
+ */
+static const unsigned char UNDO_COMPACT_MARKER = 0xff;
+static const unsigned char UNDO_FORMAT_COMPACT = 1;
+static const unsigned char UNDO_FLAG_LZ = 0x01;
+
+void EncodeBlockUndo(const vector<CTxUndo>& vtxundo, bool fCompress, vector<char>& vchOut)
+{
+    CDataStream ssBody(SER_DISK, CLIENT_VERSION);
+    map<CScript, unsigned int> mapScripts;
+
+    uint64_t nTx = vtxundo.size();
+    ssBody << VARINT(nTx);
+    for (unsigned int i = 0; i < vtxundo.size(); i++) {
+        const vector<CTxInUndo>& vprevout = vtxundo[i].vprevout;
+        uint64_t nIn = vprevout.size();
+        ssBody << VARINT(nIn);
+        for (unsigned int j = 0; j < vprevout.size(); j++) {
+            const CTxInUndo& undo = vprevout[j];
+            map<CScript, unsigned int>::const_iterator it = mapScripts.find(undo.txout.scriptPubKey);
+            bool fScriptRef = it != mapScripts.end();
+
+            unsigned int nCode = undo.nHeight * 4 + (fScriptRef ? 2 : 0) + (undo.fCoinBase ? 1 : 0);
+            ssBody << VARINT(nCode);
+            if (undo.nHeight > 0) {
+                int nTxVersion = undo.nVersion;
+                ssBody << VARINT(nTxVersion);
+            }
+            uint64_t nAmount = CTxOutCompressor::CompressAmount(undo.txout.nValue);
+            ssBody << VARINT(nAmount);
+            if (fScriptRef) {
+                unsigned int nScript = it->second;
+                ssBody << VARINT(nScript);
+            } else {
+                CScript script(undo.txout.scriptPubKey);
+                ssBody << CScriptCompressor(script);
+                mapScripts.insert(make_pair(script, (unsigned int)mapScripts.size()));
+            }
+        }
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    unsigned char nFlags = 0;
+    vector<unsigned char> vchCompressed;
+    if (fCompress) {
+        const unsigned char* pbody = (const unsigned char*)&ssBody[0];
+        LZCompress(pbody, pbody + ssBody.size(), vchCompressed);
+        // Only worth it if it saves more than the size field costs
+        if (vchCompressed.size() + 4 < ssBody.size())
+            nFlags |= UNDO_FLAG_LZ;
+    }
+    ss << UNDO_COMPACT_MARKER << UNDO_FORMAT_COMPACT << nFlags;
+    if (nFlags & UNDO_FLAG_LZ) {
+        uint64_t nRawSize = ssBody.size();
+        ss << VARINT(nRawSize);
+        ss.write((const char*)&vchCompressed[0], vchCompressed.size());
+    } else {
+        ss.write(&ssBody[0], ssBody.size());
+    }
+    vchOut.assign(ss.begin(), ss.end());
+}
+
+static void DecodeCompactBody(CMemoryReader& s, vector<CTxUndo>& vtxundo)
+{
+    // Every transaction and input takes at least a byte
+    uint64_t nTx = 0;
+    s >> VARINT(nTx);
+    if (nTx > s.size())
+        throw ios_base::failure("DecodeBlockUndo : transaction count too large");
+    vtxundo.clear();
+    vtxundo.resize(nTx);
+
+    // Scripts written in full so far; the vectors they live in are not
+    // resized again, so the pointers stay valid
+    vector<const CScript*> vScripts;
+    for (unsigned int i = 0; i < vtxundo.size(); i++) {
+        vector<CTxInUndo>& vprevout = vtxundo[i].vprevout;
+        uint64_t nIn = 0;
+        s >> VARINT(nIn);
+        if (nIn > s.size())
+            throw ios_base::failure("DecodeBlockUndo : input count too large");
+        vprevout.resize(nIn);
+        for (unsigned int j = 0; j < vprevout.size(); j++) {
+            CTxInUndo& undo = vprevout[j];
+            unsigned int nCode = 0;
+            s >> VARINT(nCode);
+            undo.nHeight = nCode / 4;
+            undo.fCoinBase = nCode & 1;
+            if (undo.nHeight > 0)
+                s >> VARINT(undo.nVersion);
+            uint64_t nAmount = 0;
+            s >> VARINT(nAmount);
+            undo.txout.nValue = CTxOutCompressor::DecompressAmount(nAmount);
+            if (nCode & 2) {
+                unsigned int nScript = 0;
+                s >> VARINT(nScript);
+                if (nScript >= vScripts.size())
+                    throw ios_base::failure("DecodeBlockUndo : bad script reference");
+                undo.txout.scriptPubKey = *vScripts[nScript];
+            } else {
+                CScriptCompressor cscript(undo.txout.scriptPubKey);
+                s >> cscript;
+                vScripts.push_back(&undo.txout.scriptPubKey);
+            }
+        }
+    }
+}
+
+void DecodeBlockUndo(const char* pbegin, const char* pend, vector<CTxUndo>& vtxundo)
+{
+    if (pbegin == pend)
+        throw ios_base::failure("DecodeBlockUndo : empty record");
+
+    CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+    if ((unsigned char)*pbegin != UNDO_COMPACT_MARKER) {
+        // Written before the compact format: a serialized CBlockUndo
+        reader >> vtxundo;
+        return;
+    }
+
+    unsigned char nMarker, nFormat, nFlags;
+    reader >> nMarker >> nFormat >> nFlags;
+    if (nFormat != UNDO_FORMAT_COMPACT || (nFlags & ~UNDO_FLAG_LZ))
+        throw ios_base::failure(strprintf("DecodeBlockUndo : unknown undo format %u flags %u", nFormat, nFlags));
+
+    if (!(nFlags & UNDO_FLAG_LZ)) {
+        DecodeCompactBody(reader, vtxundo);
+        return;
+    }
+
+    uint64_t nRawSize = 0;
+    reader >> VARINT(nRawSize);
+    if (nRawSize == 0 || nRawSize > MAX_SIZE)
+        throw ios_base::failure("DecodeBlockUndo : bad uncompressed size");
+    const unsigned char* pcompressed = (const unsigned char*)(pend - reader.size());
+    vector<unsigned char> vchRaw;
+    if (!LZDecompress(pcompressed, (const unsigned char*)pend, nRawSize, vchRaw))
+        throw ios_base::failure("DecodeBlockUndo : corrupt compressed data");
+    CMemoryReader body((const char*)&vchRaw[0], (const char*)&vchRaw[0] + vchRaw.size(), SER_DISK, CLIENT_VERSION);
+    DecodeCompactBody(body, vtxundo);
+}
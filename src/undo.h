@@ -0,0 +1,29 @@
+// Copyright (c) 2018 Project Bitmark
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITMARK_UNDO_H
+#define BITMARK_UNDO_H
+
+#include <vector>
+
+class CTxUndo;
+
+/** Default for -compressundo */
+static const bool DEFAULT_COMPRESS_UNDO = false;
+
+/** LZ-compress undo records written to the rev files (when that makes them
+ * smaller). Reading handles compressed and uncompressed records either way. */
+extern bool fCompressUndo;
+
+/** Encode the undo data of a block in the compact rev file format: spent
+ * outputs are written as in the coins database, and a script that was
+ * already spent earlier in the same block is replaced by a back-reference. */
+void EncodeBlockUndo(const std::vector<CTxUndo>& vtxundo, bool fCompress, std::vector<char>& vchOut);
+
+/** Decode a rev file record in the compact format or in the original one
+ * (a plain serialized CBlockUndo). Throws std::ios_base::failure if the
+ * record is malformed. */
+void DecodeBlockUndo(const char* pbegin, const char* pend, std::vector<CTxUndo>& vtxundo);
+
+#endif // BITMARK_UNDO_H
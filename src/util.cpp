@@ -220,11 +220,115 @@ uint256 GetRandHash()
 // maybe indirectly, and you get a core dump at shutdown trying to lock
 // the mutex).
 
+// Per -debug category message counts for the current second, see -logratelimit
+struct CLogRateLimit
+{
+    int64_t nSecond;
+    int nCount;
+    int nSuppressed;
+
+    CLogRateLimit() : nSecond(0), nCount(0), nSuppressed(0) {}
+};
+
 static boost::once_flag debugPrintInitFlag = BOOST_ONCE_INIT;
 // We use boost::call_once() to make sure these are initialized in
 // in a thread-safe manner the first time it is called:
 static FILE* fileout = NULL;
 static boost::mutex* mutexDebugLog = NULL;
+static boost::mutex* mutexDebugLogFile = NULL;
+static boost::condition_variable* condDebugLog = NULL;
+static std::string* pstrDebugLogBuffer = NULL;
+static std::string* pstrDebugLogWrite = NULL;
+static boost::thread* pthreadDebugLogWriter = NULL;
+static std::map<std::string, CLogRateLimit>* pmapLogRateLimit = NULL;
+static int nLogRateLimit = 0;
+
+// LogPrintStr() only appends to pstrDebugLogBuffer under mutexDebugLog;
+// the debug.log writer thread does the file I/O, so logging from inside
+// cs_main or a node lock never waits on the disk.
+static const size_t MAX_DEBUG_LOG_BUFFER = 16 * 1024 * 1024; // drop messages beyond this
+static const size_t DEBUG_LOG_WAKE_SIZE = 64 * 1024;         // wake the writer early
+static const int DEBUG_LOG_WRITE_INTERVAL = 100;             // milliseconds
+static const int DEBUG_LOG_COMMIT_INTERVAL = 5;              // seconds between fsyncs
+static unsigned int nDebugLogDropped = 0;
+// Set at exit, once the writer thread is gone: LogPrintStr() writes itself
+static bool fDebugLogDirect = false;
+
+// Move the buffered messages to debug.log. mutexDebugLogFile keeps batches
+// in order between the writer thread and FlushDebugLog().
+static void WriteDebugLog(bool fCommit)
+{
+    static bool fUncommitted = false;
+    std::string& strWrite = *pstrDebugLogWrite;
+
+    boost::mutex::scoped_lock scoped_lock_file(*mutexDebugLogFile);
+    unsigned int nDropped;
+    bool fReopen;
+    {
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        strWrite.clear();
+        strWrite.swap(*pstrDebugLogBuffer); // hand the old capacity back to the producers
+        nDropped = nDebugLogDropped;
+        nDebugLogDropped = 0;
+        fReopen = fReopenDebugLog;
+        fReopenDebugLog = false;
+    }
+
+    // reopen the log file, if requested
+    if (fReopen) {
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) == NULL)
+            return;
+    }
+
+    if (nDropped > 0)
+        fprintf(fileout, "*** %u log messages dropped, debug.log writer fell behind ***\n", nDropped);
+    if (!strWrite.empty() || nDropped > 0) {
+        fwrite(strWrite.data(), 1, strWrite.size(), fileout);
+        fflush(fileout);
+        fUncommitted = true;
+    }
+    if (fCommit && fUncommitted) {
+        FileCommit(fileout);
+        fUncommitted = false;
+    }
+}
+
+static void ThreadDebugLogWriter()
+{
+    RenameThread("bitmark-log");
+    int64_t nLastCommit = GetTime();
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(*mutexDebugLog);
+            if (fDebugLogDirect)
+                return;
+            if (pstrDebugLogBuffer->size() < DEBUG_LOG_WAKE_SIZE)
+                condDebugLog->timed_wait(lock, boost::posix_time::milliseconds(DEBUG_LOG_WRITE_INTERVAL));
+            if (fDebugLogDirect)
+                return;
+        }
+        bool fCommit = GetTime() >= nLastCommit + DEBUG_LOG_COMMIT_INTERVAL;
+        WriteDebugLog(fCommit);
+        if (fCommit)
+            nLastCommit = GetTime();
+    }
+}
+
+// At exit: stop the writer thread, write out the buffer, and from then on
+// have every message written as it is logged (global destructors still log).
+// Nothing here is freed, as later destructors may still log.
+static void StopDebugLogWriter()
+{
+    {
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        fDebugLogDirect = true;
+    }
+    condDebugLog->notify_one();
+    pthreadDebugLogWriter->join();
+    WriteDebugLog(true);
+}
 
 static void DebugPrintInit()
 {
@@ -233,9 +337,51 @@ static void DebugPrintInit()
 
     boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
     fileout = fopen(pathDebug.string().c_str(), "a");
-    if (fileout) setbuf(fileout, NULL); // unbuffered
 
     mutexDebugLog = new boost::mutex();
+    mutexDebugLogFile = new boost::mutex();
+    condDebugLog = new boost::condition_variable();
+    pstrDebugLogBuffer = new std::string();
+    pstrDebugLogWrite = new std::string();
+    pmapLogRateLimit = new std::map<std::string, CLogRateLimit>();
+    nLogRateLimit = GetArg("-logratelimit", DEFAULT_LOG_RATE_LIMIT);
+
+    if (fileout) {
+        // Whatever is still buffered when the process exits
+        atexit(StopDebugLogWriter);
+        pthreadDebugLogWriter = new boost::thread(&ThreadDebugLogWriter);
+    }
+}
+
+void FlushDebugLog()
+{
+    if (fileout == NULL)
+        return;
+    WriteDebugLog(true);
+}
+
+static bool LogRateLimitAccept(const char* category)
+{
+    int nSuppressed = 0;
+    bool fAccept = true;
+    {
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        CLogRateLimit& limit = (*pmapLogRateLimit)[category];
+        int64_t nNow = GetTime();
+        if (limit.nSecond != nNow) {
+            nSuppressed = limit.nSuppressed;
+            limit.nSecond = nNow;
+            limit.nCount = 0;
+            limit.nSuppressed = 0;
+        }
+        if (++limit.nCount > nLogRateLimit) {
+            limit.nSuppressed++;
+            fAccept = false;
+        }
+    }
+    if (nSuppressed > 0)
+        LogPrintStr(strprintf("Suppressed %d \"%s\" log messages (-logratelimit=%d)\n", nSuppressed, category, nLogRateLimit));
+    return fAccept;
 }
 
 bool LogAcceptCategory(const char* category)
@@ -262,6 +408,13 @@ bool LogAcceptCategory(const char* category)
         if (setCategories.count(string("")) == 0 &&
             setCategories.count(string(category)) == 0)
             return false;
+
+        if (fPrintToDebugLog && !fPrintToConsole)
+        {
+            boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+            if (nLogRateLimit > 0 && !LogRateLimitAccept(category))
+                return false;
+        }
     }
     return true;
 }
@@ -282,25 +435,34 @@ int LogPrintStr(const std::string &str)
         if (fileout == NULL)
             return ret;
 
-        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
-
         // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size()-1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
+        std::string strTimestamp;
+        if (fLogTimestamps)
+            strTimestamp = DateTimeStrFormat("%Y-%m-%d %H:%M:%S ", GetTime());
 
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        bool fWake, fDirect;
+        {
+            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+            std::string& strBuffer = *pstrDebugLogBuffer;
+            if (strBuffer.size() + strTimestamp.size() + str.size() > MAX_DEBUG_LOG_BUFFER) {
+                nDebugLogDropped++;
+                return ret;
+            }
+            if (fStartedNewLine)
+                strBuffer += strTimestamp;
+            strBuffer += str;
+            if (!str.empty() && str[str.size()-1] == '\n')
+                fStartedNewLine = true;
+            else
+                fStartedNewLine = false;
+            fWake = strBuffer.size() >= DEBUG_LOG_WAKE_SIZE;
+            fDirect = fDebugLogDirect;
+        }
+        if (fDirect)
+            WriteDebugLog(false);
+        else if (fWake)
+            condDebugLog->notify_one();
+        ret = str.size();
     }
 
     return ret;
@@ -943,6 +1105,7 @@ void PrintExceptionContinue(std::exception* pex, const char* pszThread)
     LogPrintf("\n\n************************\n%s\n", message);
     fprintf(stderr, "\n\n************************\n%s\n", message.c_str());
     strMiscWarning = message;
+    FlushDebugLog();
 }
 
 boost::filesystem::path GetDefaultDataDir()
@@ -1125,6 +1288,14 @@ bool TruncateFile(FILE *file, unsigned int length) {
 #endif
 }
 
+// tell the OS the file will be read front to back, so it reads ahead aggressively
+// and drops pages behind the reader; advisory only
+void FileAdviseSequential(FILE *file) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
 /**
  * this function tries to raise the file descriptor limit to the most that we can support.
  * It returns the actual file descriptor limit (which may be more or less than nMinFD).
@@ -105,6 +105,9 @@ extern bool fNoListen;
 extern bool fLogTimestamps;
 extern volatile bool fReopenDebugLog;
 
+// -logratelimit default: messages per second per -debug category (0 = unlimited)
+static const int DEFAULT_LOG_RATE_LIMIT = 1000;
+
 void RandAddSeed();
 void RandAddSeedPerfmon();
 void SetupEnvironment();
@@ -113,6 +116,8 @@ void SetupEnvironment();
 bool LogAcceptCategory(const char* category);
 /* Send a string to the log output */
 int LogPrintStr(const std::string &str);
+/* Write out and fsync everything LogPrintStr() has buffered */
+void FlushDebugLog();
 
 #define strprintf tfm::format
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
@@ -175,6 +180,7 @@ bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 void FileCommit(FILE *fileout);
 bool TruncateFile(FILE *file, unsigned int length);
+void FileAdviseSequential(FILE *file);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
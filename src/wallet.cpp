@@ -9,9 +9,14 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "init.h"
 #include "net.h"
 
+#include <deque>
+
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <openssl/rand.h>
 
 using namespace std;
@@ -355,6 +360,8 @@ void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
+
+    UpdateUnspent(outpoint);
 }
 
 
@@ -369,6 +376,102 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+// An output stays in the unspent index while it is ours and no spending
+// wallet transaction is in the active chain. Spenders that are only in the
+// mempool (or conflicted) leave it in place and IsSpent() decides at query time.
+// A spender's depth only changes when its block is connected or disconnected,
+// and SyncTransaction then re-evaluates the outputs it spends.
+void CWallet::UpdateUnspent(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main);
+    bool fUnspent = false;
+    CTxDestination dest = CNoDestination();
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi != mapWallet.end() && outpoint.n < mi->second.vout.size())
+    {
+        const CTxOut& txout = mi->second.vout[outpoint.n];
+        if (IsMine(txout) != ISMINE_NO)
+        {
+            fUnspent = true;
+            ExtractDestination(txout.scriptPubKey, dest);
+            pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+            for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+            {
+                std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+                if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+                {
+                    fUnspent = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    UnspentOutputs::iterator it = mapUnspentOutputs.find(outpoint);
+    if (it != mapUnspentOutputs.end() && (!fUnspent || !(it->second == dest)))
+    {
+        std::map<CTxDestination, std::set<COutPoint> >::iterator itDest = mapUnspentByDestination.find(it->second);
+        if (itDest != mapUnspentByDestination.end())
+        {
+            itDest->second.erase(outpoint);
+            if (itDest->second.empty())
+                mapUnspentByDestination.erase(itDest);
+        }
+        mapUnspentOutputs.erase(it);
+        it = mapUnspentOutputs.end();
+    }
+    if (fUnspent && it == mapUnspentOutputs.end())
+    {
+        mapUnspentOutputs.insert(make_pair(outpoint, dest));
+        mapUnspentByDestination[dest].insert(outpoint);
+    }
+}
+
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        UpdateUnspent(COutPoint(hash, i));
+    if (!wtx.IsCoinBase())
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            UpdateUnspent(txin.prevout);
+}
+
+void CWallet::ReindexUnspent()
+{
+    LOCK2(cs_main, cs_wallet);
+    mapUnspentOutputs.clear();
+    mapUnspentByDestination.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (unsigned int i = 0; i < it->second.vout.size(); i++)
+            UpdateUnspent(COutPoint(it->first, i));
+}
+
+void CWallet::GetUnspentWalletTxs(std::vector<const CWalletTx*>& vpwtx) const
+{
+    AssertLockHeld(cs_wallet);
+    vpwtx.clear();
+    uint256 hashLast = 0;
+    for (UnspentOutputs::const_iterator it = mapUnspentOutputs.begin(); it != mapUnspentOutputs.end(); ++it)
+    {
+        if (it->first.hash == hashLast)
+            continue;
+        hashLast = it->first.hash;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashLast);
+        if (mi != mapWallet.end())
+            vpwtx.push_back(&mi->second);
+    }
+}
+
+std::set<COutPoint> CWallet::GetUnspentOutputs(const CTxDestination& dest) const
+{
+    AssertLockHeld(cs_wallet);
+    std::map<CTxDestination, std::set<COutPoint> >::const_iterator it = mapUnspentByDestination.find(dest);
+    if (it == mapUnspentByDestination.end())
+        return std::set<COutPoint>();
+    return it->second;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -505,6 +608,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        UpdateUnspent(mapWallet[hash]);
     }
     else
     {
@@ -589,6 +693,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             }
         }
 
+        // Our outputs, and the outputs this spends once it is in a block
+        UpdateUnspent(wtx);
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -684,9 +791,21 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     if (!fFileBacked)
         return;
     {
-        LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        LOCK2(cs_main, cs_wallet);
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            std::vector<COutPoint> vAffected;
+            for (unsigned int i = 0; i < mi->second.vout.size(); i++)
+                vAffected.push_back(COutPoint(hash, i));
+            if (!mi->second.IsCoinBase())
+                BOOST_FOREACH(const CTxIn& txin, mi->second.vin)
+                    vAffected.push_back(txin.prevout);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+            BOOST_FOREACH(const COutPoint& outpoint, vAffected)
+                UpdateUnspent(outpoint);
+        }
     }
     return;
 }
@@ -886,47 +1005,284 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+void CWallet::GetScanKeys(CWalletScanKeys& keys) const
+{
+    GetKeys(keys.setKeyIDs);
+    {
+        LOCK(cs_KeyStore);
+        keys.mapScripts = mapScripts;
+        keys.setWatchOnly = setWatchOnly;
+    }
+}
+
+namespace {
+
+/** One block of a rescan, read and matched ahead of the wallet by a CWalletRescan worker */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    // Taken from pindex under cs_main, for the workers that run without it
+    uint256 hash;
+    CDiskBlockPos pos;
+    bool fHaveData;
+    CBlock block;
+    std::vector<bool> vfMine; // per transaction: pays to a key in the scan snapshot
+    bool fRead;
+    bool fClaimed;
+    bool fDone;
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), hash(pindexIn->GetBlockHash()), pos(pindexIn->GetBlockPos()),
+        fHaveData(pindexIn->nStatus & BLOCK_HAVE_DATA), fRead(false), fClaimed(false), fDone(false) {}
+};
+
+/** Read-ahead for ScanForWalletTransactions. Blocks are queued in chain
+ * order; worker threads read them from disk and test their outputs against
+ * a CWalletScanKeys snapshot without holding cs_main or cs_wallet, while the
+ * caller takes them back in order to add to the wallet.
+ */
+class CWalletRescan
+{
+private:
+    const CWalletScanKeys& keys;
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::deque<boost::shared_ptr<CRescanBlock> > queue;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void ThreadRead()
+    {
+        while (true)
+        {
+            boost::shared_ptr<CRescanBlock> job;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !job)
+                {
+                    for (unsigned int i = 0; i < queue.size(); i++)
+                        if (!queue[i]->fClaimed) {
+                            job = queue[i];
+                            break;
+                        }
+                    if (!job)
+                        condWork.wait(lock);
+                }
+                if (fStop)
+                    return;
+                job->fClaimed = true;
+            }
+
+            job->fRead = job->fHaveData && ReadBlockFromDisk(job->block, job->pos) && job->block.GetHash() == job->hash;
+            if (job->fRead)
+            {
+                // Also caches the transaction hashes for the in-order stage and SetMerkleBranch
+                job->block.BuildMerkleTree();
+                job->vfMine.resize(job->block.vtx.size(), false);
+                for (unsigned int i = 0; i < job->block.vtx.size(); i++)
+                    BOOST_FOREACH(const CTxOut& txout, job->block.vtx[i].vout)
+                        if (::IsMine(keys, txout.scriptPubKey) != ISMINE_NO) {
+                            job->vfMine[i] = true;
+                            break;
+                        }
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                job->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+public:
+    CWalletRescan(const CWalletScanKeys& keysIn, int nThreads) : keys(keysIn), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletRescan::ThreadRead, this));
+    }
+
+    ~CWalletRescan()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condWork.notify_all();
+        threadGroup.join_all();
+    }
+
+    size_t Size()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    // requires cs_main
+    void Push(CBlockIndex* pindex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(boost::shared_ptr<CRescanBlock>(new CRescanBlock(pindex)));
+        }
+        condWork.notify_one();
+    }
+
+    // Wait for the oldest queued block and remove it from the queue; NULL once the queue is empty
+    boost::shared_ptr<CRescanBlock> Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.empty())
+            return boost::shared_ptr<CRescanBlock>();
+        boost::shared_ptr<CRescanBlock> job = queue.front();
+        while (!job->fDone)
+            condDone.wait(lock);
+        queue.pop_front();
+        return job;
+    }
+
+    // Drop the read-ahead, e.g. after a reorg. Blocks being read finish into the void.
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.clear();
+    }
+};
+
+} // anon namespace
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and matched against a snapshot of our keys by
+// -rescanthreads workers; cs_main and cs_wallet are only held while one
+// block at a time is added to the wallet, in chain order. Progress is
+// checkpointed to the wallet file so an interrupted rescan resumes on the
+// next start (see AppInit2). If a block cannot be read, the rescan stops
+// before it, and -1 is returned; the checkpoint is not moved past it.
+//
+// Rescans run one at a time: each one checkpoints its own progress.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    LOCK(cs_rescan);
     int ret = 0;
     int64_t nNow = GetTime();
+    int64_t nLastCheckpoint = nNow;
+
+    CWalletScanKeys keys;
+    GetScanKeys(keys);
+
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads = std::max((int)boost::thread::hardware_concurrency(), 1);
+    const size_t nReadAhead = 16 * nThreads;
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_main);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+        if (pindex && fFileBacked)
+            CWalletDB(strWalletFile).WriteRescanProgress(chainActive.GetLocator(pindex));
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    bool fInterrupted = false;
+    bool fFailed = false;
+    {
+        CWalletRescan rescan(keys, nThreads);
+        while (true)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            // Keep the readers busy ahead of the wallet
+            if (pindex && rescan.Size() < nReadAhead)
+            {
+                LOCK(cs_main);
+                while (pindex && rescan.Size() < nReadAhead)
+                {
+                    CBlockIndex* pindexNext = chainActive.Next(pindex);
+                    if (pindex->nStatus & BLOCK_HAVE_DATA) {
+                        // Blocks are mostly stored in chain order, so have the
+                        // kernel read up to the next one before a worker asks
+                        unsigned int nBytes = MAX_BLOCK_SIZE;
+                        if (pindexNext && pindexNext->nFile == pindex->nFile && pindexNext->nDataPos > pindex->nDataPos)
+                            nBytes = std::min(nBytes, pindexNext->nDataPos - pindex->nDataPos);
+                        PrefetchBlockFile(pindex->GetBlockPos(), "blk", nBytes);
+                    }
+                    rescan.Push(pindex);
+                    pindex = pindexNext;
+                }
+            }
+
+            boost::shared_ptr<CRescanBlock> job = rescan.Pop();
+            if (!job)
+                break;
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
+                LOCK2(cs_main, cs_wallet);
+                if (!chainActive.Contains(job->pindex))
+                {
+                    // Reorganized while queued: continue from the fork with the new branch
+                    rescan.Clear();
+                    CBlockIndex* pindexFork = job->pindex;
+                    while (pindexFork && !chainActive.Contains(pindexFork))
+                        pindexFork = pindexFork->pprev;
+                    pindex = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis();
+                    continue;
+                }
+
+                if (!job->fRead)
+                {
+                    LogPrintf("ScanForWalletTransactions : failed to read block %s at height %d, rescan aborted\n",
+                              job->hash.ToString(), job->pindex->nHeight);
+                    fFailed = true;
+                    break;
+                }
+                const CBlock& block = job->block;
+                for (unsigned int i = 0; i < job->vfMine.size(); i++)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    const uint256& hash = block.GetTxHash(i);
+
+                    // Only outputs depend on the keys; spends and conflicts
+                    // depend on what was added from earlier blocks
+                    bool fRelevant = job->vfMine[i] || mapWallet.count(hash);
+                    for (unsigned int j = 0; !fRelevant && j < tx.vin.size(); j++)
+                        fRelevant = mapWallet.count(tx.vin[j].prevout.hash) || mapTxSpends.count(tx.vin[j].prevout);
+                    if (fRelevant && AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
+                        ret++;
+                }
+
+                if (job->pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(job->pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", job->pindex->nHeight, Checkpoints::GuessVerificationProgress(job->pindex));
+                }
+                if (fFileBacked && (GetTime() >= nLastCheckpoint + 10 || ShutdownRequested())) {
+                    nLastCheckpoint = GetTime();
+                    CWalletDB(strWalletFile).WriteRescanProgress(chainActive.GetLocator(job->pindex));
+                }
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+
+            if (ShutdownRequested()) {
+                fInterrupted = true;
+                LogPrintf("Rescan interrupted at block %d, it will resume on the next start\n", job->pindex->nHeight);
+                break;
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
-    return ret;
+    if (!fInterrupted && !fFailed && fFileBacked)
+        CWalletDB(strWalletFile).EraseRescanProgress();
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    return fFailed ? -1 : ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -1027,9 +1383,10 @@ int64_t CWallet::GetBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1043,9 +1400,10 @@ int64_t CWallet::GetUnconfirmedBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1058,9 +1416,10 @@ int64_t CWallet::GetImmatureBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1072,9 +1431,10 @@ int64_t CWallet::GetWatchOnlyBalance() const
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1088,9 +1448,10 @@ int64_t CWallet::GetUnconfirmedWatchOnlyBalance() const
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1103,9 +1464,10 @@ int64_t CWallet::GetImmatureWatchOnlyBalance() const
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vpwtx;
+        GetUnspentWalletTxs(vpwtx);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpwtx)
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -1119,29 +1481,36 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
     	LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Walk the unspent index; outputs of one transaction are adjacent
+        UnspentOutputs::const_iterator it = mapUnspentOutputs.begin();
+        while (it != mapUnspentOutputs.end())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256 wtxid = it->first.hash;
+            UnspentOutputs::const_iterator itEnd = it;
+            while (itEnd != mapUnspentOutputs.end() && itEnd->first.hash == wtxid)
+                ++itEnd;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
+            std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+            if (mi == mapWallet.end())
+            {
+                it = itEnd;
                 continue;
+            }
+            const CWalletTx* pcoin = &(*mi).second;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            int nDepth = -1;
+            if (IsFinalTx(*pcoin) && (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0))
+                nDepth = pcoin->GetDepthInMainChain();
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            for (; it != itEnd; ++it) {
+                if (nDepth < 0)
+                    continue;
+                unsigned int i = it->first.n;
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
             }
         }
@@ -1594,7 +1963,11 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (!fFileBacked)
         return DB_LOAD_OK;
     fFirstRunRet = false;
-    DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    DBErrors nLoadWalletRet;
+    {
+        LOCK(cs_main); // the unspent index looks up spenders in the chain
+        nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    }
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1855,29 +2228,30 @@ std::map<CTxDestination, int64_t> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        std::map<CTxDestination, std::set<COutPoint> >::const_iterator itDest;
+        for (itDest = mapUnspentByDestination.begin(); itDest != mapUnspentByDestination.end(); ++itDest)
         {
-            CWalletTx *pcoin = &walletEntry.second;
-
-            if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
+            const CTxDestination& addr = itDest->first;
+            if (boost::get<CNoDestination>(&addr))
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            BOOST_FOREACH(const COutPoint& outpoint, itDest->second)
+            {
+                const CWalletTx *pcoin = GetWalletTx(outpoint.hash);
+                if (!pcoin)
+                    continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
-                continue;
+                if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
+                if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
                     continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
+
+                int nDepth = pcoin->GetDepthInMainChain();
+                if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
                     continue;
 
-                int64_t n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
+                int64_t n = IsSpent(outpoint.hash, outpoint.n) ? 0 : pcoin->vout[outpoint.n].nValue;
 
                 if (!balances.count(addr))
                     balances[addr] = 0;
@@ -2129,7 +2503,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && chainActive.Contains(blit->second)) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
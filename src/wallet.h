@@ -32,6 +32,8 @@ extern bool bSpendZeroConfChange;
 static const int64_t DEFAULT_TRANSACTION_FEE = 0;
 // -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
 static const int nHighTransactionFeeWarning = 0.01 * COIN;
+// -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -95,6 +97,35 @@ public:
     StringMap destdata;
 };
 
+/** Copy of the key IDs, redeem scripts and watch-only scripts of a wallet,
+ * without any secrets. IsMine() against it takes no wallet locks, so rescan
+ * workers can match block outputs in parallel with the wallet in use.
+ */
+class CWalletScanKeys : public CKeyStore
+{
+public:
+    std::set<CKeyID> setKeyIDs;
+    ScriptMap mapScripts;
+    WatchOnlySet setWatchOnly;
+
+    bool AddKeyPubKey(const CKey &key, const CPubKey &pubkey) { return false; }
+    bool HaveKey(const CKeyID &address) const { return setKeyIDs.count(address) > 0; }
+    bool GetKey(const CKeyID &address, CKey& keyOut) const { return false; }
+    void GetKeys(std::set<CKeyID> &setAddress) const { setAddress = setKeyIDs; }
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID &hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
+    {
+        ScriptMap::const_iterator mi = mapScripts.find(hash);
+        if (mi == mapScripts.end())
+            return false;
+        redeemScriptOut = (*mi).second;
+        return true;
+    }
+    bool AddWatchOnly(const CScript &dest) { return false; }
+    bool HaveWatchOnly(const CScript &dest) const { return setWatchOnly.count(dest) > 0; }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -124,6 +155,16 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Index of wallet outputs that may still be unspent: IsMine outputs with
+    // no spending wallet transaction in the active chain. Balance and coin
+    // selection walk this instead of all of mapWallet and still apply
+    // IsSpent() to every candidate.
+    typedef std::map<COutPoint, CTxDestination> UnspentOutputs;
+    UnspentOutputs mapUnspentOutputs;
+    std::map<CTxDestination, std::set<COutPoint> > mapUnspentByDestination;
+    void UpdateUnspent(const COutPoint& outpoint);
+    void UpdateUnspent(const CWalletTx& wtx);
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -131,6 +172,8 @@ public:
     ///      fFileBacked (immutable after instantiation)
     ///      strWalletFile (immutable after instantiation)
     mutable CCriticalSection cs_wallet;
+    /// Held by ScanForWalletTransactions, taken before cs_main and cs_wallet
+    CCriticalSection cs_rescan;
 
     bool fFileBacked;
     std::string strWalletFile;
@@ -192,6 +235,13 @@ public:
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
+    /** Rebuild the unspent output index from mapWallet (needed after IsMine changes, e.g. key import) */
+    void ReindexUnspent();
+    /** Wallet transactions that have at least one output in the unspent index */
+    void GetUnspentWalletTxs(std::vector<const CWalletTx*>& vpwtx) const;
+    /** Candidate unspent outputs paying to one destination */
+    std::set<COutPoint> GetUnspentOutputs(const CTxDestination& dest) const;
+
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -256,7 +306,9 @@ public:
     void SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    // Returns the number of transactions added or updated, -1 if a block could not be read
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    void GetScanKeys(CWalletScanKeys& keys) const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64_t GetBalance() const;
@@ -100,6 +100,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteRescanProgress(const CBlockLocator& locator);
+    bool ReadRescanProgress(CBlockLocator& locator);
+    bool EraseRescanProgress();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);